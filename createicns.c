@@ -41,41 +41,218 @@
 // This tool is similar to running 'iconutil -c icns x.iconset', except it
 // doesn't change the PNG images in any way.
 
+#if defined(__linux__)
+#define _GNU_SOURCE  // For fallocate().
+#endif
+
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <libgen.h>
+#include <spawn.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include <sys/clonefile.h>
+#elif defined(__linux__)
+#include <linux/fs.h>
+#endif
+
+#include <zlib.h>
+
+#include "hash.h"
+#include "jobs.h"
+#include "legacy.h"
+#include "png.h"
+#include "resize.h"
+
+extern char** environ;
 
 // Magic values for headers were found at
 // https://en.wikipedia.org/wiki/Apple_Icon_Image_format.
 
 enum kBufferSize { kBufferSize = 1024 };
+enum kTarBlockSize { kTarBlockSize = 512 };
+enum kMaxTarExtensionSize { kMaxTarExtensionSize = 64 * 1024 };
+enum kMaxStripChunks { kMaxStripChunks = 32 };
+enum kMaxProfiles { kMaxProfiles = 8 };
+enum kMaxProfileTypes { kMaxProfileTypes = 32 };
+enum kShiftBlockSize { kShiftBlockSize = 1024 * 1024 };
 static const char kIconsetExtension[] = ".iconset";
 static const char kIcnsExtension[] = ".icns";
+static const char kIcoExtension[] = ".ico";
 static const char kUnknownFormatFilename[] = "icon_data_";
+static const char kStandardStreamPath[] = "-";
 static const uint32_t kMagicHeader = 'icns';
+// Seed for the second half of cache keys and icon hashes.
+static const uint64_t kSecondKeySeed = 0x69636e73;
+// Changes whenever the way .icns files are put together changes, so old
+// cache entries aren't used anymore.
+static const char kCacheVersion[] = "createicns cache 1";
+static const char kOptimizeCacheVersion[] = "createicns optimize 1";
+static const char kPngExtension[] = ".png";
+
+// Every PNG starts with an 8 byte signature followed by the IHDR chunk, which
+// holds the width and height at offsets 16 and 20.
+enum kPngHeaderSize { kPngHeaderSize = 24 };
+static const uint8_t kPngSignature[] = {0x89, 'P', 'N', 'G', '\r', '\n',
+                                        0x1a, '\n'};
+static const uint32_t kImageDataChunk = 'IDAT';
+static const uint32_t kImageEndChunk = 'IEND';
+// Metadata chunks that --strip removes when not given a list.
+static const char kDefaultStripChunks[] = "tEXt,iTXt,zTXt,tIME,eXIf";
 
 struct {
   const char* icon_filename;
   uint32_t icon_type;
+  // Width and height of the image in pixels.
+  uint32_t pixel_size;
+  bool retina;
 } static const kIconTypes[] = {
-    {"icon_16x16.png", 'icp4'},
-    {"icon_16x16@2x.png", 'ic11'},
-    {"icon_32x32.png", 'icp5'},
-    {"icon_32x32@2x.png", 'ic12'},
-    {"icon_64x64.png", 'icp6'},
-    {"icon_128x128.png", 'ic07'},
-    {"icon_128x128@2x.png", 'ic13'},
-    {"icon_256x256.png", 'ic08'},
-    {"icon_256x256@2x.png", 'ic14'},
-    {"icon_512x512.png", 'ic09'},
-    {"icon_512x512@2x.png", 'ic10'}
+    {"icon_16x16.png", 'icp4', 16, false},
+    {"icon_16x16@2x.png", 'ic11', 32, true},
+    {"icon_32x32.png", 'icp5', 32, false},
+    {"icon_32x32@2x.png", 'ic12', 64, true},
+    {"icon_64x64.png", 'icp6', 64, false},
+    {"icon_128x128.png", 'ic07', 128, false},
+    {"icon_128x128@2x.png", 'ic13', 256, true},
+    {"icon_256x256.png", 'ic08', 256, false},
+    {"icon_256x256@2x.png", 'ic14', 512, true},
+    {"icon_512x512.png", 'ic09', 512, false},
+    {"icon_512x512@2x.png", 'ic10', 1024, true}
 };
 
+// How to pick between a regular and an @2x icon type when a detected image
+// size fits both, like 64x64 for icon_64x64.png and icon_32x32@2x.png.
+typedef enum {
+  kRetinaPrefer1x,
+  kRetinaPrefer2x,
+  kRetinaBoth
+} RetinaPolicy;
+
+// An extra .icns file written from the same icons, with some types left out.
+typedef struct {
+  const char* path;
+  // Leave the types out instead of keeping only them.
+  bool exclude;
+  uint32_t types[kMaxProfileTypes];
+  size_t type_count;
+} Profile;
+
+typedef struct {
+  // Write the output through a preallocated, memory mapped file instead of a
+  // stream of small writes.
+  bool mmap_output;
+  // Number of threads used to fill a memory mapped output file.
+  int jobs;
+  // Path of the .icns file to write, or "-" for standard output. Derived from
+  // the iconset name when not set.
+  const char* output_path;
+  // Derive the icon type of files without a known name from their PNG size.
+  bool detect_types;
+  RetinaPolicy retina_policy;
+  // Directory of a cache of .icns files, keyed by the icons that went in.
+  const char* cache_path;
+  // Ancillary PNG chunks to leave out when copying PNGs.
+  uint32_t strip_chunks[kMaxStripChunks];
+  size_t strip_chunk_count;
+  // Check the CRC of every PNG chunk while copying.
+  bool verify;
+  // Also inflate the image data, which checks the zlib stream and its
+  // Adler-32 checksum.
+  bool verify_image_data;
+  // Deflate the image data of PNGs again at the highest level, keeping the
+  // result when it is smaller.
+  bool recompress;
+  // Write interlaced PNGs without interlacing when recompressing them.
+  bool deinterlace;
+  // Store PNGs with a palette, without alpha or with fewer bits per sample
+  // when that doesn't change any pixel.
+  bool reduce;
+  // Shell command that optimizes the PNG file named by its last argument in
+  // place.
+  const char* optimize_command;
+  // Directory where the results of the command are kept, keyed by the PNG
+  // that went in. Empty when they aren't kept.
+  char optimize_cache_path[MAXPATHLEN];
+  // Scale the largest icon down to every size that is missing.
+  bool generate;
+  ResizeFilter generate_filter;
+  // Add the old RGB and mask icon types, like is32 and s8mk.
+  bool legacy;
+  // Add the ARGB icon types ic04 and ic05.
+  bool argb;
+  // Also write the PNG icons from 16 to 256 pixels as a Windows .ico file.
+  const char* ico_path;
+  // Also write a PNG of every size to this directory, for the web.
+  const char* web_path;
+  // Also write these .icns files with a subset of the icons.
+  Profile profiles[kMaxProfiles];
+  size_t profile_count;
+  // Also write the .icns file as a C array to this path plus .h and .c.
+  const char* embed_path;
+  // Also write the .icns file to this ELF object file.
+  const char* object_path;
+  // Replace the icon of the type this file is named after in an existing
+  // .icns file, or add it if there is none.
+  const char* update_path;
+  // Remove the icon of this type, or with this name in an iconset, from an
+  // existing .icns file.
+  const char* remove_name;
+} Options;
+
+// An icon that will be written to the .icns file. The offset is only known
+// once the layout of the whole file has been planned.
+typedef struct {
+  uint32_t icon_type;
+  char* icon_path;
+  uint32_t size;
+  uint32_t offset;
+  // The icon after transforming it in memory, or NULL when it is copied from
+  // icon_path.
+  uint8_t* data;
+  // Whether data points into memory the icon doesn't own, like the file_data
+  // of the list.
+  bool shared;
+} Icon;
+
+typedef struct {
+  Icon* icons;
+  size_t count;
+  size_t capacity;
+  // A whole input file that icons point into, like an .ico file.
+  uint8_t* file_data;
+} IconList;
+
+// The .icns file being written. Output that can't seek back to fill in the
+// total size (a pipe) is collected in a temporary file and copied out when
+// closing.
+typedef struct {
+  FILE* file;
+  FILE* destination;
+} IcnsOutput;
+
+// A member of a tar stream, see
+// https://pubs.opengroup.org/onlinepubs/9699919799/utilities/pax.html
+typedef struct {
+  char name[MAXPATHLEN];
+  uint64_t size;
+  char type;
+} TarMember;
+
 void PrintError(const char* error) {
   fprintf(stderr, "Error: %s\n", error);
 }
@@ -85,12 +262,77 @@ void PrintSystemError() {
 }
 
 void PrintUsage(const char* own_path) {
-  fprintf(stderr, "Usage: %s [iconset]\n", own_path);
+  fprintf(stderr,
+          "Usage: %s [options] [iconset]\n"
+          "Use - as iconset to read a tar stream of the iconset from standard "
+          "input.\n"
+          "Options:\n"
+          "  -o, --output=F  Write the .icns file to F, - for standard "
+          "output\n"
+          "  -I, --ico=F     Also write the icons from 16 to 256 pixels to "
+          "the .ico file F\n"
+          "  -W, --web=DIR   Also write a PNG of every size to DIR\n"
+          "  -p, --profile=F:L\n"
+          "                  Also write the .icns file F with only the icon "
+          "types in the\n"
+          "                  comma separated list L, or without them if L "
+          "starts with -\n"
+          "  -E, --embed=P   Also write the .icns file as a C array with a "
+          "table of its\n"
+          "                  icons to P.h and P.c\n"
+          "  -b, --object=F  Also write the .icns file and the table to "
+          "the ELF object\n"
+          "                  file F\n"
+          "  -U, --update=F  Replace or add the icon in file F, named like in "
+          "an iconset,\n"
+          "                  in the given .icns file instead of creating one\n"
+          "  -X, --remove=T  Remove the icon of type T from the given .icns "
+          "file\n"
+          "  -d, --detect    Detect the icon type of other PNGs from their "
+          "size\n"
+          "  -r, --retina=P  Type for sizes that fit a regular and an @2x "
+          "icon:\n"
+          "                  1x (default), 2x or both\n"
+          "  -c, --cache=DIR Reuse .icns files from a cache in DIR for "
+          "iconsets with the\n"
+          "                  same icons\n"
+          "  -s, --strip[=L] Leave the PNG chunks in the comma separated list "
+          "L out,\n"
+          "                  by default %s\n"
+          "  -V, --verify[=full]\n"
+          "                  Check the CRC of every PNG chunk, and with full "
+          "the zlib\n"
+          "                  stream of the image data\n"
+          "  -z, --recompress[=deinterlace]\n"
+          "                  Deflate the image data of PNGs again, harder, "
+          "and keep the\n"
+          "                  result if it is smaller\n"
+          "  -R, --reduce    Store PNGs as greyscale, RGB or with a palette "
+          "when that\n"
+          "                  keeps every pixel the same\n"
+          "  -O, --optimize-with=C\n"
+          "                  Run shell command C on a copy of every PNG, "
+          "with the file\n"
+          "                  as last argument, and keep the result if it is "
+          "smaller\n"
+          "  -g, --generate[=F]\n"
+          "                  Make missing sizes from the largest icon, with "
+          "filter F:\n"
+          "                  lanczos (default) or box\n"
+          "  -l, --legacy    Add the old is32, il32, ih32 and it32 icons "
+          "with their masks\n"
+          "  -a, --argb      Add the ic04 and ic05 ARGB icons\n"
+          "  -m, --mmap      Preallocate the .icns file and fill it through "
+          "mmap\n"
+          "  -j, --jobs=N    Number of threads used to transform icons and "
+          "fill a mapped\n"
+          "                  file\n",
+          own_path, kDefaultStripChunks);
 }
 
 char* Basename(const char* path, char* basename) {
   if (!path || *path == '\0') {
-    strlcpy(basename, ".", sizeof("."));
+    snprintf(basename, sizeof("."), ".");
     return basename;
   }
 
@@ -104,22 +346,283 @@ char* Basename(const char* path, char* basename) {
   if (base_length >= MAXPATHLEN)
     return NULL;
 
-  strlcpy(basename, begin, base_length + 1);
+  snprintf(basename, base_length + 1, "%s", begin);
   return basename;
 }
 
-const char* IconsetFromArguments(int argc, char* argv[]) {
-  if (argc < 2) {
+char* JoinPath(const char* directory, const char* filename) {
+  const size_t directory_length = strlen(directory);
+  const size_t filename_length = strlen(filename);
+  char* path = malloc(directory_length + filename_length + 2);
+  if (!path)
+    return NULL;
+
+  memcpy(path, directory, directory_length);
+  path[directory_length] = '/';
+  memcpy(path + directory_length + 1, filename, filename_length + 1);
+  return path;
+}
+
+// Only ancillary chunks, with a lowercase first letter, can be left out
+// without changing the image. The exception is tRNS, which holds the
+// transparency of the pixels.
+bool ParseStripChunks(const char* list, Options* options) {
+  options->strip_chunk_count = 0;
+  for (const char* name = list; *name;) {
+    size_t length = strcspn(name, ",");
+    if (length != 4 || !(name[0] >= 'a' && name[0] <= 'z') ||
+        strncmp(name, "tRNS", 4) == 0) {
+      fprintf(stderr, "Error: Can't strip PNG chunk '%.*s'\n", (int)length,
+              name);
+      return false;
+    }
+    if (options->strip_chunk_count == kMaxStripChunks) {
+      PrintError("Too many PNG chunks to strip.");
+      return false;
+    }
+
+    options->strip_chunks[options->strip_chunk_count++] =
+        (uint32_t)name[0] << 24 | (uint32_t)name[1] << 16 |
+        (uint32_t)name[2] << 8 | (uint32_t)name[3];
+    name += length;
+    if (*name == ',')
+      name++;
+  }
+  return true;
+}
+
+// Parses a profile like "small.icns:icp4,icp5" or "slim.icns:-ic10,ic14".
+bool ParseProfile(const char* argument, Options* options) {
+  const char* separator = strrchr(argument, ':');
+  if (!separator || separator == argument) {
+    PrintError("A profile needs a path and a list of icon types, like "
+               "F:icp4,icp5.");
+    return false;
+  }
+  if (options->profile_count == kMaxProfiles) {
+    PrintError("Too many profiles.");
+    return false;
+  }
+
+  Profile* profile = &options->profiles[options->profile_count];
+  char* path = strndup(argument, separator - argument);
+  if (!path) {
+    PrintSystemError();
+    return false;
+  }
+  *profile = (Profile){path, false, {0}, 0};
+
+  const char* name = separator + 1;
+  if (*name == '-') {
+    profile->exclude = true;
+    name++;
+  }
+  while (*name) {
+    size_t length = strcspn(name, ",");
+    if (length != 4) {
+      fprintf(stderr, "Error: '%.*s' isn't an icon type\n", (int)length,
+              name);
+      return false;
+    }
+    if (profile->type_count == kMaxProfileTypes) {
+      PrintError("Too many icon types in profile.");
+      return false;
+    }
+
+    profile->types[profile->type_count++] =
+        (uint32_t)name[0] << 24 | (uint32_t)name[1] << 16 |
+        (uint32_t)name[2] << 8 | (uint32_t)name[3];
+    name += length;
+    if (*name == ',')
+      name++;
+  }
+
+  options->profile_count++;
+  return true;
+}
+
+const char* IconsetFromArguments(int argc, char* argv[], Options* options) {
+  static const struct option kLongOptions[] = {
+      {"mmap", no_argument, NULL, 'm'},
+      {"jobs", required_argument, NULL, 'j'},
+      {"output", required_argument, NULL, 'o'},
+      {"ico", required_argument, NULL, 'I'},
+      {"web", required_argument, NULL, 'W'},
+      {"profile", required_argument, NULL, 'p'},
+      {"embed", required_argument, NULL, 'E'},
+      {"object", required_argument, NULL, 'b'},
+      {"update", required_argument, NULL, 'U'},
+      {"remove", required_argument, NULL, 'X'},
+      {"detect", no_argument, NULL, 'd'},
+      {"retina", required_argument, NULL, 'r'},
+      {"cache", required_argument, NULL, 'c'},
+      {"strip", optional_argument, NULL, 's'},
+      {"verify", optional_argument, NULL, 'V'},
+      {"recompress", optional_argument, NULL, 'z'},
+      {"reduce", no_argument, NULL, 'R'},
+      {"optimize-with", required_argument, NULL, 'O'},
+      {"generate", optional_argument, NULL, 'g'},
+      {"legacy", no_argument, NULL, 'l'},
+      {"argb", no_argument, NULL, 'a'},
+      {NULL, 0, NULL, 0}
+  };
+
+  int option;
+  while ((option = getopt_long(argc, argv,
+                               "mj:o:I:W:p:E:b:U:X:"
+                               "dr:c:s::V::z::RO:g::la",
+                               kLongOptions, NULL)) != -1) {
+    switch (option) {
+      case 'm':
+        options->mmap_output = true;
+        break;
+      case 'j':
+        options->jobs = atoi(optarg);
+        if (options->jobs < 1) {
+          PrintError("Number of jobs must be at least 1.");
+          PrintUsage(argv[0]);
+          return NULL;
+        }
+        break;
+      case 'o':
+        options->output_path = optarg;
+        break;
+      case 'I':
+        options->ico_path = optarg;
+        break;
+      case 'W':
+        options->web_path = optarg;
+        break;
+      case 'p':
+        if (!ParseProfile(optarg, options)) {
+          PrintUsage(argv[0]);
+          return NULL;
+        }
+        break;
+      case 'E':
+        options->embed_path = optarg;
+        break;
+      case 'b':
+        options->object_path = optarg;
+        break;
+      case 'U':
+        options->update_path = optarg;
+        break;
+      case 'X':
+        options->remove_name = optarg;
+        break;
+      case 'd':
+        options->detect_types = true;
+        break;
+      case 'c':
+        options->cache_path = optarg;
+        break;
+      case 'V':
+        options->verify = true;
+        if (optarg && strcmp(optarg, "full") == 0) {
+          options->verify_image_data = true;
+        } else if (optarg) {
+          PrintError("Verify mode must be full.");
+          PrintUsage(argv[0]);
+          return NULL;
+        }
+        break;
+      case 'R':
+        options->reduce = true;
+        break;
+      case 'O':
+        options->optimize_command = optarg;
+        break;
+      case 'l':
+        options->legacy = true;
+        break;
+      case 'a':
+        options->argb = true;
+        break;
+      case 'g':
+        options->generate = true;
+        if (!optarg || strcmp(optarg, "lanczos") == 0) {
+          options->generate_filter = kResizeLanczos;
+        } else if (strcmp(optarg, "box") == 0) {
+          options->generate_filter = kResizeBox;
+        } else {
+          PrintError("Filter must be lanczos or box.");
+          PrintUsage(argv[0]);
+          return NULL;
+        }
+        break;
+      case 'z':
+        options->recompress = true;
+        if (optarg && strcmp(optarg, "deinterlace") == 0) {
+          options->deinterlace = true;
+        } else if (optarg) {
+          PrintError("Recompress mode must be deinterlace.");
+          PrintUsage(argv[0]);
+          return NULL;
+        }
+        break;
+      case 's':
+        if (!ParseStripChunks(optarg ? optarg : kDefaultStripChunks,
+                              options)) {
+          PrintUsage(argv[0]);
+          return NULL;
+        }
+        break;
+      case 'r':
+        if (strcmp(optarg, "1x") == 0) {
+          options->retina_policy = kRetinaPrefer1x;
+        } else if (strcmp(optarg, "2x") == 0) {
+          options->retina_policy = kRetinaPrefer2x;
+        } else if (strcmp(optarg, "both") == 0) {
+          options->retina_policy = kRetinaBoth;
+        } else {
+          PrintError("Retina policy must be 1x, 2x or both.");
+          PrintUsage(argv[0]);
+          return NULL;
+        }
+        break;
+      default:
+        PrintUsage(argv[0]);
+        return NULL;
+    }
+  }
+
+  if (options->update_path && options->remove_name) {
+    PrintError("--update and --remove can't be combined.");
+    PrintUsage(argv[0]);
+    return NULL;
+  }
+
+  if ((options->update_path || options->remove_name) &&
+      options->output_path) {
+    PrintError("--update and --remove change the .icns file in place, "
+               "without --output.");
+    PrintUsage(argv[0]);
+    return NULL;
+  }
+
+  if ((options->update_path || options->remove_name) &&
+      (options->mmap_output || options->cache_path || options->generate ||
+       options->legacy || options->argb || options->ico_path ||
+       options->web_path || options->profile_count || options->embed_path ||
+       options->object_path)) {
+    PrintError("--update and --remove only change a single icon, and can't "
+               "add icons or outputs.");
+    PrintUsage(argv[0]);
+    return NULL;
+  }
+
+  if (optind >= argc) {
     PrintError("No path given to iconset directory.");
     PrintUsage(argv[0]);
     return NULL;
-  } else if (argc > 2) {
+  } else if (argc - optind > 1) {
     PrintError("Too many arguments.");
     PrintUsage(argv[0]);
     return NULL;
   }
 
-  return argv[1];
+  return argv[optind];
 }
 
 bool WriteUint32(uint32_t to_write, FILE* file) {
@@ -127,49 +630,125 @@ bool WriteUint32(uint32_t to_write, FILE* file) {
   return fwrite(&msb_first, sizeof(msb_first), 1, file) == 1;
 }
 
-FILE* OpenIcnsFileForIconset(const char* iconset_path) {
-  char path[MAXPATHLEN];
+void PutUint32(uint32_t to_write, uint8_t* buffer) {
+  uint32_t msb_first = htonl(to_write);
+  memcpy(buffer, &msb_first, sizeof(msb_first));
+}
+
+uint32_t LoadUint32(const uint8_t* buffer) {
+  uint32_t msb_first;
+  memcpy(&msb_first, buffer, sizeof(msb_first));
+  return ntohl(msb_first);
+}
+
+bool HasExtension(const char* path, const char* extension) {
+  const size_t path_length = strlen(path);
+  const size_t extension_length = strlen(extension);
+  return path_length > extension_length &&
+         strcmp(path + path_length - extension_length, extension) == 0;
+}
+
+bool IcnsPathForIconset(const char* iconset_path, char* path) {
   if (!Basename(iconset_path, path)) {
     PrintError("Can't determine basename for iconset");
-    return NULL;
+    return false;
   }
 
-  const size_t path_length = strlen(path);
-  const size_t extension_length = sizeof(kIconsetExtension) - 1;
-  const size_t base_path_length = path_length - extension_length;
+  const char* extension = HasExtension(path, kIconsetExtension)
+                              ? kIconsetExtension
+                              : HasExtension(path, kIcoExtension)
+                                    ? kIcoExtension
+                                    : NULL;
+  if (!extension) {
+    PrintError("Need .iconset directory or .ico file as input.");
+    return false;
+  }
 
-  if (path_length <= extension_length ||
-      strncmp(path + base_path_length, kIconsetExtension, extension_length) !=
-          0) {
-    PrintError("Need .iconset directory as input.");
-    return NULL;
+  memcpy(path + strlen(path) - strlen(extension), kIcnsExtension,
+         sizeof(kIcnsExtension));
+  return true;
+}
+
+bool WriteIcnsFileMetadata(FILE* file) {
+  long size = ftell(file);
+  return size >= 0 && fseek(file, 4L, SEEK_SET) == 0 && WriteUint32(size, file);
+}
+
+bool CloseIcnsOutput(IcnsOutput* output, bool success) {
+  if (!output->destination) {
+    if (success && !WriteIcnsFileMetadata(output->file)) {
+      PrintSystemError();
+      success = false;
+    }
+    if ((output->file == stdout ? fflush(stdout) : fclose(output->file)) != 0) {
+      PrintSystemError();
+      success = false;
+    }
+    return success;
   }
 
-  memcpy(path + base_path_length, kIcnsExtension, sizeof(kIcnsExtension));
-  FILE* file = fopen(path, "w");
-  if (!file) {
+  if (success && ftell(output->file) > UINT32_MAX) {
+    PrintError("Icon set is too large for an .icns file");
+    success = false;
+  }
+
+  if (success) {
+    uint8_t buffer[16 * kBufferSize];
+    size_t read;
+    bool copied = WriteIcnsFileMetadata(output->file) &&
+                  fseek(output->file, 0L, SEEK_SET) == 0;
+    while (copied && (read = fread(buffer, 1, sizeof(buffer), output->file)))
+      copied = fwrite(buffer, 1, read, output->destination) == read;
+    if (!copied || ferror(output->file) ||
+        fflush(output->destination) != 0) {
+      PrintSystemError();
+      success = false;
+    }
+  }
+
+  fclose(output->file);
+  return success;
+}
+
+bool OpenIcnsOutput(const char* icns_path, IcnsOutput* output) {
+  memset(output, 0, sizeof(*output));
+  if (strcmp(icns_path, kStandardStreamPath) != 0) {
+    output->file = fopen(icns_path, "w");
+  } else if (ftell(stdout) == 0) {
+    output->file = stdout;
+  } else {
+    // Standard output is a pipe (or we're not at its start), so we can't go
+    // back to fill in the total size. Collect the file in a temporary file
+    // instead, which keeps memory use as low as for other outputs.
+    output->destination = stdout;
+    output->file = tmpfile();
+  }
+
+  if (!output->file) {
     PrintSystemError();
-    return NULL;
+    return false;
   }
 
   // Every .icns file starts with a magic header (4 bytes) and the total size
   // including the header (4 bytes). Since we don't know the size yet, we'll
-  // overwrite this in WriteIcnsFileMetadata() with the real value.
-  if (!WriteUint32(kMagicHeader, file) ||
-      !WriteUint32(0, file)) {
+  // overwrite this in CloseIcnsOutput() with the real value.
+  if (!WriteUint32(kMagicHeader, output->file) ||
+      !WriteUint32(0, output->file)) {
     PrintSystemError();
-    fclose(file);
-    return NULL;
+    CloseIcnsOutput(output, false);
+    return false;
   }
 
-  return file;
+  return true;
 }
 
 uint32_t FindIconType(const char* icon_filename) {
   if (strncmp(icon_filename, kUnknownFormatFilename,
               sizeof(kUnknownFormatFilename) - 1) == 0) {
+    // The type may be followed by an extension that readicns added to
+    // describe the data.
     const char* format = icon_filename + sizeof(kUnknownFormatFilename) - 1;
-    if (strlen(format) != 4)
+    if (strlen(format) < 4 || (format[4] != '\0' && format[4] != '.'))
       return 0;
 
     return (format[0] << 24) | (format[1] << 16) | (format[2] << 8) | format[3];
@@ -183,74 +762,168 @@ uint32_t FindIconType(const char* icon_filename) {
   return 0;
 }
 
-bool WriteIconToFile(const char *iconset_path, const char *icon_filename,
-                     uint32_t icon_type, FILE *outfile) {
-  const size_t iconset_path_length = strlen(iconset_path);
-  const size_t icon_filename_length = strlen(icon_filename);
-  char* icon_path = malloc(iconset_path_length + icon_filename_length + 2);
+uint32_t IconTypeBit(uint32_t icon_type) {
+  for (size_t i = 0; i < (sizeof(kIconTypes) / sizeof(*kIconTypes)); i++) {
+    if (kIconTypes[i].icon_type == icon_type)
+      return 1u << i;
+  }
 
-  memcpy(icon_path, iconset_path, iconset_path_length);
-  icon_path[iconset_path_length] = '/';
-  memcpy(icon_path + iconset_path_length + 1, icon_filename,
-         icon_filename_length + 1);
+  return 0;
+}
 
-  FILE* infile = fopen(icon_path, "r");
-  free(icon_path);
-  if (!infile) {
+bool ParsePngSize(const uint8_t* header, uint32_t* width, uint32_t* height) {
+  if (memcmp(header, kPngSignature, sizeof(kPngSignature)) != 0 ||
+      memcmp(header + 12, "IHDR", 4) != 0)
+    return false;
+
+  uint32_t msb_first;
+  memcpy(&msb_first, header + 16, sizeof(msb_first));
+  *width = ntohl(msb_first);
+  memcpy(&msb_first, header + 20, sizeof(msb_first));
+  *height = ntohl(msb_first);
+  return true;
+}
+
+// Picks icon types for a PNG of the given size that aren't taken yet, and
+// marks them as taken. Returns the number of types written to types.
+size_t DetectIconTypes(uint32_t width, uint32_t height, RetinaPolicy policy,
+                       uint32_t* taken, uint32_t types[2]) {
+  int regular = -1;
+  int retina = -1;
+  for (size_t i = 0; i < (sizeof(kIconTypes) / sizeof(*kIconTypes)); i++) {
+    if (kIconTypes[i].pixel_size == width && width == height)
+      *(kIconTypes[i].retina ? &retina : &regular) = i;
+  }
+
+  const int candidates[2] = {policy == kRetinaPrefer2x ? retina : regular,
+                             policy == kRetinaPrefer2x ? regular : retina};
+  size_t count = 0;
+  for (size_t i = 0; i < 2; i++) {
+    if (candidates[i] < 0 || (*taken & (1u << candidates[i])))
+      continue;
+
+    types[count++] = kIconTypes[candidates[i]].icon_type;
+    *taken |= 1u << candidates[i];
+    if (policy != kRetinaBoth)
+      break;
+  }
+
+  return count;
+}
+
+void PrintUndetectedIcon(const char* icon_filename, bool is_png,
+                         uint32_t width, uint32_t height) {
+  if (is_png)
+    fprintf(stderr, "Warning: No free icon type for %s (%ux%u), skipping\n",
+            icon_filename, width, height);
+  else
+    fprintf(stderr, "Warning: Don't know icon type for %s, skipping\n",
+            icon_filename);
+}
+
+// Makes room for one more icon in the list.
+bool GrowIconList(IconList* icons) {
+  if (icons->count < icons->capacity)
+    return true;
+
+  size_t capacity = icons->capacity ? icons->capacity * 2 : 16;
+  Icon* grown = realloc(icons->icons, capacity * sizeof(*grown));
+  if (!grown) {
     PrintSystemError();
     return false;
   }
+  icons->icons = grown;
+  icons->capacity = capacity;
+  return true;
+}
 
-  // For every icon, we put a magic header (4 bytes) and the total size of the
-  // icon following including the header (4 bytes), followed by the icon
-  // itself.
-  long size = 0;
-  if (fseek(infile, 0L, SEEK_END) < 0 ||
-      (size = ftell(infile)) < 0 ||
-      fseek(infile, 0L, SEEK_SET) < 0) {
+bool AddIcon(IconList* icons, const char* iconset_path,
+             const char* icon_filename, uint32_t icon_type) {
+  if (!GrowIconList(icons))
+    return false;
+
+  char* icon_path = JoinPath(iconset_path, icon_filename);
+  if (!icon_path) {
     PrintSystemError();
-    fclose(infile);
     return false;
   }
 
-  if (!WriteUint32(icon_type, outfile) ||
-      !WriteUint32(size + 8, outfile)) {
+  struct stat info;
+  if (stat(icon_path, &info) < 0) {
     PrintSystemError();
-    fclose(infile);
+    free(icon_path);
     return false;
   }
 
-  uint8_t buffer[kBufferSize];
-  size_t read;
-  do {
-    read = fread(buffer, 1, kBufferSize, infile);
-    if ((read < kBufferSize && ferror(infile)) ||
-        fwrite(buffer, 1, read, outfile) < read) {
-      PrintSystemError();
-      fclose(infile);
-      return false;
-    }
-  } while (read == kBufferSize);
+  if (info.st_size > UINT32_MAX - 8) {
+    fprintf(stderr, "Error: %s is too large for an .icns file\n",
+            icon_filename);
+    free(icon_path);
+    return false;
+  }
 
-  fclose(infile);
+  Icon* icon = &icons->icons[icons->count++];
+  icon->icon_type = icon_type;
+  icon->icon_path = icon_path;
+  icon->size = info.st_size;
+  icon->offset = 0;
+  icon->data = NULL;
+  icon->shared = false;
   return true;
 }
 
-bool WriteIcnsFileMetadata(FILE* file) {
-  long size = ftell(file);
-  return size >= 0 && fseek(file, 4L, SEEK_SET) == 0 && WriteUint32(size, file);
+void FreeIconList(IconList* icons) {
+  for (size_t i = 0; i < icons->count; i++) {
+    free(icons->icons[i].icon_path);
+    if (!icons->icons[i].shared)
+      free(icons->icons[i].data);
+  }
+  free(icons->icons);
+  free(icons->file_data);
 }
 
-bool CreateIcnsFromIconset(const char* iconset_path) {
-  DIR* iconset = opendir(iconset_path);
-  if (!iconset) {
+// Adds an icon for a file without a known name, based on the size in its PNG
+// header. Only the first bytes of the file are read.
+bool AddDetectedIcon(IconList* icons, const char* iconset_path,
+                     const char* icon_filename, RetinaPolicy policy,
+                     uint32_t* taken) {
+  char* icon_path = JoinPath(iconset_path, icon_filename);
+  FILE* file = icon_path ? fopen(icon_path, "r") : NULL;
+  free(icon_path);
+  if (!file) {
     PrintSystemError();
     return false;
   }
 
-  FILE* icns = OpenIcnsFileForIconset(iconset_path);
-  if (!icns)
+  uint8_t header[kPngHeaderSize];
+  uint32_t width = 0;
+  uint32_t height = 0;
+  const bool is_png =
+      fread(header, 1, sizeof(header), file) == sizeof(header) &&
+      ParsePngSize(header, &width, &height);
+  fclose(file);
+
+  uint32_t types[2];
+  const size_t type_count =
+      is_png ? DetectIconTypes(width, height, policy, taken, types) : 0;
+  if (!type_count)
+    PrintUndetectedIcon(icon_filename, is_png, width, height);
+
+  for (size_t i = 0; i < type_count; i++) {
+    if (!AddIcon(icons, iconset_path, icon_filename, types[i]))
+      return false;
+  }
+
+  return true;
+}
+
+bool ScanIconset(const char* iconset_path, const Options* options,
+                 IconList* icons) {
+  DIR* iconset = opendir(iconset_path);
+  if (!iconset) {
+    PrintSystemError();
     return false;
+  }
 
   for (struct dirent *entry = readdir(iconset); entry;
        entry = readdir(iconset)) {
@@ -259,33 +932,3204 @@ bool CreateIcnsFromIconset(const char* iconset_path) {
 
     uint32_t icon_type = FindIconType(entry->d_name);
     if (!icon_type) {
-      fprintf(stderr, "Warning: Don't know icon type for %s, skipping\n",
-              entry->d_name);
+      if (!options->detect_types)
+        fprintf(stderr, "Warning: Don't know icon type for %s, skipping\n",
+                entry->d_name);
       continue;
     }
 
-    if (!WriteIconToFile(iconset_path, entry->d_name, icon_type, icns)) {
-      fclose(icns);
+    if (!AddIcon(icons, iconset_path, entry->d_name, icon_type)) {
+      closedir(iconset);
+      return false;
+    }
+  }
+
+  // Files with known names take precedence, so detect the other files in a
+  // second pass once we know which types are taken.
+  if (options->detect_types) {
+    uint32_t taken = 0;
+    for (size_t i = 0; i < icons->count; i++)
+      taken |= IconTypeBit(icons->icons[i].icon_type);
+
+    rewinddir(iconset);
+    for (struct dirent *entry = readdir(iconset); entry;
+         entry = readdir(iconset)) {
+      if (entry->d_name[0] == '.' || FindIconType(entry->d_name))
+        continue;
+
+      if (!AddDetectedIcon(icons, iconset_path, entry->d_name,
+                           options->retina_policy, &taken)) {
+        closedir(iconset);
+        return false;
+      }
+    }
+  }
+
+  closedir(iconset);
+  return true;
+}
+
+bool ReadFully(FILE* file, void* buffer, size_t size) {
+  if (fread(buffer, 1, size, file) == size)
+    return true;
+
+  if (ferror(file))
+    PrintSystemError();
+  else
+    PrintError("Unexpected end of file.");
+  return false;
+}
+
+bool SkipBytes(FILE* file, uint64_t size) {
+  uint8_t buffer[kBufferSize];
+  while (size > 0) {
+    size_t to_read = size > kBufferSize ? kBufferSize : size;
+    if (!ReadFully(file, buffer, to_read))
+      return false;
+    size -= to_read;
+  }
+  return true;
+}
+
+bool CopyBytes(FILE* from, FILE* to, uint64_t size) {
+  uint8_t buffer[kBufferSize];
+  while (size > 0) {
+    size_t to_read = size > kBufferSize ? kBufferSize : size;
+    if (!ReadFully(from, buffer, to_read))
+      return false;
+    if (fwrite(buffer, 1, to_read, to) != to_read) {
+      PrintSystemError();
+      return false;
+    }
+    size -= to_read;
+  }
+  return true;
+}
+
+// Whether PNGs are copied chunk by chunk instead of byte by byte.
+bool FiltersPngs(const Options* options) {
+  return options->strip_chunk_count > 0 || options->verify;
+}
+
+bool ShouldStripChunk(uint32_t chunk_type, const Options* options) {
+  for (size_t i = 0; i < options->strip_chunk_count; i++) {
+    if (options->strip_chunks[i] == chunk_type)
+      return true;
+  }
+  return false;
+}
+
+// Whether PNGs are read into memory and transformed before writing them.
+bool TransformsPngs(const Options* options) {
+  return options->recompress || options->reduce || options->optimize_command;
+}
+
+// Whether the icons go to more outputs than the .icns file, which then share
+// the icons in memory.
+bool SharesIcons(const Options* options) {
+  return options->ico_path || options->web_path || options->profile_count ||
+         options->embed_path || options->object_path;
+}
+
+// Inflates the zlib stream in the IDAT chunks as it comes by, only to let
+// zlib check it. The output is thrown away.
+typedef struct {
+  z_stream stream;
+  bool initialized;
+  bool finished;
+} ImageDataCheck;
+
+bool CheckImageData(ImageDataCheck* check, const uint8_t* data, size_t size) {
+  if (!check->initialized) {
+    memset(&check->stream, 0, sizeof(check->stream));
+    if (inflateInit(&check->stream) != Z_OK)
+      return false;
+    check->initialized = true;
+  }
+  if (check->finished)
+    return size == 0;
+
+  uint8_t scratch[16 * kBufferSize];
+  check->stream.next_in = (uint8_t*)data;
+  check->stream.avail_in = size;
+  do {
+    check->stream.next_out = scratch;
+    check->stream.avail_out = sizeof(scratch);
+    int result = inflate(&check->stream, Z_NO_FLUSH);
+    if (result == Z_STREAM_END) {
+      check->finished = true;
+      return check->stream.avail_in == 0;
+    }
+    if (result != Z_OK && result != Z_BUF_ERROR)
+      return false;
+  } while (check->stream.avail_in > 0 || check->stream.avail_out == 0);
+  return true;
+}
+
+// Copies the data and CRC of a chunk while checking them.
+bool CopyVerifiedChunk(FILE* png, FILE* out, const uint8_t header[8],
+                       uint32_t length, const char* name,
+                       ImageDataCheck* check) {
+  uint32_t chunk_type;
+  memcpy(&chunk_type, header + 4, sizeof(chunk_type));
+  chunk_type = ntohl(chunk_type);
+
+  uLong crc = crc32(crc32(0L, Z_NULL, 0), header + 4, 4);
+  uint8_t buffer[16 * kBufferSize];
+  for (uint32_t remaining = length; remaining > 0;) {
+    size_t to_read = MIN(remaining, sizeof(buffer));
+    if (!ReadFully(png, buffer, to_read))
+      return false;
+    crc = crc32(crc, buffer, to_read);
+    if (check && chunk_type == kImageDataChunk &&
+        !CheckImageData(check, buffer, to_read)) {
+      fprintf(stderr, "Error: Corrupt image data in %s\n", name);
+      return false;
+    }
+    if (fwrite(buffer, 1, to_read, out) != to_read) {
+      PrintSystemError();
       return false;
     }
+    remaining -= to_read;
   }
 
-  if (!WriteIcnsFileMetadata(icns)) {
-    fclose(icns);
+  uint8_t stored_crc[4];
+  if (!ReadFully(png, stored_crc, sizeof(stored_crc)))
+    return false;
+  if ((uint32_t)crc != ((uint32_t)stored_crc[0] << 24 |
+                        (uint32_t)stored_crc[1] << 16 |
+                        (uint32_t)stored_crc[2] << 8 | stored_crc[3])) {
+    fprintf(stderr, "Error: CRC mismatch in %.4s chunk of %s\n", header + 4,
+            name);
     return false;
   }
 
-  fclose(icns);
+  if (fwrite(stored_crc, 1, sizeof(stored_crc), out) != sizeof(stored_crc)) {
+    PrintSystemError();
+    return false;
+  }
   return true;
 }
 
-int main(int argc, char* argv[]) {
-  const char* iconset_path = IconsetFromArguments(argc, argv);
-  if (!iconset_path)
-    return -1;
+// Copies the PNG in png to out chunk by chunk, leaving out the chunks that
+// should be stripped and checking the others if asked to. Everything that is
+// kept, including the image data, is copied unchanged. When out is NULL, only
+// the size of the result is computed and the chunk data is skipped. Files that
+// aren't PNGs are copied as a whole.
+bool FilterPng(FILE* png, FILE* out, const char* name, const Options* options,
+               uint64_t* size) {
+  uint8_t signature[sizeof(kPngSignature)];
+  size_t read = fread(signature, 1, sizeof(signature), png);
+  if (read != sizeof(signature) ||
+      memcmp(signature, kPngSignature, sizeof(signature)) != 0) {
+    long file_size;
+    if (fseek(png, 0L, SEEK_END) < 0 || (file_size = ftell(png)) < 0 ||
+        fseek(png, 0L, SEEK_SET) < 0) {
+      PrintSystemError();
+      return false;
+    }
+    *size = file_size;
+    return !out || CopyBytes(png, out, file_size);
+  }
 
-  if (!CreateIcnsFromIconset(iconset_path))
-    return -1;
+  *size = sizeof(signature);
+  if (out &&
+      fwrite(signature, 1, sizeof(signature), out) != sizeof(signature)) {
+    PrintSystemError();
+    return false;
+  }
+
+  const bool verify = out && options->verify;
+  ImageDataCheck check = {.initialized = false};
+  bool seen_end = false;
+  bool success = true;
+
+  // Every chunk is a length (4 bytes), a type (4 bytes), the data and a CRC
+  // (4 bytes).
+  while (success) {
+    uint8_t header[8];
+    read = fread(header, 1, sizeof(header), png);
+    if (read == 0 && feof(png))
+      break;
+    if (read != sizeof(header)) {
+      fprintf(stderr, "Error: Unexpected end of %s\n", name);
+      success = false;
+      break;
+    }
+
+    uint32_t length;
+    uint32_t chunk_type;
+    memcpy(&length, header, sizeof(length));
+    memcpy(&chunk_type, header + 4, sizeof(chunk_type));
+    length = ntohl(length);
+    chunk_type = ntohl(chunk_type);
+    if (length > INT32_MAX) {
+      fprintf(stderr, "Error: Invalid chunk length in %s\n", name);
+      success = false;
+      break;
+    }
+    seen_end = seen_end || chunk_type == kImageEndChunk;
+
+    const bool strip = ShouldStripChunk(chunk_type, options);
+    if (!strip)
+      *size += sizeof(header) + length + 4;
+
+    if (strip || !out) {
+      if (fseek(png, length + 4L, SEEK_CUR) < 0) {
+        PrintSystemError();
+        success = false;
+      }
+      continue;
+    }
+
+    if (fwrite(header, 1, sizeof(header), out) != sizeof(header)) {
+      PrintSystemError();
+      success = false;
+    } else if (verify) {
+      success = CopyVerifiedChunk(
+          png, out, header, length, name,
+          options->verify_image_data ? &check : NULL);
+    } else {
+      success = CopyBytes(png, out, length + 4L);
+    }
+  }
+
+  if (success && verify && !seen_end) {
+    fprintf(stderr, "Error: %s has no IEND chunk\n", name);
+    success = false;
+  }
+  if (success && verify && options->verify_image_data && !check.finished) {
+    fprintf(stderr, "Error: Incomplete image data in %s\n", name);
+    success = false;
+  }
+  if (check.initialized)
+    inflateEnd(&check.stream);
+  return success;
+}
+
+// Works out the size of every icon after filtering, so the layout of the
+// .icns file can still be planned before writing it.
+bool MeasureFilteredIcons(IconList* icons, const Options* options) {
+  for (size_t i = 0; i < icons->count; i++) {
+    Icon* icon = &icons->icons[i];
+    if (icon->data)
+      continue;
+
+    FILE* file = fopen(icon->icon_path, "r");
+    if (!file) {
+      PrintSystemError();
+      return false;
+    }
+
+    uint64_t size;
+    bool measured = FilterPng(file, NULL, icon->icon_path, options, &size);
+    fclose(file);
+    if (!measured)
+      return false;
+    icon->size = size;
+  }
+  return true;
+}
+
+// Image data larger than this isn't recompressed. It's far beyond the 1024x1024
+// of the largest icon.
+static const uint64_t kMaxRecompressSize = 256 * 1024 * 1024;
+
+// Checks that the image data of the recompressed PNG inflates to filtered, and
+// for a deinterlaced image also that it unfilters to image.
+bool CheckRecompressedPng(const uint8_t* png, size_t size,
+                          const PngHeader* header, const uint8_t* filtered,
+                          const uint8_t* image, size_t data_size) {
+  uint8_t* data = malloc(data_size);
+  bool same = data && InflatePngData(png, size, data, data_size) &&
+              memcmp(data, filtered, data_size) == 0;
+  if (same && image)
+    same = UnfilterPngData(header, data) && memcmp(data, image, data_size) == 0;
+  free(data);
+  return same;
+}
+
+// Deflates the image data of the PNG in *png again at the highest level, with
+// the work split over threads. The other chunks and the filtered rows are kept
+// as they are, unless an interlaced image is deinterlaced, which needs new
+// filters. The PNG is only replaced if the result is smaller and decodes to
+// the same pixels.
+bool RecompressPng(uint8_t** png, size_t* size, const char* name,
+                   const Options* options) {
+  PngHeader header;
+  if (!ReadPngHeader(*png, *size, &header) ||
+      PngImageDataSize(&header) > kMaxRecompressSize)
+    return true;
+
+  const size_t data_size = PngImageDataSize(&header);
+  uint8_t* data = malloc(data_size);
+  if (!data) {
+    PrintSystemError();
+    return false;
+  }
+  if (!InflatePngData(*png, *size, data, data_size)) {
+    fprintf(stderr, "Error: Corrupt image data in %s\n", name);
+    free(data);
+    return false;
+  }
+
+  PngHeader new_header = header;
+  uint8_t* filtered = data;
+  uint8_t* image = NULL;
+  if (header.interlace_method && options->deinterlace) {
+    if (!UnfilterPngData(&header, data)) {
+      fprintf(stderr, "Error: Corrupt image data in %s\n", name);
+      free(data);
+      return false;
+    }
+
+    new_header.interlace_method = 0;
+    const size_t image_size = PngImageDataSize(&new_header);
+    image = calloc(image_size, 1);
+    filtered = malloc(image_size);
+    bool deinterlaced = image && filtered;
+    if (deinterlaced) {
+      DeinterlacePngData(&header, data, image);
+      deinterlaced = FilterPngData(&new_header, image, filtered);
+    }
+    if (!deinterlaced) {
+      PrintSystemError();
+      free(filtered);
+      free(image);
+      free(data);
+      return false;
+    }
+  }
+
+  const size_t filtered_size = PngImageDataSize(&new_header);
+  uint8_t* deflated = NULL;
+  size_t deflated_size = 0;
+  uint8_t* rebuilt = NULL;
+  size_t rebuilt_size = 0;
+  bool success = DeflatePngData(filtered, filtered_size, options->jobs,
+                                &deflated, &deflated_size) &&
+                 ReplacePngImageData(*png, *size, &new_header, NULL, 0,
+                                     deflated, deflated_size, &rebuilt,
+                                     &rebuilt_size);
+  if (!success)
+    PrintSystemError();
+
+  if (success && rebuilt_size < *size) {
+    if (CheckRecompressedPng(rebuilt, rebuilt_size, &new_header, filtered,
+                             image, filtered_size)) {
+      free(*png);
+      *png = rebuilt;
+      *size = rebuilt_size;
+      rebuilt = NULL;
+    } else {
+      fprintf(stderr, "Error: Recompressing %s changed the image\n", name);
+      success = false;
+    }
+  }
+
+  if (filtered != data)
+    free(filtered);
+  free(data);
+  free(image);
+  free(deflated);
+  free(rebuilt);
+  return success;
+}
+
+// Images with more pixels than this aren't reduced.
+static const uint64_t kMaxReducePixels = 16 * 1024 * 1024;
+enum { kMaxPaletteSize = 256, kColorTableSize = 1024 };
+
+// What it takes to store a decoded image without loss.
+typedef struct {
+  bool opaque;
+  bool grey;
+  // Whether every sample fits in 8 bits.
+  bool fits_8_bits;
+  // The smallest bit depth that holds every grey level exactly.
+  int grey_bit_depth;
+  // The distinct colors as 8-bit RGBA, in order of appearance, and a hash
+  // table of indexes into them. More than kMaxPaletteSize colors aren't
+  // counted.
+  uint32_t colors[kMaxPaletteSize];
+  size_t color_count;
+  int16_t color_table[kColorTableSize];
+} ColorStats;
+
+uint32_t PackColor(const uint16_t* pixel) {
+  return (uint32_t)(pixel[0] >> 8) << 24 | (uint32_t)(pixel[1] >> 8) << 16 |
+         (uint32_t)(pixel[2] >> 8) << 8 | pixel[3] >> 8;
+}
+
+// Finds the slot of color in the hash table of stats, which is either free or
+// holds the color.
+size_t FindColorSlot(const ColorStats* stats, uint32_t color) {
+  size_t slot = (color * 0x9e3779b1u) >> 22;
+  while (stats->color_table[slot] >= 0 &&
+         stats->colors[stats->color_table[slot]] != color)
+    slot = (slot + 1) % kColorTableSize;
+  return slot;
+}
+
+// Counts distinct colors until there are more than fit in a palette. Icons
+// have long runs of the same color, which only cost a compare.
+void CountColors(const uint16_t* pixels, size_t pixel_count,
+                 ColorStats* stats) {
+  memset(stats->color_table, 0xff, sizeof(stats->color_table));
+  stats->color_count = 0;
+  uint32_t previous = 0;
+  for (size_t i = 0; i < pixel_count; i++) {
+    const uint32_t color = PackColor(pixels + i * 4);
+    if (i > 0 && color == previous)
+      continue;
+    previous = color;
+
+    const size_t slot = FindColorSlot(stats, color);
+    if (stats->color_table[slot] >= 0)
+      continue;
+    if (stats->color_count == kMaxPaletteSize) {
+      stats->color_count++;
+      return;
+    }
+    stats->color_table[slot] = stats->color_count;
+    stats->colors[stats->color_count++] = color;
+  }
+}
+
+void AnalyzeColors(const uint16_t* pixels, size_t pixel_count,
+                   ColorStats* stats) {
+  // Plain loops over all pixels without early exits, which compilers turn
+  // into vector code.
+  bool opaque = true;
+  bool grey = true;
+  bool fits_8_bits = true;
+  for (size_t i = 0; i < pixel_count * 4; i += 4) {
+    opaque &= pixels[i + 3] == 65535;
+    grey &= pixels[i] == pixels[i + 1] && pixels[i] == pixels[i + 2];
+    for (size_t j = 0; j < 4; j++)
+      fits_8_bits &= (pixels[i + j] >> 8) == (pixels[i + j] & 0xff);
+  }
+  stats->opaque = opaque;
+  stats->grey = grey;
+  stats->fits_8_bits = fits_8_bits;
+
+  // Grey levels fit in fewer bits when they are multiples of 65535 / 1, 3 or
+  // 15.
+  stats->grey_bit_depth = fits_8_bits ? 8 : 16;
+  static const int kBitDepths[] = {1, 2, 4};
+  for (size_t depth = 0; grey && fits_8_bits && depth < 3; depth++) {
+    const uint16_t step = 65535 / ((1 << kBitDepths[depth]) - 1);
+    bool fits = true;
+    for (size_t i = 0; i < pixel_count * 4; i += 4)
+      fits &= pixels[i] % step == 0;
+    if (fits) {
+      stats->grey_bit_depth = kBitDepths[depth];
+      break;
+    }
+  }
+
+  stats->color_count = kMaxPaletteSize + 1;
+  if (fits_8_bits)
+    CountColors(pixels, pixel_count, stats);
+}
+
+// Picks the color type and bit depth with the fewest bits per pixel that
+// holds the image exactly. Ties go to the format without a palette, and
+// greyscale formats are left out unless allow_grey is set.
+void PickReducedFormat(const ColorStats* stats, bool allow_grey,
+                       PngHeader* header) {
+  const uint8_t depth = stats->fits_8_bits ? 8 : 16;
+  const size_t colors = stats->color_count;
+  const uint8_t palette_depth =
+      colors <= 2 ? 1 : colors <= 4 ? 2 : colors <= 16 ? 4 : 8;
+  const struct {
+    uint8_t color_type;
+    uint8_t bit_depth;
+    uint8_t channels;
+    bool exact;
+  } candidates[] = {
+      {0, stats->grey_bit_depth, 1,
+       allow_grey && stats->grey && stats->opaque},
+      {3, palette_depth, 1, colors <= kMaxPaletteSize},
+      {4, depth, 2, allow_grey && stats->grey},
+      {2, depth, 3, stats->opaque},
+      {6, depth, 4, true}
+  };
+
+  size_t best = sizeof(candidates) / sizeof(*candidates) - 1;
+  for (size_t i = 0; i < best; i++) {
+    if (candidates[i].exact &&
+        candidates[i].bit_depth * candidates[i].channels <
+            candidates[best].bit_depth * candidates[best].channels)
+      best = i;
+  }
+  header->color_type = candidates[best].color_type;
+  header->bit_depth = candidates[best].bit_depth;
+  header->interlace_method = 0;
+}
+
+void PutSample(uint8_t* row, size_t index, int bit_depth, uint16_t value) {
+  if (bit_depth == 16) {
+    row[index * 2] = value >> 8;
+    row[index * 2 + 1] = value & 0xff;
+  } else if (bit_depth == 8) {
+    row[index] = value;
+  } else {
+    const size_t bit = index * bit_depth;
+    row[bit / 8] |= value << (8 - bit_depth - bit % 8);
+  }
+}
+
+// Puts translucent colors first, so the tRNS chunk can leave out the opaque
+// ones, and fills in the PLTE and tRNS chunk data. Returns the length of the
+// tRNS data. The hash table of stats maps to the new order afterwards.
+size_t BuildPalette(ColorStats* stats, uint8_t palette[3 * kMaxPaletteSize],
+                    uint8_t transparency[kMaxPaletteSize]) {
+  uint32_t ordered[kMaxPaletteSize];
+  size_t count = 0;
+  size_t translucent = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < stats->color_count; i++) {
+      const bool opaque = (stats->colors[i] & 0xff) == 0xff;
+      if (opaque == (pass == 1))
+        ordered[count++] = stats->colors[i];
+    }
+    if (pass == 0)
+      translucent = count;
+  }
+
+  memcpy(stats->colors, ordered, count * sizeof(*ordered));
+  memset(stats->color_table, 0xff, sizeof(stats->color_table));
+  for (size_t i = 0; i < count; i++) {
+    stats->color_table[FindColorSlot(stats, ordered[i])] = i;
+    palette[i * 3] = ordered[i] >> 24;
+    palette[i * 3 + 1] = ordered[i] >> 16;
+    palette[i * 3 + 2] = ordered[i] >> 8;
+    transparency[i] = ordered[i] & 0xff;
+  }
+  return translucent;
+}
+
+// Encodes decoded pixels as unfiltered rows in the format of header.
+void EncodeReducedRows(const uint16_t* pixels, const PngHeader* header,
+                       const ColorStats* stats, uint8_t* rows) {
+  const size_t row_size = PngRowSize(header, header->width) + 1;
+  const uint16_t scale = 65535 / ((1 << header->bit_depth) - 1);
+  for (uint32_t y = 0; y < header->height; y++) {
+    uint8_t* row = rows + y * row_size + 1;
+    const uint16_t* pixel = pixels + (size_t)y * header->width * 4;
+    for (uint32_t x = 0; x < header->width; x++, pixel += 4) {
+      switch (header->color_type) {
+        case 0:
+          PutSample(row, x, header->bit_depth, pixel[0] / scale);
+          break;
+        case 3: {
+          const size_t slot = FindColorSlot(stats, PackColor(pixel));
+          PutSample(row, x, header->bit_depth, stats->color_table[slot]);
+          break;
+        }
+        case 4:
+          PutSample(row, x * 2, header->bit_depth, pixel[0] / scale);
+          PutSample(row, x * 2 + 1, header->bit_depth, pixel[3] / scale);
+          break;
+        case 2:
+        case 6: {
+          const size_t channels = header->color_type == 2 ? 3 : 4;
+          for (size_t i = 0; i < channels; i++)
+            PutSample(row, x * channels + i, header->bit_depth,
+                      pixel[i] / scale);
+          break;
+        }
+      }
+    }
+  }
+}
+
+bool HasPngChunk(const uint8_t* png, size_t size, uint32_t type) {
+  size_t offset = sizeof(kPngSignature);
+  PngChunk chunk;
+  while (NextPngChunk(png, size, &offset, &chunk)) {
+    if (chunk.type == type)
+      return true;
+  }
+  return false;
+}
+
+// Whether png has chunks whose meaning depends on the color type or bit
+// depth, other than the palette and transparency that are rebuilt.
+bool HasFormatDependentChunks(const uint8_t* png, size_t size) {
+  size_t offset = sizeof(kPngSignature);
+  PngChunk chunk;
+  while (NextPngChunk(png, size, &offset, &chunk)) {
+    if (chunk.type == 'bKGD' || chunk.type == 'sBIT' || chunk.type == 'hIST')
+      return true;
+  }
+  return false;
+}
+
+// Rewrites the PNG in *png as greyscale, RGB, with a palette or with fewer
+// bits per sample when that holds every pixel exactly, like 8-bit RGBA icons
+// that are opaque or have few colors. Sets *reduced when the PNG was replaced,
+// which only happens if the result is smaller and decodes to the same pixels.
+bool ReducePng(uint8_t** png, size_t* size, const char* name,
+               const Options* options, bool* reduced) {
+  *reduced = false;
+  PngHeader header;
+  if (!ReadPngHeader(*png, *size, &header) || header.color_type == 3 ||
+      header.bit_depth < 8 ||
+      (uint64_t)header.width * header.height > kMaxReducePixels ||
+      HasFormatDependentChunks(*png, *size))
+    return true;
+
+  const size_t pixel_count = (size_t)header.width * header.height;
+  uint16_t* pixels = malloc(pixel_count * 4 * sizeof(*pixels));
+  ColorStats* stats = malloc(sizeof(*stats));
+  if (!pixels || !stats) {
+    PrintSystemError();
+    free(pixels);
+    free(stats);
+    return false;
+  }
+  if (!DecodePngImage(*png, *size, &header, pixels)) {
+    fprintf(stderr, "Error: Corrupt image data in %s\n", name);
+    free(pixels);
+    free(stats);
+    return false;
+  }
+
+  AnalyzeColors(pixels, pixel_count, stats);
+  PngHeader new_header = header;
+  // A color PNG can only become greyscale without an ICC profile, which
+  // would have to be a greyscale profile then.
+  const bool allow_grey = header.color_type == 0 || header.color_type == 4 ||
+                          !HasPngChunk(*png, *size, 'iCCP');
+  PickReducedFormat(stats, allow_grey, &new_header);
+  if (new_header.color_type == header.color_type &&
+      new_header.bit_depth == header.bit_depth) {
+    free(pixels);
+    free(stats);
+    return true;
+  }
+
+  uint8_t palette[3 * kMaxPaletteSize];
+  uint8_t transparency[kMaxPaletteSize];
+  PngChunk palette_chunks[2];
+  size_t palette_chunk_count = 0;
+  if (new_header.color_type == 3) {
+    const size_t translucent = BuildPalette(stats, palette, transparency);
+    palette_chunks[palette_chunk_count++] =
+        (PngChunk){'PLTE', palette, stats->color_count * 3};
+    if (translucent)
+      palette_chunks[palette_chunk_count++] =
+          (PngChunk){'tRNS', transparency, translucent};
+  }
+
+  const size_t data_size = PngImageDataSize(&new_header);
+  uint8_t* rows = calloc(data_size, 1);
+  uint8_t* filtered = malloc(data_size);
+  uint8_t* deflated = NULL;
+  size_t deflated_size = 0;
+  uint8_t* rebuilt = NULL;
+  size_t rebuilt_size = 0;
+  bool success = rows && filtered;
+  if (success)
+    EncodeReducedRows(pixels, &new_header, stats, rows);
+  success = success && FilterPngData(&new_header, rows, filtered) &&
+            DeflatePngData(filtered, data_size, options->jobs, &deflated,
+                           &deflated_size) &&
+            ReplacePngImageData(*png, *size, &new_header, palette_chunks,
+                                palette_chunk_count, deflated, deflated_size,
+                                &rebuilt, &rebuilt_size);
+  if (!success)
+    PrintSystemError();
+
+  if (success && rebuilt_size < *size) {
+    uint16_t* check = malloc(pixel_count * 4 * sizeof(*check));
+    if (!check) {
+      PrintSystemError();
+      success = false;
+    } else if (DecodePngImage(rebuilt, rebuilt_size, &new_header, check) &&
+               memcmp(check, pixels, pixel_count * 4 * sizeof(*check)) == 0) {
+      free(*png);
+      *png = rebuilt;
+      *size = rebuilt_size;
+      rebuilt = NULL;
+      *reduced = true;
+    } else {
+      fprintf(stderr, "Error: Reducing %s changed the image\n", name);
+      success = false;
+    }
+    free(check);
+  }
+
+  free(pixels);
+  free(stats);
+  free(rows);
+  free(filtered);
+  free(deflated);
+  free(rebuilt);
+  return success;
+}
+
+bool WriteFully(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0)
+      return false;
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+// Reads a whole file into memory. The caller frees *data.
+bool ReadWholeFile(const char* path, uint8_t** data, size_t* size) {
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return false;
+
+  long file_size;
+  bool read = fseek(file, 0L, SEEK_END) == 0 &&
+              (file_size = ftell(file)) >= 0 && fseek(file, 0L, SEEK_SET) == 0;
+  *data = read ? malloc(file_size ? file_size : 1) : NULL;
+  read = *data && fread(*data, 1, file_size, file) == (size_t)file_size;
+  fclose(file);
+  if (!read) {
+    free(*data);
+    *data = NULL;
+    return false;
+  }
+  *size = file_size;
+  return true;
+}
+
+// Runs the optimizer command on a temporary copy of the PNG and reads back the
+// result into *optimized. When the command fails, *optimized is left NULL.
+// Only returns false for errors that should stop the build.
+bool RunOptimizer(const char* command, const uint8_t* png, size_t size,
+                  const char* name, uint8_t** optimized,
+                  size_t* optimized_size) {
+  *optimized = NULL;
+  const char* directory = getenv("TMPDIR");
+  char path[MAXPATHLEN];
+  snprintf(path, sizeof(path), "%s/createicns-XXXXXX%s",
+           directory && *directory ? directory : "/tmp", kPngExtension);
+  int fd = mkstemps(path, strlen(kPngExtension));
+  if (fd < 0) {
+    PrintSystemError();
+    return false;
+  }
+  const bool written = WriteFully(fd, png, size);
+  if (close(fd) < 0 || !written) {
+    PrintSystemError();
+    unlink(path);
+    return false;
+  }
+
+  // The path is passed as "$1" so the shell doesn't interpret it. Standard
+  // output goes to standard error, to keep it out of an .icns file that is
+  // written to standard output.
+  char* script = malloc(strlen(command) + sizeof(" \"$1\""));
+  posix_spawn_file_actions_t actions;
+  int error = script ? posix_spawn_file_actions_init(&actions) : ENOMEM;
+  pid_t pid = -1;
+  if (!error) {
+    sprintf(script, "%s \"$1\"", command);
+    char* const arguments[] = {"sh", "-c", script, "sh", path, NULL};
+    error = posix_spawn_file_actions_adddup2(&actions, STDERR_FILENO,
+                                             STDOUT_FILENO);
+    if (!error)
+      error = posix_spawn(&pid, "/bin/sh", &actions, NULL, arguments,
+                          environ);
+    posix_spawn_file_actions_destroy(&actions);
+  }
+  free(script);
+
+  int status = 0;
+  while (!error && waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR)
+      error = errno;
+  }
+  if (error) {
+    errno = error;
+    PrintSystemError();
+    unlink(path);
+    return false;
+  }
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Warning: Optimizer failed for %s, keeping it as is\n",
+            name);
+  } else if (!ReadWholeFile(path, optimized, optimized_size)) {
+    fprintf(stderr, "Warning: Can't read the optimized %s, keeping it as is\n",
+            name);
+  }
+  unlink(path);
+  return true;
+}
+
+// Stores a PNG in the optimizer cache under a temporary name first, so other
+// processes never see a partial entry.
+void AddOptimizedPng(const char* cache_path, const char* entry_path,
+                     const uint8_t* png, size_t size) {
+  char temporary_path[MAXPATHLEN];
+  snprintf(temporary_path, sizeof(temporary_path), "%s/.entry-XXXXXX",
+           cache_path);
+  int fd = mkstemp(temporary_path);
+  bool added = fd >= 0 && WriteFully(fd, png, size);
+  if (fd >= 0 && close(fd) < 0)
+    added = false;
+  if (!added || rename(temporary_path, entry_path) < 0) {
+    if (fd >= 0)
+      unlink(temporary_path);
+    fprintf(stderr, "Warning: Can't add %s to the cache\n", entry_path);
+  }
+}
+
+// Runs the optimizer command on the PNG in *png, and replaces it with the
+// result if that is a smaller PNG of the same size. The outcome is kept in a
+// cache keyed by the PNG and the command, so an unchanged icon set costs only
+// hash lookups the next time.
+bool OptimizePng(uint8_t** png, size_t* size, const char* name,
+                 const Options* options) {
+  PngHeader header;
+  if (!ReadPngHeader(*png, *size, &header))
+    return true;
+
+  char entry_path[MAXPATHLEN] = "";
+  if (options->optimize_cache_path[0]) {
+    HashState states[2];
+    HashInit(&states[0], 0);
+    HashInit(&states[1], kSecondKeySeed);
+    for (size_t i = 0; i < 2; i++) {
+      HashUpdate(&states[i], kOptimizeCacheVersion,
+                 sizeof(kOptimizeCacheVersion));
+      HashUpdate(&states[i], options->optimize_command,
+                 strlen(options->optimize_command) + 1);
+      HashUpdate(&states[i], *png, *size);
+    }
+    if (snprintf(entry_path, sizeof(entry_path), "%s/%016llx%016llx%s",
+                 options->optimize_cache_path,
+                 (unsigned long long)HashFinal(&states[0]),
+                 (unsigned long long)HashFinal(&states[1]),
+                 kPngExtension) >= (int)sizeof(entry_path))
+      entry_path[0] = '\0';
+  }
+
+  uint8_t* optimized = NULL;
+  size_t optimized_size = 0;
+  const bool cached =
+      entry_path[0] && ReadWholeFile(entry_path, &optimized, &optimized_size);
+  if (!cached && !RunOptimizer(options->optimize_command, *png, *size, name,
+                               &optimized, &optimized_size))
+    return false;
+
+  PngHeader optimized_header;
+  if (optimized &&
+      (!ReadPngHeader(optimized, optimized_size, &optimized_header) ||
+       optimized_header.width != header.width ||
+       optimized_header.height != header.height)) {
+    if (!cached)
+      fprintf(stderr, "Warning: Optimizer changed %s into something else, "
+              "keeping it as is\n", name);
+    free(optimized);
+    optimized = NULL;
+  }
+
+  if (optimized && optimized_size < *size) {
+    free(*png);
+    *png = optimized;
+    *size = optimized_size;
+    optimized = NULL;
+  }
+
+  // What is kept is cached, even if that is the PNG that went in, so it
+  // isn't optimized again.
+  if (entry_path[0] && !cached)
+    AddOptimizedPng(options->optimize_cache_path, entry_path, *png, *size);
+  free(optimized);
+  return true;
+}
+
+// Reads a PNG into memory, filtered like FilterPng does, and applies the
+// transformations that need the whole image. The caller frees *data.
+bool ProcessPng(FILE* png, const char* name, const Options* options,
+                uint8_t** data, size_t* size) {
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  FILE* out = open_memstream(&buffer, &buffer_size);
+  if (!out) {
+    PrintSystemError();
+    return false;
+  }
+
+  uint64_t filtered_size;
+  bool processed = FilterPng(png, out, name, options, &filtered_size);
+  if (fclose(out) != 0) {
+    PrintSystemError();
+    processed = false;
+  }
+
+  uint8_t* processed_data = (uint8_t*)buffer;
+  size_t processed_size = buffer_size;
+  if (processed && options->optimize_command)
+    processed = OptimizePng(&processed_data, &processed_size, name, options);
+  // A reduced PNG has already been deflated at the highest level.
+  bool reduced = false;
+  if (processed && options->reduce)
+    processed = ReducePng(&processed_data, &processed_size, name, options,
+                          &reduced);
+  if (processed && options->recompress && !reduced)
+    processed = RecompressPng(&processed_data, &processed_size, name, options);
+  if (processed && processed_size > UINT32_MAX - 8) {
+    fprintf(stderr, "Error: %s is too large for an .icns file\n", name);
+    processed = false;
+  }
+
+  if (!processed) {
+    free(processed_data);
+    return false;
+  }
+  *data = processed_data;
+  *size = processed_size;
+  return true;
+}
+
+bool WriteIconToFile(const Icon* icon, FILE *outfile, const Options* options) {
+  if (icon->data) {
+    if (!WriteUint32(icon->icon_type, outfile) ||
+        !WriteUint32(icon->size + 8, outfile) ||
+        fwrite(icon->data, 1, icon->size, outfile) != icon->size) {
+      PrintSystemError();
+      return false;
+    }
+    return true;
+  }
+
+  FILE* infile = fopen(icon->icon_path, "r");
+  if (!infile) {
+    PrintSystemError();
+    return false;
+  }
+
+  if (FiltersPngs(options)) {
+    uint64_t size;
+    if (!WriteUint32(icon->icon_type, outfile) ||
+        !WriteUint32(icon->size + 8, outfile)) {
+      PrintSystemError();
+      fclose(infile);
+      return false;
+    }
+
+    bool filtered =
+        FilterPng(infile, outfile, icon->icon_path, options, &size);
+    fclose(infile);
+    if (filtered && size != icon->size) {
+      fprintf(stderr, "Error: %s changed while reading it\n",
+              icon->icon_path);
+      return false;
+    }
+    return filtered;
+  }
+
+  // For every icon, we put a magic header (4 bytes) and the total size of the
+  // icon following including the header (4 bytes), followed by the icon
+  // itself.
+  long size = 0;
+  if (fseek(infile, 0L, SEEK_END) < 0 ||
+      (size = ftell(infile)) < 0 ||
+      fseek(infile, 0L, SEEK_SET) < 0) {
+    PrintSystemError();
+    fclose(infile);
+    return false;
+  }
+
+  if (!WriteUint32(icon->icon_type, outfile) ||
+      !WriteUint32(size + 8, outfile)) {
+    PrintSystemError();
+    fclose(infile);
+    return false;
+  }
+
+  uint8_t buffer[kBufferSize];
+  size_t read;
+  do {
+    read = fread(buffer, 1, kBufferSize, infile);
+    if ((read < kBufferSize && ferror(infile)) ||
+        fwrite(buffer, 1, read, outfile) < read) {
+      PrintSystemError();
+      fclose(infile);
+      return false;
+    }
+  } while (read == kBufferSize);
+
+  fclose(infile);
+  return true;
+}
+
+bool WriteStreamedIcnsFile(const char* icns_path, const IconList* icons,
+                           const Options* options) {
+  IcnsOutput output;
+  if (!OpenIcnsOutput(icns_path, &output))
+    return false;
+
+  for (size_t i = 0; i < icons->count; i++) {
+    if (!WriteIconToFile(&icons->icons[i], output.file, options))
+      return CloseIcnsOutput(&output, false);
+  }
+
+  return CloseIcnsOutput(&output, true);
+}
+
+uint64_t ParseTarNumber(const uint8_t* field, size_t length) {
+  // Large values are stored as big endian base-256 numbers with the high bit
+  // of the first byte set, the rest as octal text.
+  uint64_t value = 0;
+  if (field[0] & 0x80) {
+    value = field[0] & 0x7f;
+    for (size_t i = 1; i < length; i++)
+      value = (value << 8) | field[i];
+    return value;
+  }
+
+  for (size_t i = 0; i < length && field[i] != '\0'; i++) {
+    if (field[i] >= '0' && field[i] <= '7')
+      value = (value << 3) | (field[i] - '0');
+  }
+  return value;
+}
+
+uint64_t TarPadding(uint64_t size) {
+  return (kTarBlockSize - size % kTarBlockSize) % kTarBlockSize;
+}
+
+// Picks the path and size out of a pax extended header, which overrides the
+// fields of the member that follows it.
+bool ReadPaxHeader(FILE* tar, uint64_t size, TarMember* next) {
+  if (size > kMaxTarExtensionSize)
+    return SkipBytes(tar, size + TarPadding(size));
+
+  char* records = malloc(size + 1);
+  if (!records) {
+    PrintSystemError();
+    return false;
+  }
+
+  if (!ReadFully(tar, records, size)) {
+    free(records);
+    return false;
+  }
+  records[size] = '\0';
+
+  // Every record looks like "<length> <key>=<value>\n".
+  for (char* record = records; record < records + size;) {
+    char* key;
+    unsigned long length = strtoul(record, &key, 10);
+    if (length == 0 || record + length > records + size || *key != ' ')
+      break;
+
+    char* end = record + length - 1;
+    *end = '\0';
+    key++;
+    if (strncmp(key, "path=", 5) == 0)
+      snprintf(next->name, sizeof(next->name), "%s", key + 5);
+    else if (strncmp(key, "size=", 5) == 0)
+      next->size = strtoull(key + 5, NULL, 10);
+    record = end + 1;
+  }
+
+  free(records);
+  return SkipBytes(tar, TarPadding(size));
+}
+
+// Reads the next member header. Returns false on errors and at the end of the
+// archive, which is marked by an empty block.
+bool ReadTarMember(FILE* tar, TarMember* member, bool* end) {
+  TarMember extended = {{0}, 0, 0};
+  bool has_extended_size = false;
+  *end = false;
+
+  for (;;) {
+    uint8_t block[kTarBlockSize];
+    size_t read = fread(block, 1, sizeof(block), tar);
+    if (read == 0 && feof(tar)) {
+      // Some writers don't bother with the end of archive blocks.
+      *end = true;
+      return false;
+    }
+    if (read != sizeof(block)) {
+      if (ferror(tar))
+        PrintSystemError();
+      else
+        PrintError("Unexpected end of tar stream.");
+      return false;
+    }
+
+    unsigned checksum = 0;
+    bool empty = true;
+    for (size_t i = 0; i < sizeof(block); i++) {
+      checksum += (i >= 148 && i < 156) ? ' ' : block[i];
+      empty = empty && block[i] == 0;
+    }
+    if (empty) {
+      *end = true;
+      return false;
+    }
+    if (checksum != ParseTarNumber(block + 148, 8)) {
+      PrintError("This doesn't look like a tar stream.");
+      return false;
+    }
+
+    member->type = block[156];
+    member->size = ParseTarNumber(block + 124, 12);
+    if (member->type == 'x') {
+      if (!ReadPaxHeader(tar, member->size, &extended))
+        return false;
+      has_extended_size = extended.size != 0;
+      continue;
+    }
+    if (member->type == 'L') {
+      // GNU tar stores long names in a separate member before the real one.
+      uint64_t length = member->size;
+      if (length >= sizeof(extended.name)) {
+        PrintError("Name of tar member is too long.");
+        return false;
+      }
+      if (!ReadFully(tar, extended.name, length) ||
+          !SkipBytes(tar, TarPadding(length)))
+        return false;
+      extended.name[length] = '\0';
+      continue;
+    }
+
+    if (extended.name[0]) {
+      snprintf(member->name, sizeof(member->name), "%s", extended.name);
+    } else {
+      // The ustar format splits long names over a prefix and a name field.
+      char name[101] = {0};
+      char prefix[156] = {0};
+      memcpy(name, block, 100);
+      if (memcmp(block + 257, "ustar", 5) == 0)
+        memcpy(prefix, block + 345, 155);
+      snprintf(member->name, sizeof(member->name), "%s%s%s", prefix,
+               prefix[0] ? "/" : "", name);
+    }
+    if (has_extended_size)
+      member->size = extended.size;
+    return true;
+  }
+}
+
+const char* TarMemberFilename(const TarMember* member) {
+  const char* filename = strrchr(member->name, '/');
+  return filename ? filename + 1 : member->name;
+}
+
+bool WriteIconHeader(uint32_t icon_type, uint64_t size, FILE* icns) {
+  if (!WriteUint32(icon_type, icns) || !WriteUint32(size + 8, icns)) {
+    PrintSystemError();
+    return false;
+  }
+  return true;
+}
+
+bool WriteFilteredIcon(uint8_t* data, size_t size, const char* filename,
+                       const uint32_t* types, size_t type_count, FILE* icns,
+                       const Options* options) {
+  FILE* png = fmemopen(data, size, "r");
+  if (!png) {
+    PrintSystemError();
+    return false;
+  }
+
+  uint8_t* processed;
+  size_t processed_size;
+  bool written = ProcessPng(png, filename, options, &processed,
+                            &processed_size);
+  fclose(png);
+  if (!written)
+    return false;
+
+  for (size_t i = 0; written && i < type_count; i++) {
+    written = WriteIconHeader(types[i], processed_size, icns);
+    if (written && fwrite(processed, 1, processed_size, icns) !=
+                       processed_size) {
+      PrintSystemError();
+      written = false;
+    }
+  }
+
+  free(processed);
+  return written;
+}
+
+// Builds the .icns file in one pass over a tar stream of an iconset. The size
+// in each member header tells us the size of the icon before reading it, so
+// icons are copied through a fixed size buffer as they come by.
+bool WriteIcnsFromTar(FILE* tar, FILE* icns, const Options* options) {
+  // Without a second pass, detected types can only avoid the types of icons
+  // that came before them in the stream.
+  uint32_t taken = 0;
+  for (;;) {
+    TarMember member;
+    bool end;
+    if (!ReadTarMember(tar, &member, &end))
+      return end;
+
+    const char* filename = TarMemberFilename(&member);
+    const bool regular_file =
+        member.type == '0' || member.type == '\0' || member.type == '7';
+    uint32_t types[2] = {0};
+    size_t type_count = 0;
+    uint8_t header[kPngHeaderSize];
+    size_t header_size = 0;
+    if (regular_file && filename[0] != '.') {
+      types[0] = FindIconType(filename);
+      type_count = types[0] ? 1 : 0;
+      taken |= IconTypeBit(types[0]);
+
+      if (!type_count && options->detect_types) {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        header_size = MIN(member.size, sizeof(header));
+        if (!ReadFully(tar, header, header_size))
+          return false;
+        const bool is_png = header_size == sizeof(header) &&
+                            ParsePngSize(header, &width, &height);
+        if (is_png)
+          type_count = DetectIconTypes(width, height, options->retina_policy,
+                                       &taken, types);
+        if (!type_count)
+          PrintUndetectedIcon(filename, is_png, width, height);
+      } else if (!type_count) {
+        fprintf(stderr, "Warning: Don't know icon type for %s, skipping\n",
+                filename);
+      }
+    }
+
+    const uint64_t remaining = member.size - header_size;
+    if (!type_count) {
+      if (!SkipBytes(tar, remaining + TarPadding(member.size)))
+        return false;
+      continue;
+    }
+
+    if (member.size > UINT32_MAX - 8) {
+      fprintf(stderr, "Error: %s is too large for an .icns file\n", filename);
+      return false;
+    }
+
+    const bool filters = FiltersPngs(options) || TransformsPngs(options);
+    if (type_count == 1 && !filters) {
+      if (!WriteIconHeader(types[0], member.size, icns))
+        return false;
+      if (fwrite(header, 1, header_size, icns) != header_size) {
+        PrintSystemError();
+        return false;
+      }
+      if (!CopyBytes(tar, icns, remaining) ||
+          !SkipBytes(tar, TarPadding(member.size)))
+        return false;
+      continue;
+    }
+
+    // The icon goes in under two types, or has to be filtered, so hold on to
+    // it.
+    uint8_t* data = malloc(member.size);
+    if (!data) {
+      PrintSystemError();
+      return false;
+    }
+    memcpy(data, header, header_size);
+    bool written = ReadFully(tar, data + header_size, remaining) &&
+                   SkipBytes(tar, TarPadding(member.size));
+    if (filters) {
+      written = written && WriteFilteredIcon(data, member.size, filename,
+                                             types, type_count, icns, options);
+    } else {
+      for (size_t i = 0; written && i < type_count; i++) {
+        written = WriteIconHeader(types[i], member.size, icns);
+        if (written && fwrite(data, 1, member.size, icns) != member.size) {
+          PrintSystemError();
+          written = false;
+        }
+      }
+    }
+    free(data);
+    if (!written)
+      return false;
+  }
+}
+
+// Reserves size bytes for the file up front, so the file system can hand out
+// contiguous extents instead of growing the file piece by piece.
+bool PreallocateFile(int fd, off_t size) {
+#if defined(__linux__)
+  if (fallocate(fd, 0, 0, size) == 0)
+    return true;
+  if (errno != EOPNOTSUPP && errno != ENOSYS)
+    return false;
+#elif defined(F_PREALLOCATE)
+  fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, size, 0};
+  if (fcntl(fd, F_PREALLOCATE, &store) < 0) {
+    store.fst_flags = F_ALLOCATEALL;
+    fcntl(fd, F_PREALLOCATE, &store);
+  }
+#endif
+  return ftruncate(fd, size) == 0;
+}
+
+typedef struct {
+  uint8_t* map;
+  const IconList* icons;
+  const Options* options;
+} MappedIcnsFile;
+
+// Filters a PNG into memory first, and then copies it into its place in the
+// mapping.
+bool FillMappedFilteredIcon(const Icon* icon, uint8_t* data,
+                            const Options* options) {
+  FILE* infile = fopen(icon->icon_path, "r");
+  if (!infile) {
+    PrintSystemError();
+    return false;
+  }
+
+  char* filtered = NULL;
+  size_t filtered_size = 0;
+  FILE* outfile = open_memstream(&filtered, &filtered_size);
+  if (!outfile) {
+    PrintSystemError();
+    fclose(infile);
+    return false;
+  }
+
+  uint64_t size;
+  bool copied = FilterPng(infile, outfile, icon->icon_path, options, &size);
+  fclose(infile);
+  if (fclose(outfile) != 0) {
+    PrintSystemError();
+    copied = false;
+  }
+  if (copied && filtered_size != icon->size) {
+    fprintf(stderr, "Error: %s changed while reading it\n", icon->icon_path);
+    copied = false;
+  }
+
+  if (copied)
+    memcpy(data, filtered, filtered_size);
+  free(filtered);
+  return copied;
+}
+
+bool FillMappedIcon(void* context, size_t index) {
+  const MappedIcnsFile* file = context;
+  const Icon* icon = &file->icons->icons[index];
+  uint8_t* chunk = file->map + icon->offset;
+
+  PutUint32(icon->icon_type, chunk);
+  PutUint32(icon->size + 8, chunk + 4);
+  if (icon->data) {
+    memcpy(chunk + 8, icon->data, icon->size);
+    return true;
+  }
+  if (FiltersPngs(file->options))
+    return FillMappedFilteredIcon(icon, chunk + 8, file->options);
+
+  int fd = open(icon->icon_path, O_RDONLY);
+  if (fd < 0) {
+    PrintSystemError();
+    return false;
+  }
+
+  // The icon is read straight into its final place in the mapping.
+  uint8_t* data = chunk + 8;
+  size_t remaining = icon->size;
+  while (remaining > 0) {
+    ssize_t read_size = read(fd, data, remaining);
+    if (read_size < 0 && errno == EINTR)
+      continue;
+    if (read_size <= 0) {
+      if (read_size == 0)
+        fprintf(stderr, "Error: %s changed while reading it\n",
+                icon->icon_path);
+      else
+        PrintSystemError();
+      close(fd);
+      return false;
+    }
+    data += read_size;
+    remaining -= read_size;
+  }
+
+  close(fd);
+  return true;
+}
+
+bool WriteMappedIcnsFile(const char* icns_path, IconList* icons,
+                         const Options* options) {
+  // All sizes are known in advance, so every icon gets a fixed offset and the
+  // total size can go into the file header right away.
+  uint64_t total_size = 8;
+  for (size_t i = 0; i < icons->count; i++) {
+    icons->icons[i].offset = total_size;
+    total_size += icons->icons[i].size + 8;
+    if (total_size > UINT32_MAX) {
+      PrintError("Icon set is too large for an .icns file");
+      return false;
+    }
+  }
+
+  int fd = open(icns_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    PrintSystemError();
+    return false;
+  }
+
+  if (!PreallocateFile(fd, total_size)) {
+    PrintSystemError();
+    close(fd);
+    return false;
+  }
+
+  uint8_t* map =
+      mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    PrintSystemError();
+    close(fd);
+    return false;
+  }
+
+  PutUint32(kMagicHeader, map);
+  PutUint32(total_size, map + 4);
+
+  MappedIcnsFile file = {map, icons, options};
+  bool filled =
+      RunInParallel(FillMappedIcon, &file, icons->count, options->jobs);
+
+  if (munmap(map, total_size) < 0) {
+    PrintSystemError();
+    filled = false;
+  }
+  if (close(fd) < 0) {
+    PrintSystemError();
+    filled = false;
+  }
+
+  return filled;
+}
+
+bool HashFile(const char* path, uint64_t* size, uint64_t digest[2]) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    PrintSystemError();
+    return false;
+  }
+
+  HashState states[2];
+  HashInit(&states[0], 0);
+  HashInit(&states[1], kSecondKeySeed);
+  uint8_t buffer[64 * kBufferSize];
+  size_t read;
+  *size = 0;
+  while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    HashUpdate(&states[0], buffer, read);
+    HashUpdate(&states[1], buffer, read);
+    *size += read;
+  }
+
+  const bool failed = ferror(file);
+  fclose(file);
+  if (failed) {
+    PrintSystemError();
+    return false;
+  }
+
+  digest[0] = HashFinal(&states[0]);
+  digest[1] = HashFinal(&states[1]);
+  return true;
+}
+
+// Hashes an icon like HashFile, from memory for icons that are there already.
+bool HashIcon(const Icon* icon, uint64_t* size, uint64_t digest[2]) {
+  if (!icon->data)
+    return HashFile(icon->icon_path, size, digest);
+
+  *size = icon->size;
+  digest[0] = Hash(icon->data, icon->size, 0);
+  digest[1] = Hash(icon->data, icon->size, kSecondKeySeed);
+  return true;
+}
+
+// The cache key is a 128-bit hash over the type, size and hash of every icon
+// in the order they go into the .icns file, plus everything else that
+// changes the output.
+bool GetCacheKey(const IconList* icons, const Options* options,
+                 char key[33]) {
+  HashState states[2];
+  HashInit(&states[0], 0);
+  HashInit(&states[1], kSecondKeySeed);
+  for (size_t i = 0; i < 2; i++) {
+    HashUpdate(&states[i], kCacheVersion, sizeof(kCacheVersion));
+    HashUpdate(&states[i], options->strip_chunks,
+               options->strip_chunk_count * sizeof(*options->strip_chunks));
+    // Verifying doesn't change the output, but an entry written without
+    // verifying shouldn't stand in for a verified build.
+    const uint8_t flags[9] = {options->verify, options->verify_image_data,
+                              options->recompress, options->deinterlace,
+                              options->reduce, options->generate,
+                              options->generate_filter, options->legacy,
+                              options->argb};
+    HashUpdate(&states[i], flags, sizeof(flags));
+    if (options->optimize_command)
+      HashUpdate(&states[i], options->optimize_command,
+                 strlen(options->optimize_command) + 1);
+  }
+
+  for (size_t i = 0; i < icons->count; i++) {
+    uint64_t record[4] = {icons->icons[i].icon_type};
+    if (!HashIcon(&icons->icons[i], &record[1], &record[2]))
+      return false;
+
+    for (size_t j = 0; j < 2; j++)
+      HashUpdate(&states[j], record, sizeof(record));
+  }
+
+  snprintf(key, 33, "%016llx%016llx",
+           (unsigned long long)HashFinal(&states[0]),
+           (unsigned long long)HashFinal(&states[1]));
+  return true;
+}
+
+bool CloneFile(int source, int target) {
+#if defined(FICLONE)
+  return ioctl(target, FICLONE, source) == 0;
+#else
+  (void)source;
+  (void)target;
+  return false;
+#endif
+}
+
+bool CopyFileContents(int source, int target) {
+  uint8_t buffer[64 * kBufferSize];
+  for (;;) {
+    ssize_t read_size = read(source, buffer, sizeof(buffer));
+    if (read_size < 0 && errno == EINTR)
+      continue;
+    if (read_size <= 0)
+      return read_size == 0;
+
+    for (ssize_t written = 0; written < read_size;) {
+      ssize_t written_size =
+          write(target, buffer + written, read_size - written);
+      if (written_size < 0 && errno == EINTR)
+        continue;
+      if (written_size <= 0)
+        return false;
+      written += written_size;
+    }
+  }
+}
+
+// Makes target_path a file with the same contents as source_path: a clone
+// where the file system supports it, or else a copy. It is never a hard link,
+// so writing to the output later can't change the cache entry.
+bool MaterializeFile(const char* source_path, const char* target_path) {
+  if (unlink(target_path) < 0 && errno != ENOENT)
+    return false;
+
+#if defined(__APPLE__)
+  if (clonefile(source_path, target_path, 0) == 0)
+    return true;
+#endif
+
+  int source = open(source_path, O_RDONLY);
+  if (source < 0)
+    return false;
+
+  int target = open(target_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if (target < 0) {
+    close(source);
+    return false;
+  }
+
+  bool materialized =
+      CloneFile(source, target) || CopyFileContents(source, target);
+  close(source);
+  if (close(target) < 0)
+    materialized = false;
+  return materialized;
+}
+
+// Adds a freshly written .icns file to the cache. It's copied to a temporary
+// file first and renamed into place, so other processes never see a partial
+// entry.
+bool AddToCache(const char* cache_path, const char* entry_path,
+                const char* icns_path) {
+  char temporary_path[MAXPATHLEN];
+  snprintf(temporary_path, sizeof(temporary_path), "%s/.entry-XXXXXX",
+           cache_path);
+  int target = mkstemp(temporary_path);
+  if (target < 0)
+    return false;
+
+  int source = open(icns_path, O_RDONLY);
+  bool added = source >= 0 &&
+               (CloneFile(source, target) || CopyFileContents(source, target));
+  if (source >= 0)
+    close(source);
+
+  // Entries are only read, and protected from accidental changes.
+  if (added && fchmod(target, 0444) < 0)
+    added = false;
+  if (close(target) < 0)
+    added = false;
+  if (!added || rename(temporary_path, entry_path) < 0) {
+    unlink(temporary_path);
+    return false;
+  }
+  return true;
+}
+
+// Compares the data of two icons of the given size, from memory or from
+// their files, so that icons whose hashes collide never share data. Icons
+// that can't be read count as different.
+bool IsSameIcon(const Icon* icon, const Icon* other, uint64_t size) {
+  if (size == 0)
+    return true;
+
+  const Icon* pair[] = {icon, other};
+  FILE* files[2];
+  for (size_t i = 0; i < 2; i++)
+    files[i] = pair[i]->data ? fmemopen(pair[i]->data, size, "r")
+                             : fopen(pair[i]->icon_path, "r");
+
+  uint8_t buffers[2][kBufferSize];
+  bool same = files[0] && files[1];
+  for (uint64_t compared = 0; same && compared < size;) {
+    const size_t to_read = MIN(size - compared, kBufferSize);
+    same = fread(buffers[0], 1, to_read, files[0]) == to_read &&
+           fread(buffers[1], 1, to_read, files[1]) == to_read &&
+           memcmp(buffers[0], buffers[1], to_read) == 0;
+    compared += to_read;
+  }
+
+  for (size_t i = 0; i < 2; i++) {
+    if (files[i])
+      fclose(files[i]);
+  }
+  return same;
+}
+
+typedef struct {
+  IconList* icons;
+  const Options* options;
+  // Indexes of the icons to transform, one for every distinct file.
+  size_t* distinct;
+} PreparedIcons;
+
+bool PrepareIcon(void* context, size_t index) {
+  const PreparedIcons* prepared_icons = context;
+  Icon* icon = &prepared_icons->icons->icons[prepared_icons->distinct[index]];
+  const Options* options = prepared_icons->options;
+  // Icons that are only shared between outputs are kept byte for byte.
+  if (!FiltersPngs(options) && !TransformsPngs(options)) {
+    size_t size;
+    if (icon->data)
+      return true;
+    if (!ReadWholeFile(icon->icon_path, &icon->data, &size)) {
+      PrintSystemError();
+      return false;
+    }
+    icon->size = size;
+    return true;
+  }
+
+  // Icons from an .ico file are processed from memory.
+  FILE* file = icon->data ? fmemopen(icon->data, icon->size, "r")
+                          : fopen(icon->icon_path, "r");
+  if (!file) {
+    PrintSystemError();
+    return false;
+  }
+
+  uint8_t* data;
+  size_t size;
+  bool prepared = ProcessPng(file, icon->icon_path, options, &data, &size);
+  fclose(file);
+  if (prepared) {
+    if (!icon->shared)
+      free(icon->data);
+    icon->data = data;
+    icon->size = size;
+    icon->shared = false;
+  }
+  return prepared;
+}
+
+// Gets every icon ready for writing, so that its size is known. Icons are
+// transformed in memory in parallel, or only measured when they are filtered
+// while writing. Icons that also go to the .ico file, the web directory or
+// profiles are read into memory too, as they are when nothing filters them,
+// so that every output shares a single read. Icons from an .ico file are in
+// memory already, and are filtered there. Icons with the same data share one
+// buffer.
+bool PrepareIcons(IconList* icons, const Options* options) {
+  bool in_memory = false;
+  for (size_t i = 0; i < icons->count; i++)
+    in_memory |= icons->icons[i].data != NULL;
+  if (!TransformsPngs(options) && !SharesIcons(options) &&
+      !(in_memory && FiltersPngs(options)))
+    return !FiltersPngs(options) || MeasureFilteredIcons(icons, options);
+
+  // Icons with the same data, like icon_32x32.png and icon_16x16@2x.png, are
+  // only transformed once. Matching hashes are confirmed byte for byte.
+  uint64_t (*digests)[3] = malloc(icons->count * sizeof(*digests));
+  size_t* sources = malloc(icons->count * sizeof(*sources));
+  size_t* distinct = malloc(icons->count * sizeof(*distinct));
+  bool prepared = digests && sources && distinct;
+  if (!prepared)
+    PrintSystemError();
+
+  size_t distinct_count = 0;
+  for (size_t i = 0; prepared && i < icons->count; i++) {
+    prepared = HashIcon(&icons->icons[i], &digests[i][0], &digests[i][1]);
+    sources[i] = i;
+    for (size_t j = 0; prepared && j < i; j++) {
+      if (memcmp(digests[i], digests[j], sizeof(*digests)) == 0 &&
+          IsSameIcon(&icons->icons[i], &icons->icons[j], digests[i][0])) {
+        sources[i] = sources[j];
+        break;
+      }
+    }
+    if (sources[i] == i)
+      distinct[distinct_count++] = i;
+  }
+
+  // Every icon deflates on its share of the threads, so that no more than
+  // --jobs threads run at a time.
+  Options icon_options = *options;
+  icon_options.jobs = MAX(1, options->jobs / (int)MAX(distinct_count, 1));
+  PreparedIcons prepared_icons = {icons, &icon_options, distinct};
+  prepared = prepared && RunInParallel(PrepareIcon, &prepared_icons,
+                                       distinct_count, options->jobs);
+
+  // The others share the data of the first icon with the same data.
+  for (size_t i = 0; prepared && i < icons->count; i++) {
+    const Icon* source = &icons->icons[sources[i]];
+    Icon* icon = &icons->icons[i];
+    if (sources[i] == i || icon->data == source->data)
+      continue;
+
+    if (!icon->shared)
+      free(icon->data);
+    icon->data = source->data;
+    icon->size = source->size;
+    icon->shared = true;
+  }
+
+  free(digests);
+  free(sources);
+  free(distinct);
+  return prepared;
+}
+
+// Decodes an icon that should be a PNG of pixel_size by pixel_size pixels into
+// 16-bit RGBA. Returns NULL if it isn't one, or on errors, which set *failed.
+// The caller frees the result.
+uint16_t* DecodeIcon(const Icon* icon, uint32_t pixel_size, bool* failed) {
+  uint8_t* png = icon->data;
+  size_t png_size = icon->size;
+  if (!png && !ReadWholeFile(icon->icon_path, &png, &png_size)) {
+    PrintSystemError();
+    *failed = true;
+    return NULL;
+  }
+
+  PngHeader header;
+  uint16_t* pixels = NULL;
+  if (ReadPngHeader(png, png_size, &header) && header.width == pixel_size &&
+      header.height == pixel_size) {
+    pixels = malloc((size_t)pixel_size * pixel_size * 4 * sizeof(*pixels));
+    if (!pixels) {
+      PrintSystemError();
+      *failed = true;
+    } else if (!DecodePngImage(png, png_size, &header, pixels)) {
+      fprintf(stderr, "Error: Corrupt image data in %s\n", icon->icon_path);
+      *failed = true;
+      free(pixels);
+      pixels = NULL;
+    }
+  }
+
+  if (png != icon->data)
+    free(png);
+  return pixels;
+}
+
+// The name readicns gives to icons of a type without a known name, like
+// icon_data_is32.
+void UnknownFormatFilename(uint32_t icon_type,
+                           char filename[sizeof(kUnknownFormatFilename) + 4]) {
+  snprintf(filename, sizeof(kUnknownFormatFilename) + 4, "%s%c%c%c%c",
+           kUnknownFormatFilename, icon_type >> 24, (icon_type >> 16) & 0xff,
+           (icon_type >> 8) & 0xff, icon_type & 0xff);
+}
+
+// Size in pixels of an icon of one of kIconTypes, or 0 for other types.
+uint32_t IconPixelSize(uint32_t icon_type) {
+  for (size_t i = 0; i < (sizeof(kIconTypes) / sizeof(*kIconTypes)); i++) {
+    if (kIconTypes[i].icon_type == icon_type)
+      return kIconTypes[i].pixel_size;
+  }
+  return 0;
+}
+
+// Finds the icon with the largest size in pixels, if there is one.
+const Icon* FindLargestIcon(const IconList* icons, uint32_t* pixel_size) {
+  const Icon* largest = NULL;
+  *pixel_size = 0;
+  for (size_t i = 0; i < icons->count; i++) {
+    const uint32_t size = IconPixelSize(icons->icons[i].icon_type);
+    if (size > *pixel_size) {
+      largest = &icons->icons[i];
+      *pixel_size = size;
+    }
+  }
+  return largest;
+}
+
+// An icon size to scale the largest icon down to.
+typedef struct {
+  const uint16_t* pixels;
+  uint32_t master_size;
+  uint32_t pixel_size;
+  const Options* options;
+  uint8_t* png;
+  size_t png_size;
+} GeneratedIcon;
+
+bool GenerateIcon(void* context, size_t index) {
+  GeneratedIcon* icon = &((GeneratedIcon*)context)[index];
+  const uint32_t size = icon->pixel_size;
+  PngHeader header = {size, size, 8, 6, 0};
+  const size_t row_size = (size_t)size * 4 + 1;
+  uint8_t* pixels = malloc((size_t)size * size * 4);
+  uint8_t* rows = malloc(row_size * size);
+  bool generated = pixels && rows &&
+                   ResizeImage(icon->pixels, icon->master_size,
+                               icon->master_size, size, size,
+                               icon->options->generate_filter, pixels);
+  for (uint32_t y = 0; generated && y < size; y++) {
+    rows[y * row_size] = 0;
+    memcpy(rows + y * row_size + 1, pixels + (size_t)y * size * 4,
+           row_size - 1);
+  }
+  generated = generated && EncodePngImage(&header, rows, 1, &icon->png,
+                                          &icon->png_size);
+  if (!generated)
+    PrintSystemError();
+  free(pixels);
+  free(rows);
+  return generated;
+}
+
+// Adds an icon that only exists in memory. With shared, data stays owned by
+// the caller.
+bool AddMemoryIcon(IconList* icons, const char* icon_filename,
+                   uint32_t icon_type, uint8_t* data, size_t size,
+                   bool shared) {
+  if (!GrowIconList(icons))
+    return false;
+  char* icon_path = strdup(icon_filename);
+  if (!icon_path) {
+    PrintSystemError();
+    return false;
+  }
+
+  icons->icons[icons->count++] =
+      (Icon){icon_type, icon_path, size, 0, data, shared};
+  return true;
+}
+
+// Adds an icon that only exists in memory. Takes ownership of data.
+bool AddGeneratedIcon(IconList* icons, const char* icon_filename,
+                      uint32_t icon_type, uint8_t* data, size_t size) {
+  if (!AddMemoryIcon(icons, icon_filename, icon_type, data, size, false)) {
+    free(data);
+    return false;
+  }
+  return true;
+}
+
+// Decodes the largest icon once and scales it down to every size in
+// kIconTypes that isn't there yet, one size per thread. Sizes larger than
+// the largest icon are left out.
+bool GenerateMissingIcons(IconList* icons, const Options* options) {
+  const size_t type_count = sizeof(kIconTypes) / sizeof(*kIconTypes);
+  uint32_t present = 0;
+  for (size_t i = 0; i < icons->count; i++)
+    present |= IconTypeBit(icons->icons[i].icon_type);
+
+  uint32_t master_size;
+  const Icon* master = FindLargestIcon(icons, &master_size);
+  if (!master)
+    return true;
+
+  bool failed = false;
+  uint16_t* pixels = DecodeIcon(master, master_size, &failed);
+  if (!pixels) {
+    if (!failed)
+      fprintf(stderr, "Warning: %s isn't a %ux%u PNG, can't generate other "
+              "sizes from it\n", master->icon_path, master_size, master_size);
+    return !failed;
+  }
+
+  // Regular and @2x types share sizes, which are only generated once.
+  GeneratedIcon sizes[sizeof(kIconTypes) / sizeof(*kIconTypes)];
+  size_t size_count = 0;
+  for (size_t i = 0; i < type_count; i++) {
+    const uint32_t pixel_size = kIconTypes[i].pixel_size;
+    bool listed = false;
+    for (size_t j = 0; j < size_count; j++)
+      listed |= sizes[j].pixel_size == pixel_size;
+    if (!(present & (1u << i)) && pixel_size < master_size && !listed)
+      sizes[size_count++] =
+          (GeneratedIcon){pixels, master_size, pixel_size, options, NULL, 0};
+  }
+
+  bool generated =
+      RunInParallel(GenerateIcon, sizes, size_count, options->jobs);
+  free(pixels);
+
+  for (size_t i = 0; generated && i < type_count; i++) {
+    if ((present & (1u << i)) || kIconTypes[i].pixel_size >= master_size)
+      continue;
+
+    for (size_t j = 0; j < size_count; j++) {
+      if (sizes[j].pixel_size != kIconTypes[i].pixel_size)
+        continue;
+
+      uint8_t* data = malloc(sizes[j].png_size);
+      if (!data) {
+        PrintSystemError();
+        generated = false;
+        break;
+      }
+      memcpy(data, sizes[j].png, sizes[j].png_size);
+      generated = AddGeneratedIcon(icons, kIconTypes[i].icon_filename,
+                                   kIconTypes[i].icon_type, data,
+                                   sizes[j].png_size);
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < size_count; i++)
+    free(sizes[i].png);
+  return generated;
+}
+
+// A pair of old icon types, with the run-length encoded color channels in one
+// chunk and an 8-bit mask in the other. ARGB icons have no mask type: their
+// chunk starts with "ARGB", followed by the alpha channel and then the color
+// channels, all encoded the same way.
+typedef struct {
+  uint32_t image_type;
+  uint32_t mask_type;
+  uint32_t pixel_size;
+  // Number of bytes in front of the encoded channels: zeros, or the "ARGB"
+  // tag.
+  size_t padding;
+} LegacyIconType;
+
+static const LegacyIconType kLegacyIconTypes[] = {
+    {'is32', 's8mk', 16, 0},
+    {'il32', 'l8mk', 32, 0},
+    {'ih32', 'h8mk', 48, 0},
+    {'it32', 't8mk', 128, 4}
+};
+
+static const LegacyIconType kArgbIconTypes[] = {
+    {'ic04', 0, 16, 4},
+    {'ic05', 0, 32, 4}
+};
+
+typedef struct {
+  const LegacyIconType* type;
+  // An icon of the same size to take the pixels from, or NULL to scale the
+  // largest icon down.
+  const Icon* source;
+  const uint16_t* master;
+  uint32_t master_size;
+  const Options* options;
+  uint8_t* image;
+  size_t image_size;
+  uint8_t* mask;
+} LegacyIcon;
+
+bool EncodeLegacyIcon(void* context, size_t index) {
+  LegacyIcon* icon = &((LegacyIcon*)context)[index];
+  const uint32_t size = icon->type->pixel_size;
+  const size_t pixel_count = (size_t)size * size;
+  uint8_t* pixels = malloc(pixel_count * 4);
+  if (!pixels) {
+    PrintSystemError();
+    return false;
+  }
+
+  bool encoded = true;
+  if (icon->source) {
+    bool failed = false;
+    uint16_t* decoded = DecodeIcon(icon->source, size, &failed);
+    if (!decoded) {
+      if (!failed)
+        fprintf(stderr, "Warning: %s isn't a %ux%u PNG, can't make old icon "
+                "types from it\n", icon->source->icon_path, size, size);
+      free(pixels);
+      return !failed;
+    }
+    for (size_t i = 0; i < pixel_count * 4; i++)
+      pixels[i] = (decoded[i] + 128) / 257;
+    free(decoded);
+  } else {
+    encoded = ResizeImage(icon->master, icon->master_size, icon->master_size,
+                          size, size, icon->options->generate_filter, pixels);
+  }
+
+  // The channels are encoded one after the other, red first. ARGB icons
+  // start with alpha.
+  static const size_t kArgbChannels[] = {3, 0, 1, 2};
+  const bool argb = !icon->type->mask_type;
+  const size_t channel_count = argb ? 4 : 3;
+  const size_t padding = icon->type->padding;
+  icon->image =
+      encoded ? malloc(padding + channel_count * MaxIconRleSize(pixel_count))
+              : NULL;
+  icon->mask = encoded && !argb ? malloc(pixel_count) : NULL;
+  encoded = icon->image && (argb || icon->mask);
+  if (encoded) {
+    if (argb)
+      memcpy(icon->image, "ARGB", padding);
+    else
+      memset(icon->image, 0, padding);
+    icon->image_size = padding;
+    for (size_t i = 0; i < channel_count; i++) {
+      const size_t channel = argb ? kArgbChannels[i] : i;
+      icon->image_size += EncodeIconRle(pixels + channel, pixel_count, 4,
+                                        icon->image + icon->image_size);
+    }
+    for (size_t i = 0; !argb && i < pixel_count; i++)
+      icon->mask[i] = pixels[i * 4 + 3];
+  } else {
+    PrintSystemError();
+  }
+
+  free(pixels);
+  return encoded;
+}
+
+// Adds the icon types in types, like the old RGB and mask types that older
+// versions of macOS use. Each is made from the icon of the same size, or by
+// scaling down the largest icon when there isn't one. Types that are already
+// there are left alone.
+bool AddLegacyIcons(IconList* icons, const LegacyIconType* types,
+                    size_t type_count, const Options* options) {
+  uint32_t master_size;
+  const Icon* master = FindLargestIcon(icons, &master_size);
+  if (!master)
+    return true;
+
+  LegacyIcon legacy_icons[sizeof(kLegacyIconTypes) /
+                          sizeof(*kLegacyIconTypes)];
+  size_t count = 0;
+  bool needs_master = false;
+  for (size_t i = 0; i < type_count; i++) {
+    const LegacyIconType* type = &types[i];
+    const Icon* source = NULL;
+    bool present = false;
+    for (size_t j = 0; j < icons->count; j++) {
+      const Icon* icon = &icons->icons[j];
+      present |= icon->icon_type == type->image_type ||
+                 (type->mask_type && icon->icon_type == type->mask_type);
+      if (!source && IconPixelSize(icon->icon_type) == type->pixel_size)
+        source = icon;
+    }
+    if (present || (!source && type->pixel_size >= master_size))
+      continue;
+
+    needs_master |= !source;
+    legacy_icons[count++] = (LegacyIcon){type, source, NULL, master_size,
+                                         options, NULL, 0, NULL};
+  }
+
+  bool failed = false;
+  uint16_t* pixels =
+      needs_master ? DecodeIcon(master, master_size, &failed) : NULL;
+  if (needs_master && !pixels) {
+    if (!failed)
+      fprintf(stderr, "Warning: %s isn't a %ux%u PNG, can't make old icon "
+              "types from it\n", master->icon_path, master_size, master_size);
+    return !failed;
+  }
+  for (size_t i = 0; i < count; i++)
+    legacy_icons[i].master = pixels;
+
+  bool added =
+      RunInParallel(EncodeLegacyIcon, legacy_icons, count, options->jobs);
+  free(pixels);
+
+  for (size_t i = 0; i < count; i++) {
+    LegacyIcon* icon = &legacy_icons[i];
+    if (!added || !icon->image) {
+      free(icon->image);
+      free(icon->mask);
+      continue;
+    }
+
+    char filename[sizeof(kUnknownFormatFilename) + 4];
+    UnknownFormatFilename(icon->type->image_type, filename);
+    if (!AddGeneratedIcon(icons, filename, icon->type->image_type,
+                          icon->image, icon->image_size)) {
+      free(icon->mask);
+      added = false;
+      continue;
+    }
+    if (!icon->mask)
+      continue;
+    UnknownFormatFilename(icon->type->mask_type, filename);
+    added = AddGeneratedIcon(icons, filename, icon->type->mask_type,
+                             icon->mask, (size_t)icon->type->pixel_size *
+                                             icon->type->pixel_size);
+  }
+  return added;
+}
+
+// Finds a PNG icon for every size from 16 up to max_size pixels, smallest
+// first. Icons of types that share a size, like icon_32x32.png and
+// icon_16x16@2x.png, only count once. Returns the number of icons found.
+size_t FindIconSizes(const IconList* icons, uint32_t max_size,
+                     const Icon* sized[]) {
+  size_t count = 0;
+  for (size_t i = 0; i < icons->count; i++) {
+    const Icon* icon = &icons->icons[i];
+    const uint32_t pixel_size = IconPixelSize(icon->icon_type);
+    uint32_t width;
+    uint32_t height;
+    if (!pixel_size || pixel_size > max_size || !icon->data ||
+        icon->size < kPngHeaderSize ||
+        !ParsePngSize(icon->data, &width, &height) || width != pixel_size ||
+        height != pixel_size)
+      continue;
+
+    size_t position = 0;
+    while (position < count && IconPixelSize(sized[position]->icon_type) <
+                                   pixel_size)
+      position++;
+    if (position < count &&
+        IconPixelSize(sized[position]->icon_type) == pixel_size)
+      continue;
+
+    memmove(&sized[position + 1], &sized[position],
+            (count - position) * sizeof(*sized));
+    sized[position] = icon;
+    count++;
+  }
+  return count;
+}
+
+// Writes parts one after the other to a new file at path.
+bool WriteFileParts(const char* path, const uint8_t* const parts[],
+                    const size_t sizes[], size_t count) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  bool written = fd >= 0;
+  for (size_t i = 0; written && i < count; i++)
+    written = WriteFully(fd, parts[i], sizes[i]);
+  if (fd >= 0 && close(fd) < 0)
+    written = false;
+  if (!written)
+    PrintSystemError();
+  return written;
+}
+
+void PutUint16LittleEndian(uint16_t value, uint8_t* buffer) {
+  buffer[0] = value & 0xff;
+  buffer[1] = value >> 8;
+}
+
+void PutUint32LittleEndian(uint32_t value, uint8_t* buffer) {
+  PutUint16LittleEndian(value & 0xffff, buffer);
+  PutUint16LittleEndian(value >> 16, buffer + 2);
+}
+
+uint16_t LoadUint16LittleEndian(const uint8_t* buffer) {
+  return buffer[0] | buffer[1] << 8;
+}
+
+uint32_t LoadUint32LittleEndian(const uint8_t* buffer) {
+  return LoadUint16LittleEndian(buffer) |
+         (uint32_t)LoadUint16LittleEndian(buffer + 2) << 16;
+}
+
+// A Windows .ico file starts with a header of three 16-bit fields: zero, the
+// type (1) and the number of images. An entry for every image follows, with
+// the size and offset of its data at 8 and 12. Since Windows Vista the data
+// can be a PNG. See
+// https://learn.microsoft.com/en-us/previous-versions/ms997538(v=msdn.10)
+enum { kIcoHeaderSize = 6, kIcoEntrySize = 16 };
+
+// Writes the PNG icons from 16 to 256 pixels to a Windows .ico file.
+bool WriteIcoFile(const IconList* icons, const char* ico_path) {
+  enum { kMaxIcoSize = 256 };
+  const Icon* sized[sizeof(kIconTypes) / sizeof(*kIconTypes)];
+  const size_t count = FindIconSizes(icons, kMaxIcoSize, sized);
+  if (!count) {
+    fprintf(stderr, "Warning: No icons to write to %s\n", ico_path);
+    return true;
+  }
+
+  uint8_t header[kIcoHeaderSize + kIcoEntrySize * (sizeof(sized) /
+                                                   sizeof(*sized))] = {0};
+  PutUint16LittleEndian(1, header + 2);
+  PutUint16LittleEndian(count, header + 4);
+  const uint8_t* parts[1 + sizeof(sized) / sizeof(*sized)] = {header};
+  size_t sizes[1 + sizeof(sized) / sizeof(*sized)] = {
+      kIcoHeaderSize + kIcoEntrySize * count};
+  uint32_t offset = sizes[0];
+  for (size_t i = 0; i < count; i++) {
+    uint8_t* entry = header + kIcoHeaderSize + kIcoEntrySize * i;
+    // A width and height of 0 stand for 256.
+    const uint32_t pixel_size = IconPixelSize(sized[i]->icon_type);
+    entry[0] = entry[1] = pixel_size % kMaxIcoSize;
+    PutUint16LittleEndian(1, entry + 4);
+    PutUint16LittleEndian(32, entry + 6);
+    PutUint32LittleEndian(sized[i]->size, entry + 8);
+    PutUint32LittleEndian(offset, entry + 12);
+    offset += sized[i]->size;
+    parts[i + 1] = sized[i]->data;
+    sizes[i + 1] = sized[i]->size;
+  }
+
+  return WriteFileParts(ico_path, parts, sizes, count + 1);
+}
+
+// Writes a PNG of every size to web_path, named like icon-32x32.png.
+bool WriteWebIcons(const IconList* icons, const char* web_path) {
+  if (mkdir(web_path, 0777) < 0 && errno != EEXIST) {
+    PrintSystemError();
+    return false;
+  }
+
+  const Icon* sized[sizeof(kIconTypes) / sizeof(*kIconTypes)];
+  const size_t count = FindIconSizes(icons, UINT32_MAX, sized);
+  for (size_t i = 0; i < count; i++) {
+    const uint32_t pixel_size = IconPixelSize(sized[i]->icon_type);
+    char path[MAXPATHLEN];
+    if (snprintf(path, sizeof(path), "%s/icon-%ux%u%s", web_path, pixel_size,
+                 pixel_size, kPngExtension) >= (int)sizeof(path)) {
+      PrintError("Path of web icons is too long");
+      return false;
+    }
+
+    const uint8_t* parts[] = {sized[i]->data};
+    const size_t sizes[] = {sized[i]->size};
+    if (!WriteFileParts(path, parts, sizes, 1))
+      return false;
+  }
+  return true;
+}
+
+// Adds the PNG images in a Windows .ico file as icons, with types picked by
+// their size like --detect does. The file is read once, and the icons point
+// into it instead of copying their images. Images in the older BMP format are
+// skipped.
+bool ReadIcoFile(const char* ico_path, const Options* options,
+                 IconList* icons) {
+  uint8_t* ico;
+  size_t size;
+  if (!ReadWholeFile(ico_path, &ico, &size)) {
+    PrintSystemError();
+    return false;
+  }
+
+  const size_t count = size >= kIcoHeaderSize ? LoadUint16LittleEndian(ico + 4)
+                                              : 0;
+  if (size < kIcoHeaderSize || LoadUint16LittleEndian(ico) != 0 ||
+      LoadUint16LittleEndian(ico + 2) != 1 ||
+      kIcoHeaderSize + kIcoEntrySize * count > size) {
+    PrintError("This doesn't look like a Windows .ico file.");
+    free(ico);
+    return false;
+  }
+  icons->file_data = ico;
+
+  uint32_t taken = 0;
+  bool added = true;
+  for (size_t i = 0; added && i < count; i++) {
+    const uint8_t* entry = ico + kIcoHeaderSize + kIcoEntrySize * i;
+    const uint32_t image_size = LoadUint32LittleEndian(entry + 8);
+    const uint32_t offset = LoadUint32LittleEndian(entry + 12);
+    uint32_t width;
+    uint32_t height;
+    const bool is_png = offset <= size && image_size <= size - offset &&
+                        image_size >= kPngHeaderSize &&
+                        ParsePngSize(ico + offset, &width, &height);
+    char name[MAXPATHLEN];
+    snprintf(name, sizeof(name), "%s[%zu]", ico_path, i);
+
+    uint32_t types[2];
+    const size_t type_count =
+        is_png ? DetectIconTypes(width, height, options->retina_policy,
+                                 &taken, types)
+               : 0;
+    if (!type_count)
+      PrintUndetectedIcon(name, is_png, width, height);
+
+    for (size_t j = 0; added && j < type_count; j++)
+      added = AddMemoryIcon(icons, name, types[j], ico + offset, image_size,
+                            true);
+  }
+  return added;
+}
+
+bool IsInProfile(const Profile* profile, uint32_t icon_type) {
+  bool listed = false;
+  for (size_t i = 0; i < profile->type_count; i++)
+    listed |= profile->types[i] == icon_type;
+  return listed != profile->exclude;
+}
+
+// Writes the icons of a profile from memory, with one gather write for many
+// icons at a time instead of copying them into a buffer first.
+bool WriteProfile(const Profile* profile, const IconList* icons) {
+  struct iovec* parts = malloc((icons->count * 2 + 1) * sizeof(*parts));
+  uint8_t(*headers)[8] = malloc((icons->count + 1) * sizeof(*headers));
+  int fd = parts && headers
+               ? open(profile->path, O_WRONLY | O_CREAT | O_TRUNC, 0666)
+               : -1;
+  if (fd < 0) {
+    PrintSystemError();
+    free(parts);
+    free(headers);
+    return false;
+  }
+
+  size_t part_count = 1;
+  uint64_t total_size = 8;
+  for (size_t i = 0; i < icons->count; i++) {
+    const Icon* icon = &icons->icons[i];
+    if (!IsInProfile(profile, icon->icon_type))
+      continue;
+
+    PutUint32(icon->icon_type, headers[i + 1]);
+    PutUint32(icon->size + 8, headers[i + 1] + 4);
+    parts[part_count++] = (struct iovec){headers[i + 1], 8};
+    parts[part_count++] = (struct iovec){icon->data, icon->size};
+    total_size += icon->size + 8;
+  }
+  PutUint32(kMagicHeader, headers[0]);
+  PutUint32(total_size, headers[0] + 4);
+  parts[0] = (struct iovec){headers[0], 8};
+
+  bool written = total_size <= UINT32_MAX;
+  if (!written)
+    fprintf(stderr, "Error: Icon set is too large for %s\n", profile->path);
+  for (size_t start = 0; written && start < part_count;) {
+    const size_t count = MIN(part_count - start, IOV_MAX);
+    ssize_t written_size = writev(fd, parts + start, count);
+    if (written_size < 0 && errno == EINTR)
+      continue;
+    if (written_size <= 0) {
+      PrintSystemError();
+      written = false;
+      break;
+    }
+
+    // Skip the parts that were written, and the written start of a part that
+    // was cut short.
+    while (start < part_count && (size_t)written_size >= parts[start].iov_len)
+      written_size -= parts[start++].iov_len;
+    if (start < part_count) {
+      parts[start].iov_base = (uint8_t*)parts[start].iov_base + written_size;
+      parts[start].iov_len -= written_size;
+    }
+  }
+
+  if (close(fd) < 0 && written) {
+    PrintSystemError();
+    written = false;
+  }
+  free(parts);
+  free(headers);
+  return written;
+}
+
+// Writes data as C hex literals, 16 to a line. Every byte is copied from a
+// table of its literal rather than formatted with printf, which is what
+// makes large icon sets quick.
+bool WriteHexArray(const uint8_t* data, size_t size, FILE* out) {
+  enum { kBytesPerLine = 16, kLiteralSize = 5 };
+  static const char kDigits[] = "0123456789abcdef";
+  char literals[256][kLiteralSize];
+  for (int i = 0; i < 256; i++) {
+    literals[i][0] = '0';
+    literals[i][1] = 'x';
+    literals[i][2] = kDigits[i >> 4];
+    literals[i][3] = kDigits[i & 15];
+    literals[i][4] = ',';
+  }
+
+  char line[2 + kBytesPerLine * kLiteralSize + 1];
+  for (size_t start = 0; start < size; start += kBytesPerLine) {
+    const size_t count = MIN(size - start, kBytesPerLine);
+    char* position = line;
+    *position++ = ' ';
+    *position++ = ' ';
+    for (size_t i = 0; i < count; i++, position += kLiteralSize)
+      memcpy(position, literals[data[start + i]], kLiteralSize);
+    *position++ = '\n';
+    if (fwrite(line, 1, position - line, out) != (size_t)(position - line))
+      return false;
+  }
+  return true;
+}
+
+// Names in embeddings start with the file name made into a C identifier,
+// like app_icon for app-icon. Name has room for one more byte than basename.
+void EmbeddingName(const char* basename, char* name) {
+  snprintf(name, MAXPATHLEN + 1, "%s%s",
+           isdigit((unsigned char)basename[0]) ? "_" : "", basename);
+  for (char* position = name; *position; position++) {
+    if (!isalnum((unsigned char)*position))
+      *position = '_';
+  }
+}
+
+// Writes the .icns file as the array <name>_icns in P.c, and declares it in
+// P.h together with a table of where every icon is in it. The table is
+// constexpr in C++ and a static array in C, so icons can be found without
+// parsing the .icns file at run time.
+bool WriteEmbedding(const IconList* icons, const char* embed_path) {
+  char basename[MAXPATHLEN];
+  if (!Basename(embed_path, basename)) {
+    PrintError("Can't determine name of embedding");
+    return false;
+  }
+
+  char name[MAXPATHLEN + 1];
+  char macro[MAXPATHLEN + 1];
+  EmbeddingName(basename, name);
+  for (size_t i = 0; i == 0 || name[i - 1]; i++)
+    macro[i] = toupper((unsigned char)name[i]);
+
+  char header_path[MAXPATHLEN];
+  char source_path[MAXPATHLEN];
+  if (snprintf(header_path, sizeof(header_path), "%s.h", embed_path) >=
+          (int)sizeof(header_path) ||
+      snprintf(source_path, sizeof(source_path), "%s.c", embed_path) >=
+          (int)sizeof(source_path)) {
+    PrintError("Path of embedding is too long");
+    return false;
+  }
+
+  uint64_t total_size = 8;
+  for (size_t i = 0; i < icons->count; i++)
+    total_size += icons->icons[i].size + 8;
+  if (total_size > UINT32_MAX) {
+    PrintError("Icon set is too large for an .icns file");
+    return false;
+  }
+
+  FILE* header = fopen(header_path, "w");
+  if (!header) {
+    PrintSystemError();
+    return false;
+  }
+  bool written =
+      fprintf(header,
+              "// Generated by createicns, don't edit.\n\n"
+              "#ifndef %s_H_\n#define %s_H_\n\n"
+              "#include <stddef.h>\n#include <stdint.h>\n\n"
+              "#define %s_ICNS_SIZE %lluu\n"
+              "#define %s_ICON_COUNT %zuu\n\n"
+              "// An icon in %s_icns: its type, and where its data starts "
+              "and how\n// long it is.\n"
+              "typedef struct {\n  uint32_t type;\n  uint32_t offset;\n"
+              "  uint32_t size;\n} %s_icon;\n\n"
+              "#ifdef __cplusplus\nextern \"C\" {\n#endif\n"
+              "extern const unsigned char %s_icns[%lluu];\n"
+              "#ifdef __cplusplus\n}\nconstexpr\n#else\nstatic const\n"
+              "#endif\n%s_icon %s_icons[] = {\n",
+              macro, macro, macro,
+              (unsigned long long)total_size, macro, icons->count,
+              name, name, name,
+              (unsigned long long)total_size, name, name) > 0;
+  uint32_t offset = 8;
+  for (size_t i = 0; written && i < icons->count; i++) {
+    const Icon* icon = &icons->icons[i];
+    const char type[] = {icon->icon_type >> 24, icon->icon_type >> 16,
+                         icon->icon_type >> 8, icon->icon_type, '\0'};
+    bool printable = true;
+    for (size_t j = 0; j < 4; j++)
+      printable &= isalnum((unsigned char)type[j]) != 0;
+    written = fprintf(header, "    {0x%08xu, %uu, %uu},%s%s\n",
+                      icon->icon_type, offset + 8, icon->size,
+                      printable ? "  // " : "", printable ? type : "") > 0;
+    offset += icon->size + 8;
+  }
+  written = written &&
+            fprintf(header, "};\n\n#endif  // %s_H_\n", macro) > 0;
+  if (fclose(header) != 0)
+    written = false;
+
+  FILE* source = written ? fopen(source_path, "w") : NULL;
+  written = source &&
+            fprintf(source,
+                    "// Generated by createicns, don't edit.\n\n"
+                    "#include \"%s.h\"\n\n"
+                    "const unsigned char %s_icns[%lluu] = {\n",
+                    basename, name,
+                    (unsigned long long)total_size) > 0;
+  uint8_t file_header[8];
+  PutUint32(kMagicHeader, file_header);
+  PutUint32(total_size, file_header + 4);
+  written = written && WriteHexArray(file_header, 8, source);
+  for (size_t i = 0; written && i < icons->count; i++) {
+    const Icon* icon = &icons->icons[i];
+    uint8_t icon_header[8];
+    PutUint32(icon->icon_type, icon_header);
+    PutUint32(icon->size + 8, icon_header + 4);
+    written = WriteHexArray(icon_header, 8, source) &&
+              WriteHexArray(icon->data, icon->size, source);
+  }
+  written = written && fprintf(source, "};\n") > 0;
+  if (source && fclose(source) != 0)
+    written = false;
+  if (!written)
+    PrintSystemError();
+  return written;
+}
+
+// The parts of a 64-bit ELF file that an object with only data needs, in
+// the byte order of the machine. See
+// https://refspecs.linuxfoundation.org/elf/gabi4+/contents.html
+typedef struct {
+  uint8_t ident[16];
+  uint16_t type;
+  uint16_t machine;
+  uint32_t version;
+  uint64_t entry;
+  uint64_t program_headers_offset;
+  uint64_t sections_offset;
+  uint32_t flags;
+  uint16_t header_size;
+  uint16_t program_header_size;
+  uint16_t program_header_count;
+  uint16_t section_size;
+  uint16_t section_count;
+  uint16_t section_names_index;
+} ElfHeader;
+
+typedef struct {
+  uint32_t name;
+  uint32_t type;
+  uint64_t flags;
+  uint64_t address;
+  uint64_t offset;
+  uint64_t size;
+  uint32_t link;
+  uint32_t info;
+  uint64_t alignment;
+  uint64_t entry_size;
+} ElfSection;
+
+typedef struct {
+  uint32_t name;
+  uint8_t info;
+  uint8_t other;
+  uint16_t section;
+  uint64_t value;
+  uint64_t size;
+} ElfSymbol;
+
+enum {
+  kElfRelocatable = 1,
+  kElfProgramBits = 1,
+  kElfSymbolTable = 2,
+  kElfStringTable = 3,
+  kElfAllocate = 2,
+  kElfGlobalObject = 0x11,
+  kElfGlobalNoType = 0x10
+};
+
+// The sections of the object, in order, and their names in .shstrtab.
+enum {
+  kNoSection,
+  kRodataSection,
+  kNoteSection,
+  kSymbolSection,
+  kStringSection,
+  kSectionNameSection,
+  kObjectSectionCount
+};
+static const char kObjectSectionNames[] =
+    "\0.rodata\0.note.GNU-stack\0.symtab\0.strtab\0.shstrtab";
+static const uint32_t kObjectSectionNameOffsets[kObjectSectionCount] = {
+    0, 1, 9, 25, 33, 41};
+
+#if defined(__x86_64__)
+static const uint16_t kElfMachine = 62;
+#elif defined(__aarch64__)
+static const uint16_t kElfMachine = 183;
+#else
+static const uint16_t kElfMachine = 0;
+#endif
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+static const uint8_t kElfByteOrder = 2;
+#else
+static const uint8_t kElfByteOrder = 1;
+#endif
+
+// Writes the .icns file to a relocatable ELF object for this machine, like
+// `ld -r -b binary` would, so it can be linked without compiling a C array.
+// The .icns file is in .rodata as <name>_icns up to <name>_icns_end, and is
+// followed by the same table of icons that --embed writes, as <name>_icons
+// up to <name>_icons_end. An empty .note.GNU-stack section tells the linker
+// that the object doesn't need an executable stack.
+bool WriteObjectFile(const IconList* icons, const char* object_path) {
+  if (kElfMachine == 0) {
+    PrintError("Can't write ELF objects for this machine.");
+    return false;
+  }
+
+  char basename[MAXPATHLEN];
+  if (!Basename(object_path, basename)) {
+    PrintError("Can't determine name of object file");
+    return false;
+  }
+  const size_t base_length = strlen(basename);
+  if (base_length > 2 && strcmp(basename + base_length - 2, ".o") == 0)
+    basename[base_length - 2] = '\0';
+  char name[MAXPATHLEN + 1];
+  EmbeddingName(basename, name);
+
+  uint64_t total_size = 8;
+  for (size_t i = 0; i < icons->count; i++)
+    total_size += icons->icons[i].size + 8;
+  if (total_size > UINT32_MAX) {
+    PrintError("Icon set is too large for an .icns file");
+    return false;
+  }
+
+  const size_t name_length = strlen(name);
+  const char* kSuffixes[] = {"_icns", "_icns_end", "_icons", "_icons_end"};
+  enum { kSymbolCount = sizeof(kSuffixes) / sizeof(*kSuffixes) + 1 };
+  const uint64_t icns_offset = sizeof(ElfHeader);
+  const uint64_t icns_end = icns_offset + total_size;
+  const uint64_t index_offset = (icns_end + 3) & ~(uint64_t)3;
+  const uint64_t index_size = icons->count * 3 * sizeof(uint32_t);
+  const uint64_t symbols_offset =
+      (index_offset + index_size + 7) & ~(uint64_t)7;
+  const uint64_t strings_offset =
+      symbols_offset + kSymbolCount * sizeof(ElfSymbol);
+  uint64_t strings_size = 1;
+  for (size_t i = 0; i < kSymbolCount - 1; i++)
+    strings_size += name_length + strlen(kSuffixes[i]) + 1;
+  const uint64_t names_offset = strings_offset + strings_size;
+  const uint64_t sections_offset =
+      (names_offset + sizeof(kObjectSectionNames) + 7) & ~(uint64_t)7;
+  const uint64_t end =
+      sections_offset + kObjectSectionCount * sizeof(ElfSection);
+
+  // Everything after the .icns file is put together in one buffer, and
+  // written after the icons with a single call per part.
+  uint8_t* tail = calloc(end - icns_end, 1);
+  const uint8_t** parts = malloc((icons->count * 2 + 3) * sizeof(*parts));
+  size_t* sizes = malloc((icons->count * 2 + 3) * sizeof(*sizes));
+  uint8_t(*headers)[8] = malloc((icons->count + 1) * sizeof(*headers));
+  if (!tail || !parts || !sizes || !headers) {
+    PrintSystemError();
+    free(tail);
+    free(parts);
+    free(sizes);
+    free(headers);
+    return false;
+  }
+
+  uint8_t* index = tail + (index_offset - icns_end);
+  uint32_t offset = 8;
+  for (size_t i = 0; i < icons->count; i++) {
+    const Icon* icon = &icons->icons[i];
+    const uint32_t entry[3] = {icon->icon_type, offset + 8, icon->size};
+    memcpy(index + i * sizeof(entry), entry, sizeof(entry));
+    offset += icon->size + 8;
+  }
+
+  ElfSymbol symbols[kSymbolCount] = {{0}};
+  const uint64_t values[] = {0, total_size, index_offset - icns_offset,
+                             index_offset - icns_offset + index_size};
+  const uint64_t symbol_sizes[] = {total_size, 0, index_size, 0};
+  char* strings = (char*)tail + (strings_offset - icns_end);
+  uint32_t string_offset = 1;
+  for (size_t i = 1; i < kSymbolCount; i++) {
+    symbols[i].name = string_offset;
+    symbols[i].info = symbol_sizes[i - 1] ? kElfGlobalObject : kElfGlobalNoType;
+    symbols[i].section = kRodataSection;
+    symbols[i].value = values[i - 1];
+    symbols[i].size = symbol_sizes[i - 1];
+    string_offset += sprintf(strings + string_offset, "%s%s", name,
+                             kSuffixes[i - 1]) + 1;
+  }
+  memcpy(tail + (symbols_offset - icns_end), symbols, sizeof(symbols));
+  memcpy(tail + (names_offset - icns_end), kObjectSectionNames,
+         sizeof(kObjectSectionNames));
+
+  ElfSection sections[kObjectSectionCount] = {{0}};
+  sections[kRodataSection] = (ElfSection){
+      .type = kElfProgramBits, .flags = kElfAllocate, .offset = icns_offset,
+      .size = index_offset + index_size - icns_offset, .alignment = 16};
+  sections[kNoteSection] = (ElfSection){
+      .type = kElfProgramBits, .offset = icns_offset, .alignment = 1};
+  sections[kSymbolSection] = (ElfSection){
+      .type = kElfSymbolTable, .offset = symbols_offset,
+      .size = sizeof(symbols), .link = kStringSection, .info = 1,
+      .alignment = 8, .entry_size = sizeof(ElfSymbol)};
+  sections[kStringSection] = (ElfSection){
+      .type = kElfStringTable, .offset = strings_offset, .size = strings_size,
+      .alignment = 1};
+  sections[kSectionNameSection] = (ElfSection){
+      .type = kElfStringTable, .offset = names_offset,
+      .size = sizeof(kObjectSectionNames), .alignment = 1};
+  for (size_t i = 0; i < kObjectSectionCount; i++)
+    sections[i].name = kObjectSectionNameOffsets[i];
+  memcpy(tail + (sections_offset - icns_end), sections, sizeof(sections));
+
+  const ElfHeader header = {
+      .ident = {0x7f, 'E', 'L', 'F', 2, kElfByteOrder, 1},
+      .type = kElfRelocatable,
+      .machine = kElfMachine,
+      .version = 1,
+      .sections_offset = sections_offset,
+      .header_size = sizeof(ElfHeader),
+      .section_size = sizeof(ElfSection),
+      .section_count = kObjectSectionCount,
+      .section_names_index = kSectionNameSection};
+
+  size_t part_count = 0;
+  parts[part_count] = (const uint8_t*)&header;
+  sizes[part_count++] = sizeof(header);
+  PutUint32(kMagicHeader, headers[0]);
+  PutUint32(total_size, headers[0] + 4);
+  parts[part_count] = headers[0];
+  sizes[part_count++] = 8;
+  for (size_t i = 0; i < icons->count; i++) {
+    const Icon* icon = &icons->icons[i];
+    PutUint32(icon->icon_type, headers[i + 1]);
+    PutUint32(icon->size + 8, headers[i + 1] + 4);
+    parts[part_count] = headers[i + 1];
+    sizes[part_count++] = 8;
+    parts[part_count] = icon->data;
+    sizes[part_count++] = icon->size;
+  }
+  parts[part_count] = tail;
+  sizes[part_count++] = end - icns_end;
+
+  const bool written = WriteFileParts(object_path, parts, sizes, part_count);
+  free(tail);
+  free(parts);
+  free(sizes);
+  free(headers);
+  return written;
+}
+
+// Generated icons are PNGs like the others, so they are made before the icons
+// are prepared and transformed. The legacy and ARGB icons aren't, and are
+// added after.
+bool WriteIcnsFile(const char* icns_path, IconList* icons,
+                   const Options* options) {
+  if ((options->generate && !GenerateMissingIcons(icons, options)) ||
+      !PrepareIcons(icons, options) ||
+      (options->legacy &&
+       !AddLegacyIcons(icons, kLegacyIconTypes,
+                       sizeof(kLegacyIconTypes) / sizeof(*kLegacyIconTypes),
+                       options)) ||
+      (options->argb &&
+       !AddLegacyIcons(icons, kArgbIconTypes,
+                       sizeof(kArgbIconTypes) / sizeof(*kArgbIconTypes),
+                       options)))
+    return false;
+
+  const bool written =
+      options->mmap_output
+          ? WriteMappedIcnsFile(icns_path, icons, options)
+          : WriteStreamedIcnsFile(icns_path, icons, options);
+  bool shared =
+      written &&
+      (!options->ico_path || WriteIcoFile(icons, options->ico_path)) &&
+      (!options->web_path || WriteWebIcons(icons, options->web_path));
+  for (size_t i = 0; shared && i < options->profile_count; i++)
+    shared = WriteProfile(&options->profiles[i], icons);
+  return shared &&
+         (!options->embed_path || WriteEmbedding(icons, options->embed_path)) &&
+         (!options->object_path ||
+          WriteObjectFile(icons, options->object_path));
+}
+
+// Takes the .icns file from the cache if it has one for these icons. If not,
+// the file is written as usual and added to the cache.
+bool WriteCachedIcnsFile(const char* icns_path, IconList* icons,
+                         const Options* options) {
+  char key[33];
+  if (!GetCacheKey(icons, options, key))
+    return false;
+
+  char entry_path[MAXPATHLEN];
+  if (snprintf(entry_path, sizeof(entry_path), "%s/%s%s", options->cache_path,
+               key, kIcnsExtension) >= (int)sizeof(entry_path)) {
+    PrintError("Path of cache is too long");
+    return false;
+  }
+
+  if (access(entry_path, R_OK) == 0) {
+    if (MaterializeFile(entry_path, icns_path))
+      return true;
+    PrintSystemError();
+    return false;
+  }
+
+  // The output might be a hard link to a cache entry made by an older
+  // version, which must not be overwritten.
+  if (unlink(icns_path) < 0 && errno != ENOENT) {
+    PrintSystemError();
+    return false;
+  }
+
+  if (!WriteIcnsFile(icns_path, icons, options))
+    return false;
+
+  if ((mkdir(options->cache_path, 0777) < 0 && errno != EEXIST) ||
+      !AddToCache(options->cache_path, entry_path, icns_path))
+    fprintf(stderr, "Warning: Can't add %s to the cache\n", icns_path);
+  return true;
+}
+
+bool CreateIcnsFromIconset(const char* iconset_path, const Options* options) {
+  char icns_path[MAXPATHLEN];
+  if (options->output_path)
+    snprintf(icns_path, sizeof(icns_path), "%s", options->output_path);
+  else if (!IcnsPathForIconset(iconset_path, icns_path))
+    return false;
+
+  if (options->mmap_output && strcmp(icns_path, kStandardStreamPath) == 0) {
+    PrintError("Can't map standard output, use --output with a file.");
+    return false;
+  }
+
+  if (options->cache_path && strcmp(icns_path, kStandardStreamPath) == 0) {
+    PrintError("Can't use the cache for standard output.");
+    return false;
+  }
+
+  if (options->cache_path && SharesIcons(options)) {
+    PrintError("Can't use the cache together with --ico, --web, --profile, "
+               "--embed or --object.");
+    return false;
+  }
+
+  IconList icons = {0};
+  const bool scanned = HasExtension(iconset_path, kIcoExtension)
+                           ? ReadIcoFile(iconset_path, options, &icons)
+                           : ScanIconset(iconset_path, options, &icons);
+  if (!scanned) {
+    FreeIconList(&icons);
+    return false;
+  }
+
+  bool written = options->cache_path
+                     ? WriteCachedIcnsFile(icns_path, &icons, options)
+                     : WriteIcnsFile(icns_path, &icons, options);
+  FreeIconList(&icons);
+  return written;
+}
+
+bool CreateIcnsFromTar(FILE* tar, const Options* options) {
+  if (options->mmap_output) {
+    PrintError("Can't preallocate the .icns file when reading a tar stream.");
+    return false;
+  }
+
+  if (options->cache_path) {
+    PrintError("Can't use the cache when reading a tar stream.");
+    return false;
+  }
+
+  if (options->generate || options->legacy || options->argb) {
+    PrintError("Can't generate icons when reading a tar stream.");
+    return false;
+  }
+
+  if (SharesIcons(options)) {
+    PrintError("Can't write --ico, --web, --profile, --embed or --object "
+               "outputs when reading a tar stream.");
+    return false;
+  }
+
+  IcnsOutput output;
+  if (!OpenIcnsOutput(
+          options->output_path ? options->output_path : kStandardStreamPath,
+          &output))
+    return false;
+
+  return CloseIcnsOutput(&output, WriteIcnsFromTar(tar, output.file, options));
+}
+
+bool ReadAt(int fd, uint8_t* data, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t read = pread(fd, data, size, offset);
+    if (read < 0 && errno == EINTR)
+      continue;
+    if (read <= 0)
+      return false;
+    data += read;
+    size -= read;
+    offset += read;
+  }
+  return true;
+}
+
+bool WriteAt(int fd, const uint8_t* data, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t written = pwrite(fd, data, size, offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0)
+      return false;
+    data += written;
+    size -= written;
+    offset += written;
+  }
+  return true;
+}
+
+// Moves the bytes from start up to the end of the file by distance, which is
+// negative to move them towards the start of the file. Where the file system
+// supports it and the range is aligned to its blocks, only the extents are
+// moved. Otherwise the bytes are copied in large blocks, starting at the end
+// when moving up, so that nothing is overwritten before it is copied.
+bool ShiftFileTail(int fd, off_t start, off_t end, off_t distance) {
+  if (start == end)
+    return ftruncate(fd, end + distance) == 0;
+
+#if defined(FALLOC_FL_INSERT_RANGE) && defined(FALLOC_FL_COLLAPSE_RANGE)
+  struct stat status;
+  if (fstat(fd, &status) == 0 && status.st_blksize > 0) {
+    const off_t block = status.st_blksize;
+    const off_t length = distance > 0 ? distance : -distance;
+    const off_t offset = distance > 0 ? start : start + distance;
+    if (offset % block == 0 && length % block == 0 &&
+        fallocate(fd,
+                  distance > 0 ? FALLOC_FL_INSERT_RANGE
+                               : FALLOC_FL_COLLAPSE_RANGE,
+                  offset, length) == 0)
+      return true;
+  }
+#endif
+
+  uint8_t* buffer = malloc(MIN(end - start, kShiftBlockSize));
+  bool shifted = buffer != NULL;
+  if (distance > 0) {
+    for (off_t position = end; shifted && position > start;) {
+      const size_t size = MIN(position - start, kShiftBlockSize);
+      position -= size;
+      shifted = ReadAt(fd, buffer, size, position) &&
+                WriteAt(fd, buffer, size, position + distance);
+    }
+  } else {
+    for (off_t position = start; shifted && position < end;) {
+      const size_t size = MIN(end - position, kShiftBlockSize);
+      shifted = ReadAt(fd, buffer, size, position) &&
+                WriteAt(fd, buffer, size, position + distance);
+      position += size;
+    }
+    shifted = shifted && ftruncate(fd, end + distance) == 0;
+  }
+  free(buffer);
+  return shifted;
+}
+
+// Replaces, adds or removes a single icon in an existing .icns file. Only
+// the icons after it are moved, and the size in the header is updated, so a
+// change near the end of a large file doesn't rewrite all of it. The file is
+// broken if this is interrupted halfway.
+bool PatchIcnsFile(const char* icns_path, const Options* options) {
+  const char* name = options->remove_name;
+  uint32_t icon_type = name && strlen(name) == 4
+                           ? (uint32_t)name[0] << 24 | (uint32_t)name[1] << 16 |
+                                 (uint32_t)name[2] << 8 | (uint32_t)name[3]
+                           : 0;
+  char filename[MAXPATHLEN];
+  if (options->update_path)
+    name = Basename(options->update_path, filename);
+  if (!icon_type && name)
+    icon_type = FindIconType(name);
+  if (!icon_type) {
+    fprintf(stderr, "Error: Can't tell the icon type of %s\n",
+            options->update_path ? options->update_path : name);
+    return false;
+  }
+
+  // The new icon is stripped, checked and transformed like the icons of an
+  // iconset.
+  uint8_t* data = NULL;
+  size_t size = 0;
+  if (options->update_path &&
+      (FiltersPngs(options) || TransformsPngs(options))) {
+    FILE* file = fopen(options->update_path, "r");
+    if (!file) {
+      PrintSystemError();
+      return false;
+    }
+    const bool processed =
+        ProcessPng(file, options->update_path, options, &data, &size);
+    fclose(file);
+    if (!processed)
+      return false;
+  } else if (options->update_path &&
+             !ReadWholeFile(options->update_path, &data, &size)) {
+    PrintSystemError();
+    return false;
+  }
+
+  int fd = open(icns_path, O_RDWR);
+  struct stat status;
+  if (fd < 0 || fstat(fd, &status) < 0) {
+    PrintSystemError();
+    if (fd >= 0)
+      close(fd);
+    free(data);
+    return false;
+  }
+
+  // Walk the icon headers to find the icon, and check the whole file on the
+  // way before changing anything.
+  const off_t end = status.st_size;
+  uint8_t header[8];
+  bool patched = ReadAt(fd, header, sizeof(header), 0);
+  if (!patched || LoadUint32(header) != kMagicHeader ||
+      LoadUint32(header + 4) != end) {
+    PrintError("This doesn't look like an Apple .icns file.");
+    patched = false;
+  }
+  off_t icon_offset = end;
+  uint32_t icon_size = 0;
+  for (off_t offset = sizeof(header); patched && offset < end;) {
+    const uint32_t chunk_size = ReadAt(fd, header, sizeof(header), offset)
+                                    ? LoadUint32(header + 4)
+                                    : 0;
+    if (chunk_size < 8 || chunk_size > end - offset) {
+      PrintError("Invalid size in .icns file");
+      patched = false;
+      break;
+    }
+    if (LoadUint32(header) == icon_type && icon_size == 0) {
+      icon_offset = offset;
+      icon_size = chunk_size;
+    }
+    offset += chunk_size;
+  }
+
+  if (patched && !options->update_path && icon_size == 0) {
+    fprintf(stderr, "Error: %s has no %c%c%c%c icon\n", icns_path,
+            icon_type >> 24, (icon_type >> 16) & 0xff,
+            (icon_type >> 8) & 0xff, icon_type & 0xff);
+    patched = false;
+  }
+
+  const off_t new_icon_size = options->update_path ? (off_t)size + 8 : 0;
+  const off_t distance = new_icon_size - icon_size;
+  if (patched && end + distance > UINT32_MAX) {
+    PrintError("Icon set is too large for an .icns file");
+    patched = false;
+  }
+
+  if (patched) {
+    PutUint32(kMagicHeader, header);
+    PutUint32(end + distance, header + 4);
+    patched = (distance == 0 ||
+               ShiftFileTail(fd, icon_offset + icon_size, end, distance)) &&
+              WriteAt(fd, header, sizeof(header), 0);
+    PutUint32(icon_type, header);
+    PutUint32(new_icon_size, header + 4);
+    patched = patched &&
+              (!options->update_path ||
+               (WriteAt(fd, header, sizeof(header), icon_offset) &&
+                WriteAt(fd, data, size, icon_offset + sizeof(header))));
+    if (!patched)
+      PrintSystemError();
+  }
+
+  if (close(fd) < 0 && patched) {
+    PrintSystemError();
+    patched = false;
+  }
+  free(data);
+  return patched;
+}
+
+// Picks the directory for the results of --optimize-with: the --cache
+// directory if there is one, or the user's cache directory.
+void SetUpOptimizeCache(Options* options) {
+  char* path = options->optimize_cache_path;
+  const size_t size = sizeof(options->optimize_cache_path);
+  const char* base = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  if (options->cache_path) {
+    snprintf(path, size, "%s", options->cache_path);
+  } else if ((base && *base) || (home && *home)) {
+    // The cache directory itself might not be there yet.
+    char parent[MAXPATHLEN];
+    if (base && *base)
+      snprintf(parent, sizeof(parent), "%s", base);
+    else
+      snprintf(parent, sizeof(parent), "%s/.cache", home);
+    mkdir(parent, 0777);
+    if (snprintf(path, size, "%s/createicns", parent) >= (int)size)
+      path[0] = '\0';
+  } else {
+    path[0] = '\0';
+  }
+  if (!path[0])
+    return;
+
+  if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Warning: Can't keep optimized PNGs in %s\n", path);
+    path[0] = '\0';
+  }
+}
+
+int main(int argc, char* argv[]) {
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  Options options = {.jobs = processors > 0 ? processors : 1,
+                     .retina_policy = kRetinaPrefer1x,
+                     .generate_filter = kResizeLanczos};
+  const char* iconset_path = IconsetFromArguments(argc, argv, &options);
+  if (!iconset_path)
+    return -1;
+
+  if (options.optimize_command)
+    SetUpOptimizeCache(&options);
+
+  if (options.update_path || options.remove_name)
+    return PatchIcnsFile(iconset_path, &options) ? 0 : -1;
+
+  if (strcmp(iconset_path, kStandardStreamPath) == 0) {
+    if (!CreateIcnsFromTar(stdin, &options))
+      return -1;
+  } else if (!CreateIcnsFromIconset(iconset_path, &options)) {
+    return -1;
+  }
 
   return 0;
 }
@@ -0,0 +1,154 @@
+// -*- Mode: c; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+//
+// Copyright (c) 2017, Arjan van Leeuwen
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "hash.h"
+
+#include <string.h>
+
+static const uint64_t kPrime1 = 11400714785074694791ULL;
+static const uint64_t kPrime2 = 14029467366897019727ULL;
+static const uint64_t kPrime3 = 1609587929392839161ULL;
+static const uint64_t kPrime4 = 9650029242287828579ULL;
+static const uint64_t kPrime5 = 2870177450012600261ULL;
+
+static uint64_t RotateLeft(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t ReadUint64(const uint8_t* data) {
+  return (uint64_t)data[0] | (uint64_t)data[1] << 8 | (uint64_t)data[2] << 16 |
+         (uint64_t)data[3] << 24 | (uint64_t)data[4] << 32 |
+         (uint64_t)data[5] << 40 | (uint64_t)data[6] << 48 |
+         (uint64_t)data[7] << 56;
+}
+
+static uint64_t ReadUint32(const uint8_t* data) {
+  return (uint64_t)data[0] | (uint64_t)data[1] << 8 | (uint64_t)data[2] << 16 |
+         (uint64_t)data[3] << 24;
+}
+
+static uint64_t Round(uint64_t accumulator, uint64_t input) {
+  accumulator += input * kPrime2;
+  return RotateLeft(accumulator, 31) * kPrime1;
+}
+
+static uint64_t Merge(uint64_t hash, uint64_t accumulator) {
+  hash ^= Round(0, accumulator);
+  return hash * kPrime1 + kPrime4;
+}
+
+// Consumes as many whole 32 byte stripes as possible, returns the number of
+// bytes consumed.
+static size_t ConsumeStripes(uint64_t accumulators[4], const uint8_t* data,
+                             size_t length) {
+  size_t consumed = 0;
+  for (; length - consumed >= 32; consumed += 32) {
+    accumulators[0] = Round(accumulators[0], ReadUint64(data + consumed));
+    accumulators[1] = Round(accumulators[1], ReadUint64(data + consumed + 8));
+    accumulators[2] = Round(accumulators[2], ReadUint64(data + consumed + 16));
+    accumulators[3] = Round(accumulators[3], ReadUint64(data + consumed + 24));
+  }
+  return consumed;
+}
+
+void HashInit(HashState* state, uint64_t seed) {
+  memset(state, 0, sizeof(*state));
+  state->seed = seed;
+  state->accumulators[0] = seed + kPrime1 + kPrime2;
+  state->accumulators[1] = seed + kPrime2;
+  state->accumulators[2] = seed;
+  state->accumulators[3] = seed - kPrime1;
+}
+
+void HashUpdate(HashState* state, const void* data, size_t length) {
+  const uint8_t* bytes = data;
+  state->total_length += length;
+
+  if (state->buffered) {
+    size_t to_copy = sizeof(state->buffer) - state->buffered;
+    if (to_copy > length)
+      to_copy = length;
+    memcpy(state->buffer + state->buffered, bytes, to_copy);
+    state->buffered += to_copy;
+    bytes += to_copy;
+    length -= to_copy;
+    if (state->buffered < sizeof(state->buffer))
+      return;
+
+    ConsumeStripes(state->accumulators, state->buffer, sizeof(state->buffer));
+    state->buffered = 0;
+  }
+
+  size_t consumed = ConsumeStripes(state->accumulators, bytes, length);
+  memcpy(state->buffer, bytes + consumed, length - consumed);
+  state->buffered = length - consumed;
+}
+
+uint64_t HashFinal(const HashState* state) {
+  const uint64_t* accumulators = state->accumulators;
+  uint64_t hash;
+  if (state->total_length >= 32) {
+    hash = RotateLeft(accumulators[0], 1) + RotateLeft(accumulators[1], 7) +
+           RotateLeft(accumulators[2], 12) + RotateLeft(accumulators[3], 18);
+    for (size_t i = 0; i < 4; i++)
+      hash = Merge(hash, accumulators[i]);
+  } else {
+    hash = state->seed + kPrime5;
+  }
+  hash += state->total_length;
+
+  const uint8_t* data = state->buffer;
+  size_t length = state->buffered;
+  for (; length >= 8; data += 8, length -= 8) {
+    hash ^= Round(0, ReadUint64(data));
+    hash = RotateLeft(hash, 27) * kPrime1 + kPrime4;
+  }
+  if (length >= 4) {
+    hash ^= ReadUint32(data) * kPrime1;
+    hash = RotateLeft(hash, 23) * kPrime2 + kPrime3;
+    data += 4;
+    length -= 4;
+  }
+  for (; length > 0; data++, length--) {
+    hash ^= *data * kPrime5;
+    hash = RotateLeft(hash, 11) * kPrime1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= kPrime2;
+  hash ^= hash >> 29;
+  hash *= kPrime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+uint64_t Hash(const void* data, size_t length, uint64_t seed) {
+  HashState state;
+  HashInit(&state, seed);
+  HashUpdate(&state, data, length);
+  return HashFinal(&state);
+}
@@ -0,0 +1,54 @@
+// -*- Mode: c; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+//
+// Copyright (c) 2017, Arjan van Leeuwen
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// A fast, non-cryptographic 64-bit hash (xxHash64) used to recognize icons
+// with the same data. The algorithm is described at
+// https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// State for hashing data that comes in in parts.
+typedef struct {
+  uint64_t accumulators[4];
+  uint64_t total_length;
+  uint8_t buffer[32];
+  size_t buffered;
+  uint64_t seed;
+} HashState;
+
+void HashInit(HashState* state, uint64_t seed);
+void HashUpdate(HashState* state, const void* data, size_t length);
+uint64_t HashFinal(const HashState* state);
+
+// Hashes data in one go.
+uint64_t Hash(const void* data, size_t length, uint64_t seed);
+
+#endif  // HASH_H_
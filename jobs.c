@@ -0,0 +1,84 @@
+// -*- Mode: c; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+//
+// Copyright (c) 2017, Arjan van Leeuwen
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "jobs.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+typedef struct {
+  JobFunction function;
+  void* context;
+  size_t count;
+  size_t next;
+  bool failed;
+  pthread_mutex_t mutex;
+} JobQueue;
+
+static void* RunJobs(void* queue_pointer) {
+  JobQueue* queue = queue_pointer;
+  for (;;) {
+    pthread_mutex_lock(&queue->mutex);
+    const size_t index = queue->next++;
+    const bool done = queue->failed || index >= queue->count;
+    pthread_mutex_unlock(&queue->mutex);
+    if (done)
+      return NULL;
+
+    if (!queue->function(queue->context, index)) {
+      pthread_mutex_lock(&queue->mutex);
+      queue->failed = true;
+      pthread_mutex_unlock(&queue->mutex);
+    }
+  }
+}
+
+bool RunInParallel(JobFunction function, void* context, size_t count,
+                   int jobs) {
+  JobQueue queue = {function, context, count, 0, false,
+                    PTHREAD_MUTEX_INITIALIZER};
+  size_t thread_count = jobs > 1 ? (size_t)jobs - 1 : 0;
+  if (thread_count >= count)
+    thread_count = count > 0 ? count - 1 : 0;
+
+  pthread_t* threads = NULL;
+  size_t started = 0;
+  if (thread_count > 0 && (threads = malloc(thread_count * sizeof(*threads)))) {
+    for (; started < thread_count; started++) {
+      if (pthread_create(&threads[started], NULL, RunJobs, &queue) != 0)
+        break;
+    }
+  }
+
+  RunJobs(&queue);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  free(threads);
+  pthread_mutex_destroy(&queue.mutex);
+  return !queue.failed;
+}
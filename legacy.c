@@ -0,0 +1,122 @@
+// -*- Mode: c; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+//
+// Copyright (c) 2017, Arjan van Leeuwen
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "legacy.h"
+
+#include <string.h>
+
+enum {
+  kMaxLiteralLength = 128,
+  kMinRunLength = 3,
+  kMaxRunLength = 130
+};
+
+size_t MaxIconRleSize(size_t count) {
+  return count + (count + kMaxLiteralLength - 1) / kMaxLiteralLength;
+}
+
+// Writes samples from start to end as literal packets.
+static size_t PutLiterals(const uint8_t* samples, size_t start, size_t end,
+                          size_t stride, uint8_t* out) {
+  size_t written = 0;
+  while (start < end) {
+    const size_t length =
+        end - start < kMaxLiteralLength ? end - start : kMaxLiteralLength;
+    out[written++] = length - 1;
+    for (size_t i = 0; i < length; i++)
+      out[written++] = samples[(start + i) * stride];
+    start += length;
+  }
+  return written;
+}
+
+size_t EncodeIconRle(const uint8_t* samples, size_t count, size_t stride,
+                     uint8_t* out) {
+  size_t written = 0;
+  size_t literal_start = 0;
+  size_t i = 0;
+  while (i < count) {
+    const uint8_t value = samples[i * stride];
+    size_t run = 1;
+    while (i + run < count && run < kMaxRunLength &&
+           samples[(i + run) * stride] == value)
+      run++;
+
+    // Runs of two cost as much as literals, and would break up a literal
+    // packet.
+    if (run < kMinRunLength) {
+      i += run;
+      continue;
+    }
+
+    written += PutLiterals(samples, literal_start, i, stride, out + written);
+    out[written++] = 0x80 + run - kMinRunLength;
+    out[written++] = value;
+    i += run;
+    literal_start = i;
+  }
+  return written + PutLiterals(samples, literal_start, count, stride,
+                               out + written);
+}
+
+size_t DecodeIconRle(const uint8_t* data, size_t size, uint8_t* samples,
+                     size_t count, size_t stride) {
+  size_t used = 0;
+  size_t decoded = 0;
+  while (decoded < count) {
+    if (used >= size)
+      return 0;
+
+    const uint8_t header = data[used++];
+    if (header < 0x80) {
+      const size_t length = header + 1;
+      if (length > size - used || length > count - decoded)
+        return 0;
+      if (stride == 1) {
+        memcpy(samples + decoded, data + used, length);
+      } else {
+        for (size_t i = 0; i < length; i++)
+          samples[(decoded + i) * stride] = data[used + i];
+      }
+      used += length;
+      decoded += length;
+    } else {
+      const size_t length = header - 0x80 + kMinRunLength;
+      if (used >= size || length > count - decoded)
+        return 0;
+      if (stride == 1) {
+        memset(samples + decoded, data[used], length);
+      } else {
+        for (size_t i = 0; i < length; i++)
+          samples[(decoded + i) * stride] = data[used];
+      }
+      used++;
+      decoded += length;
+    }
+  }
+  return used;
+}
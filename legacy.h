@@ -0,0 +1,55 @@
+// -*- Mode: c; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+//
+// Copyright (c) 2017, Arjan van Leeuwen
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// The run-length encoding of the color channels of old icon types, like is32
+// and il32, and of ARGB icons. Every channel is encoded on its own as a
+// series of packets. A header byte below 0x80 is followed by that number plus
+// one bytes to copy. Any other header byte is followed by one byte that is
+// repeated the header minus 0x80, plus three times.
+
+#ifndef LEGACY_H_
+#define LEGACY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest number of bytes that encoding count samples can take.
+size_t MaxIconRleSize(size_t count);
+
+// Encodes count samples that are stride bytes apart, like one channel of RGBA
+// pixels. Returns the number of bytes written to out.
+size_t EncodeIconRle(const uint8_t* samples, size_t count, size_t stride,
+                     uint8_t* out);
+
+// Decodes count samples from data into samples, stride bytes apart. Returns
+// the number of bytes of data used, or 0 if data ends early or has more than
+// count samples.
+size_t DecodeIconRle(const uint8_t* data, size_t size, uint8_t* samples,
+                     size_t count, size_t stride);
+
+#endif  // LEGACY_H_
@@ -0,0 +1,941 @@
+// -*- Mode: c; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+//
+// Copyright (c) 2017, Arjan van Leeuwen
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "png.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <zlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "jobs.h"
+
+static const uint8_t kSignature[] = {0x89, 'P', 'N', 'G', '\r', '\n',
+                                     0x1a, '\n'};
+static const uint32_t kHeaderChunk = 'IHDR';
+static const uint32_t kImageDataChunk = 'IDAT';
+static const uint32_t kPaletteChunk = 'PLTE';
+static const uint32_t kTransparencyChunk = 'tRNS';
+static const uint32_t kImageEndChunk = 'IEND';
+// Sizes of the length, type and CRC fields around the data of a chunk.
+static const size_t kChunkOverhead = 12;
+static const uint32_t kMaxChunkLength = 0x7fffffff;
+
+// Deflate blocks of this size are compressed independently, as in pigz.
+static const size_t kDeflateBlockSize = 128 * 1024;
+static const size_t kDeflateWindowSize = 32 * 1024;
+
+// Number of channels for each color type, 0 for invalid color types.
+static const uint8_t kChannels[] = {1, 0, 3, 1, 2, 0, 4};
+
+// Starting column and row and the steps between pixels of the passes of
+// Adam7 interlacing.
+static const struct {
+  uint8_t x;
+  uint8_t y;
+  uint8_t dx;
+  uint8_t dy;
+} kAdam7Passes[] = {
+    {0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4},
+    {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}
+};
+enum { kAdam7PassCount = sizeof(kAdam7Passes) / sizeof(*kAdam7Passes) };
+
+static uint32_t LoadUint32(const uint8_t* data) {
+  return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 |
+         (uint32_t)data[2] << 8 | data[3];
+}
+
+static void StoreUint32(uint32_t value, uint8_t* data) {
+  data[0] = value >> 24;
+  data[1] = value >> 16;
+  data[2] = value >> 8;
+  data[3] = value;
+}
+
+bool ReadPngHeader(const uint8_t* png, size_t size, PngHeader* header) {
+  if (size < sizeof(kSignature) + kChunkOverhead + 13 ||
+      memcmp(png, kSignature, sizeof(kSignature)) != 0 ||
+      LoadUint32(png + 8) != 13 || LoadUint32(png + 12) != kHeaderChunk)
+    return false;
+
+  const uint8_t* fields = png + 16;
+  header->width = LoadUint32(fields);
+  header->height = LoadUint32(fields + 4);
+  header->bit_depth = fields[8];
+  header->color_type = fields[9];
+  header->interlace_method = fields[12];
+  if (header->width == 0 || header->width > kMaxChunkLength ||
+      header->height == 0 || header->height > kMaxChunkLength ||
+      fields[10] != 0 || fields[11] != 0 || header->interlace_method > 1 ||
+      header->color_type >= sizeof(kChannels) ||
+      !kChannels[header->color_type])
+    return false;
+
+  // Allowed bit depths are 1, 2, 4, 8 and 16, with only 8 and 16 for color
+  // types with more than one channel and no 16 for palettes.
+  switch (header->bit_depth) {
+    case 1:
+    case 2:
+    case 4:
+      return header->color_type == 0 || header->color_type == 3;
+    case 8:
+      return true;
+    case 16:
+      return header->color_type != 3;
+    default:
+      return false;
+  }
+}
+
+bool NextPngChunk(const uint8_t* png, size_t size, size_t* offset,
+                  PngChunk* chunk) {
+  if (*offset > size || size - *offset < kChunkOverhead)
+    return false;
+
+  chunk->length = LoadUint32(png + *offset);
+  chunk->type = LoadUint32(png + *offset + 4);
+  chunk->data = png + *offset + 8;
+  if (chunk->length > size - *offset - kChunkOverhead)
+    return false;
+
+  *offset += kChunkOverhead + chunk->length;
+  return true;
+}
+
+size_t PngBitsPerPixel(const PngHeader* header) {
+  return kChannels[header->color_type] * header->bit_depth;
+}
+
+size_t PngRowSize(const PngHeader* header, uint32_t width) {
+  return ((uint64_t)width * PngBitsPerPixel(header) + 7) / 8;
+}
+
+// Width and height of a pass of an interlaced image, which can be empty for
+// small images.
+static void GetPassSize(const PngHeader* header, int pass, uint32_t* width,
+                        uint32_t* height) {
+  const uint32_t x = kAdam7Passes[pass].x;
+  const uint32_t y = kAdam7Passes[pass].y;
+  *width = header->width > x
+               ? (header->width - x - 1) / kAdam7Passes[pass].dx + 1
+               : 0;
+  *height = header->height > y
+                ? (header->height - y - 1) / kAdam7Passes[pass].dy + 1
+                : 0;
+}
+
+uint64_t PngImageDataSize(const PngHeader* header) {
+  if (!header->interlace_method)
+    return (uint64_t)header->height * (1 + PngRowSize(header, header->width));
+
+  uint64_t size = 0;
+  for (int pass = 0; pass < kAdam7PassCount; pass++) {
+    uint32_t width;
+    uint32_t height;
+    GetPassSize(header, pass, &width, &height);
+    if (width && height)
+      size += (uint64_t)height * (1 + PngRowSize(header, width));
+  }
+  return size;
+}
+
+bool InflatePngData(const uint8_t* png, size_t size, uint8_t* data,
+                    size_t data_size) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit(&stream) != Z_OK)
+    return false;
+
+  stream.next_out = data;
+  stream.avail_out = data_size;
+  int result = Z_OK;
+  size_t offset = sizeof(kSignature);
+  PngChunk chunk;
+  while (result == Z_OK && NextPngChunk(png, size, &offset, &chunk)) {
+    if (chunk.type != kImageDataChunk)
+      continue;
+
+    stream.next_in = (uint8_t*)chunk.data;
+    stream.avail_in = chunk.length;
+    while (result == Z_OK && stream.avail_in > 0)
+      result = inflate(&stream, Z_NO_FLUSH);
+  }
+
+  const bool complete = result == Z_STREAM_END && stream.avail_out == 0;
+  inflateEnd(&stream);
+  return complete;
+}
+
+static uint8_t PaethPredictor(uint8_t left, uint8_t up, uint8_t up_left) {
+  const int estimate = left + up - up_left;
+  const int distance_left = abs(estimate - left);
+  const int distance_up = abs(estimate - up);
+  const int distance_up_left = abs(estimate - up_left);
+  const uint8_t closer = distance_up <= distance_up_left ? up : up_left;
+  return distance_left <= distance_up && distance_left <= distance_up_left
+             ? left
+             : closer;
+}
+
+#ifdef __SSE2__
+// Sub, Average and Paeth depend on the pixel before, so they go from pixel to
+// pixel, with all bytes of a pixel in one register. Each size is loaded and
+// stored without going through memory in between, and the switch on the size
+// folds away where it's a constant.
+static inline __m128i LoadPixel(const uint8_t* pixel, size_t pixel_size) {
+  uint32_t low = 0;
+  uint16_t high;
+  switch (pixel_size) {
+    case 3:
+      low = pixel[0] | pixel[1] << 8 | (uint32_t)pixel[2] << 16;
+      return _mm_cvtsi32_si128(low);
+    case 4:
+      memcpy(&low, pixel, 4);
+      return _mm_cvtsi32_si128(low);
+    case 6:
+      memcpy(&low, pixel, 4);
+      memcpy(&high, pixel + 4, 2);
+      return _mm_unpacklo_epi32(_mm_cvtsi32_si128(low),
+                                _mm_cvtsi32_si128(high));
+    default:
+      return _mm_loadl_epi64((const __m128i*)pixel);
+  }
+}
+
+static inline void StorePixel(__m128i value, uint8_t* pixel,
+                              size_t pixel_size) {
+  const uint32_t low = _mm_cvtsi128_si32(value);
+  const uint16_t high = _mm_cvtsi128_si32(_mm_srli_si128(value, 4));
+  switch (pixel_size) {
+    case 3:
+      pixel[0] = low;
+      pixel[1] = low >> 8;
+      pixel[2] = low >> 16;
+      break;
+    case 4:
+      memcpy(pixel, &low, 4);
+      break;
+    case 6:
+      memcpy(pixel, &low, 4);
+      memcpy(pixel + 4, &high, 2);
+      break;
+    default:
+      _mm_storel_epi64((__m128i*)pixel, value);
+      break;
+  }
+}
+
+static inline void UnfilterSubSse2(uint8_t* pixels, size_t row_size,
+                                   size_t pixel_size) {
+  __m128i left = _mm_setzero_si128();
+  for (size_t i = 0; i < row_size; i += pixel_size) {
+    left = _mm_add_epi8(LoadPixel(pixels + i, pixel_size), left);
+    StorePixel(left, pixels + i, pixel_size);
+  }
+}
+
+static inline void UnfilterAverageSse2(uint8_t* pixels,
+                                       const uint8_t* previous,
+                                       size_t row_size, size_t pixel_size) {
+  // _mm_avg_epu8 rounds up, the filter rounds down.
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i left = _mm_setzero_si128();
+  for (size_t i = 0; i < row_size; i += pixel_size) {
+    const __m128i up = LoadPixel(previous + i, pixel_size);
+    const __m128i average =
+        _mm_sub_epi8(_mm_avg_epu8(left, up),
+                     _mm_and_si128(_mm_xor_si128(left, up), one));
+    left = _mm_add_epi8(LoadPixel(pixels + i, pixel_size), average);
+    StorePixel(left, pixels + i, pixel_size);
+  }
+}
+
+static inline __m128i Absolute16(__m128i value) {
+  return _mm_max_epi16(value, _mm_sub_epi16(_mm_setzero_si128(), value));
+}
+
+// Returns values where mask is set, and others where it isn't.
+static inline __m128i Select(__m128i mask, __m128i values, __m128i others) {
+  return _mm_or_si128(_mm_and_si128(mask, values),
+                      _mm_andnot_si128(mask, others));
+}
+
+// Paeth on 16-bit lanes, where the distances fit. With left and up-left
+// starting at zero, the first pixel picks up like the filter says.
+static inline void UnfilterPaethSse2(uint8_t* pixels, const uint8_t* previous,
+                                     size_t row_size, size_t pixel_size) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i left = zero;
+  __m128i up_left = zero;
+  for (size_t i = 0; i < row_size; i += pixel_size) {
+    const __m128i up =
+        _mm_unpacklo_epi8(LoadPixel(previous + i, pixel_size), zero);
+    // The distances of the estimate left + up - up_left to left, up and
+    // up_left.
+    const __m128i distance_left = Absolute16(_mm_sub_epi16(up, up_left));
+    const __m128i distance_up = Absolute16(_mm_sub_epi16(left, up_left));
+    const __m128i distance_up_left = Absolute16(
+        _mm_sub_epi16(_mm_add_epi16(left, up), _mm_add_epi16(up_left, up_left)));
+    const __m128i smallest = _mm_min_epi16(
+        distance_left, _mm_min_epi16(distance_up, distance_up_left));
+    // Ties go to left, then up.
+    __m128i predicted = up_left;
+    predicted = Select(_mm_cmpeq_epi16(distance_up, smallest), up, predicted);
+    predicted =
+        Select(_mm_cmpeq_epi16(distance_left, smallest), left, predicted);
+
+    const __m128i filtered = LoadPixel(pixels + i, pixel_size);
+    const __m128i value =
+        _mm_add_epi8(filtered, _mm_packus_epi16(predicted, zero));
+    StorePixel(value, pixels + i, pixel_size);
+    left = _mm_unpacklo_epi8(value, zero);
+    up_left = up;
+  }
+}
+
+static inline void UnfilterPixelsSse2(int type, uint8_t* pixels,
+                                      const uint8_t* previous,
+                                      size_t row_size, size_t pixel_size) {
+  if (type == 1)
+    UnfilterSubSse2(pixels, row_size, pixel_size);
+  else if (type == 3)
+    UnfilterAverageSse2(pixels, previous, row_size, pixel_size);
+  else
+    UnfilterPaethSse2(pixels, previous, row_size, pixel_size);
+}
+
+// Unfilters a row with Sub, Average or Paeth, for pixels of 3, 4, 6 or 8
+// bytes: 8- and 16-bit RGB and RGBA, and 16-bit grey with alpha. Returns false
+// for other rows, which are left to the scalar loops.
+static bool UnfilterRowSse2(int type, uint8_t* pixels, const uint8_t* previous,
+                            size_t row_size, size_t pixel_size) {
+  switch (pixel_size) {
+    case 3:
+      UnfilterPixelsSse2(type, pixels, previous, row_size, 3);
+      return true;
+    case 4:
+      UnfilterPixelsSse2(type, pixels, previous, row_size, 4);
+      return true;
+    case 6:
+      UnfilterPixelsSse2(type, pixels, previous, row_size, 6);
+      return true;
+    case 8:
+      UnfilterPixelsSse2(type, pixels, previous, row_size, 8);
+      return true;
+    default:
+      return false;
+  }
+}
+#endif
+
+// Unfilters rows of a single image or pass. previous is the row above, NULL
+// for the first one. Filters work on bytes, with left being the byte of the
+// pixel before, or the byte before for pixels smaller than a byte.
+//
+// The checks for the first row and the first pixel are kept out of the inner
+// loops, so the compiler can vectorize Up. Sub, Average and Paeth depend on
+// the byte a pixel before, and are scalar here; with SSE2 the bytes of a pixel
+// are done together by UnfilterRowSse2.
+static bool UnfilterRows(uint8_t* rows, uint32_t count, size_t row_size,
+                         size_t pixel_size) {
+  const uint8_t* previous = NULL;
+  for (uint32_t y = 0; y < count; y++) {
+    uint8_t* row = rows + y * (row_size + 1);
+    uint8_t* pixels = row + 1;
+    const size_t first = MIN(pixel_size, row_size);
+    int type = row[0];
+    // Without a row above, Up adds nothing, and Paeth always picks left.
+    if (!previous && (type == 2 || type == 4))
+      type = type == 2 ? 0 : 1;
+
+#ifdef __SSE2__
+    if ((type == 1 || (previous && (type == 3 || type == 4))) &&
+        UnfilterRowSse2(type, pixels, previous, row_size, pixel_size)) {
+      row[0] = 0;
+      previous = pixels;
+      continue;
+    }
+#endif
+
+    switch (type) {
+      case 0:
+        break;
+      case 1:
+        for (size_t i = pixel_size; i < row_size; i++)
+          pixels[i] += pixels[i - pixel_size];
+        break;
+      case 2:
+        for (size_t i = 0; i < row_size; i++)
+          pixels[i] += previous[i];
+        break;
+      case 3:
+        if (!previous) {
+          for (size_t i = pixel_size; i < row_size; i++)
+            pixels[i] += pixels[i - pixel_size] / 2;
+          break;
+        }
+        for (size_t i = 0; i < first; i++)
+          pixels[i] += previous[i] / 2;
+        for (size_t i = pixel_size; i < row_size; i++)
+          pixels[i] += (pixels[i - pixel_size] + previous[i]) / 2;
+        break;
+      case 4:
+        // The first pixel has no left or up-left, which leaves up.
+        for (size_t i = 0; i < first; i++)
+          pixels[i] += previous[i];
+        for (size_t i = pixel_size; i < row_size; i++)
+          pixels[i] += PaethPredictor(pixels[i - pixel_size], previous[i],
+                                      previous[i - pixel_size]);
+        break;
+      default:
+        return false;
+    }
+    row[0] = 0;
+    previous = pixels;
+  }
+  return true;
+}
+
+static size_t FilterPixelSize(const PngHeader* header) {
+  const size_t bits = PngBitsPerPixel(header);
+  return bits >= 8 ? bits / 8 : 1;
+}
+
+bool UnfilterPngData(const PngHeader* header, uint8_t* data) {
+  const size_t pixel_size = FilterPixelSize(header);
+  if (!header->interlace_method)
+    return UnfilterRows(data, header->height,
+                        PngRowSize(header, header->width), pixel_size);
+
+  for (int pass = 0; pass < kAdam7PassCount; pass++) {
+    uint32_t width;
+    uint32_t height;
+    GetPassSize(header, pass, &width, &height);
+    if (!width || !height)
+      continue;
+
+    const size_t row_size = PngRowSize(header, width);
+    if (!UnfilterRows(data, height, row_size, pixel_size))
+      return false;
+    data += (size_t)height * (row_size + 1);
+  }
+  return true;
+}
+
+// Filters a row with the given filter type into filtered, and returns the sum
+// of the filtered bytes taken as signed values, the usual estimate of how
+// well the row compresses.
+static uint64_t FilterRow(int type, const uint8_t* pixels,
+                          const uint8_t* previous, size_t row_size,
+                          size_t pixel_size, uint8_t* filtered) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < row_size; i++) {
+    const uint8_t left = i >= pixel_size ? pixels[i - pixel_size] : 0;
+    const uint8_t up = previous ? previous[i] : 0;
+    const uint8_t up_left =
+        previous && i >= pixel_size ? previous[i - pixel_size] : 0;
+    uint8_t value = pixels[i];
+    switch (type) {
+      case 1:
+        value -= left;
+        break;
+      case 2:
+        value -= up;
+        break;
+      case 3:
+        value -= (left + up) / 2;
+        break;
+      case 4:
+        value -= PaethPredictor(left, up, up_left);
+        break;
+    }
+    filtered[i] = value;
+    sum += value < 128 ? value : 256 - value;
+  }
+  return sum;
+}
+
+bool FilterPngData(const PngHeader* header, const uint8_t* data,
+                   uint8_t* filtered) {
+  const size_t row_size = PngRowSize(header, header->width);
+  const size_t pixel_size = FilterPixelSize(header);
+  // Images with a palette or less than a byte per pixel rarely gain from
+  // filtering, so they are left unfiltered like most encoders do.
+  const int filter_count =
+      header->color_type == 3 || header->bit_depth < 8 ? 1 : 5;
+
+  uint8_t* trial = malloc(row_size);
+  if (!trial)
+    return false;
+
+  const uint8_t* previous = NULL;
+  for (uint32_t y = 0; y < header->height; y++) {
+    const uint8_t* pixels = data + y * (row_size + 1) + 1;
+    uint8_t* row = filtered + y * (row_size + 1);
+    uint64_t best_sum = FilterRow(0, pixels, previous, row_size, pixel_size,
+                                  row + 1);
+    row[0] = 0;
+    for (int type = 1; type < filter_count; type++) {
+      const uint64_t sum =
+          FilterRow(type, pixels, previous, row_size, pixel_size, trial);
+      if (sum < best_sum) {
+        best_sum = sum;
+        row[0] = type;
+        memcpy(row + 1, trial, row_size);
+      }
+    }
+    previous = pixels;
+  }
+
+  free(trial);
+  return true;
+}
+
+void DeinterlacePngData(const PngHeader* header, const uint8_t* passes,
+                        uint8_t* image) {
+  const size_t bits = PngBitsPerPixel(header);
+  const size_t image_row_size = PngRowSize(header, header->width) + 1;
+  for (int pass = 0; pass < kAdam7PassCount; pass++) {
+    uint32_t width;
+    uint32_t height;
+    GetPassSize(header, pass, &width, &height);
+    if (!width || !height)
+      continue;
+
+    const size_t row_size = PngRowSize(header, width) + 1;
+    for (uint32_t y = 0; y < height; y++) {
+      const uint8_t* from = passes + y * row_size + 1;
+      uint8_t* to = image +
+                    (kAdam7Passes[pass].y + (size_t)y * kAdam7Passes[pass].dy) *
+                        image_row_size + 1;
+      for (uint32_t x = 0; x < width; x++) {
+        const size_t target_x =
+            kAdam7Passes[pass].x + (size_t)x * kAdam7Passes[pass].dx;
+        if (bits >= 8) {
+          memcpy(to + target_x * (bits / 8), from + x * (bits / 8), bits / 8);
+          continue;
+        }
+
+        // Pixels smaller than a byte are packed from the most significant
+        // bit down.
+        const size_t from_bit = x * bits;
+        const size_t to_bit = target_x * bits;
+        const uint8_t value =
+            (from[from_bit / 8] >> (8 - bits - from_bit % 8)) &
+            ((1 << bits) - 1);
+        to[to_bit / 8] |= value << (8 - bits - to_bit % 8);
+      }
+    }
+    passes += (size_t)height * row_size;
+  }
+}
+
+typedef struct {
+  const uint8_t* data;
+  size_t size;
+  size_t block_count;
+  // Per block: the deflated data, its size and the Adler-32 of the input.
+  uint8_t** blocks;
+  size_t* block_sizes;
+  uLong* checksums;
+} DeflateJob;
+
+// Deflates one block as raw deflate data. Every block but the last ends on a
+// byte boundary with a sync flush, so the blocks can be put one after the
+// other.
+static bool DeflateBlock(void* context, size_t index) {
+  DeflateJob* job = context;
+  const size_t start = index * kDeflateBlockSize;
+  const size_t length = MIN(kDeflateBlockSize, job->size - start);
+  const bool last = index == job->block_count - 1;
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 9,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+
+  // Priming the block with the data before it keeps matches across block
+  // boundaries, so splitting costs very little compression.
+  const size_t window = MIN(start, kDeflateWindowSize);
+  bool deflated = window == 0 ||
+                  deflateSetDictionary(&stream, job->data + start - window,
+                                       window) == Z_OK;
+
+  size_t capacity = deflateBound(&stream, length) + 16;
+  uint8_t* out = deflated ? malloc(capacity) : NULL;
+  stream.next_in = (uint8_t*)job->data + start;
+  stream.avail_in = length;
+  stream.next_out = out;
+  stream.avail_out = capacity;
+  while (out) {
+    const int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (result == Z_STREAM_END ||
+        (!last && result == Z_OK && stream.avail_out > 0))
+      break;
+    if (result != Z_OK && result != Z_BUF_ERROR) {
+      deflated = false;
+      break;
+    }
+
+    uint8_t* grown = realloc(out, capacity * 2);
+    if (!grown) {
+      deflated = false;
+      break;
+    }
+    out = grown;
+    stream.next_out = out + capacity;
+    stream.avail_out = capacity;
+    capacity *= 2;
+  }
+
+  job->blocks[index] = out;
+  job->block_sizes[index] = stream.total_out;
+  job->checksums[index] = adler32(adler32(0L, Z_NULL, 0), job->data + start,
+                                  length);
+  deflateEnd(&stream);
+  return out && deflated;
+}
+
+bool DeflatePngData(const uint8_t* data, size_t size, int jobs,
+                    uint8_t** deflated, size_t* deflated_size) {
+  DeflateJob job = {
+      .data = data,
+      .size = size,
+      .block_count = size ? (size - 1) / kDeflateBlockSize + 1 : 1};
+  job.blocks = calloc(job.block_count, sizeof(*job.blocks));
+  job.block_sizes = calloc(job.block_count, sizeof(*job.block_sizes));
+  job.checksums = calloc(job.block_count, sizeof(*job.checksums));
+  bool success = job.blocks && job.block_sizes && job.checksums &&
+                 RunInParallel(DeflateBlock, &job, job.block_count, jobs);
+  // Blocks fail for lack of memory, on threads with their own errno.
+  if (!success)
+    errno = ENOMEM;
+
+  // The zlib stream is a two byte header for the best compression level, the
+  // blocks, and the Adler-32 of all data.
+  size_t total_size = 2 + 4;
+  uLong checksum = adler32(0L, Z_NULL, 0);
+  for (size_t i = 0; success && i < job.block_count; i++) {
+    const size_t start = i * kDeflateBlockSize;
+    total_size += job.block_sizes[i];
+    checksum = adler32_combine(checksum, job.checksums[i],
+                               MIN(kDeflateBlockSize, size - start));
+  }
+
+  uint8_t* out = success ? malloc(total_size) : NULL;
+  if (out) {
+    out[0] = 0x78;
+    out[1] = 0xda;
+    size_t offset = 2;
+    for (size_t i = 0; i < job.block_count; i++) {
+      memcpy(out + offset, job.blocks[i], job.block_sizes[i]);
+      offset += job.block_sizes[i];
+    }
+    StoreUint32(checksum, out + offset);
+    *deflated = out;
+    *deflated_size = total_size;
+  }
+
+  for (size_t i = 0; job.blocks && i < job.block_count; i++)
+    free(job.blocks[i]);
+  free(job.blocks);
+  free(job.block_sizes);
+  free(job.checksums);
+  return out != NULL;
+}
+
+// Reads sample number index of a row of unfiltered pixels.
+static uint16_t ReadSample(const uint8_t* row, size_t index, int bit_depth) {
+  if (bit_depth == 16)
+    return row[index * 2] << 8 | row[index * 2 + 1];
+  if (bit_depth == 8)
+    return row[index];
+
+  const size_t bit = index * bit_depth;
+  return (row[bit / 8] >> (8 - bit_depth - bit % 8)) & ((1 << bit_depth) - 1);
+}
+
+bool DecodePngImage(const uint8_t* png, size_t size, const PngHeader* header,
+                    uint16_t* pixels) {
+  const uint8_t* palette = NULL;
+  uint32_t palette_size = 0;
+  const uint8_t* transparency = NULL;
+  uint32_t transparency_size = 0;
+  size_t offset = sizeof(kSignature);
+  PngChunk chunk;
+  while (NextPngChunk(png, size, &offset, &chunk)) {
+    if (chunk.type == kPaletteChunk) {
+      palette = chunk.data;
+      palette_size = chunk.length / 3;
+    } else if (chunk.type == kTransparencyChunk) {
+      transparency = chunk.data;
+      transparency_size = chunk.length;
+    }
+  }
+  if (header->color_type == 3 && !palette)
+    return false;
+
+  const size_t data_size = PngImageDataSize(header);
+  uint8_t* data = malloc(data_size);
+  if (!data || !InflatePngData(png, size, data, data_size) ||
+      !UnfilterPngData(header, data)) {
+    free(data);
+    return false;
+  }
+
+  uint8_t* rows = data;
+  if (header->interlace_method) {
+    PngHeader image_header = *header;
+    image_header.interlace_method = 0;
+    rows = calloc(PngImageDataSize(&image_header), 1);
+    if (!rows) {
+      free(data);
+      return false;
+    }
+    DeinterlacePngData(header, data, rows);
+    free(data);
+  }
+
+  const int bit_depth = header->bit_depth;
+  const size_t channels = kChannels[header->color_type];
+  const size_t row_size = PngRowSize(header, header->width) + 1;
+  const uint16_t scale = 65535 / ((1 << bit_depth) - 1);
+  // The color that is transparent for color types without alpha.
+  uint16_t key[3] = {0};
+  const bool has_key = transparency && (header->color_type == 0 ||
+                                        header->color_type == 2) &&
+                       transparency_size >= channels * 2;
+  for (size_t i = 0; has_key && i < channels; i++)
+    key[i] = ReadSample(transparency, i, 16);
+
+  bool decoded = true;
+  for (uint32_t y = 0; decoded && y < header->height; y++) {
+    const uint8_t* row = rows + y * row_size + 1;
+    uint16_t* pixel = pixels + (size_t)y * header->width * 4;
+    for (uint32_t x = 0; x < header->width; x++, pixel += 4) {
+      uint16_t samples[4];
+      for (size_t i = 0; i < channels; i++)
+        samples[i] = ReadSample(row, x * channels + i, bit_depth);
+
+      switch (header->color_type) {
+        case 0:
+        case 2: {
+          const bool grey = header->color_type == 0;
+          pixel[0] = samples[0] * scale;
+          pixel[1] = samples[grey ? 0 : 1] * scale;
+          pixel[2] = samples[grey ? 0 : 2] * scale;
+          pixel[3] = has_key && samples[0] == key[0] &&
+                             (grey || (samples[1] == key[1] &&
+                                       samples[2] == key[2]))
+                         ? 0
+                         : 65535;
+          break;
+        }
+        case 3:
+          if (samples[0] >= palette_size) {
+            decoded = false;
+            break;
+          }
+          for (size_t i = 0; i < 3; i++)
+            pixel[i] = palette[samples[0] * 3 + i] * 257;
+          pixel[3] = samples[0] < transparency_size
+                         ? transparency[samples[0]] * 257
+                         : 65535;
+          break;
+        case 4:
+          pixel[0] = pixel[1] = pixel[2] = samples[0] * scale;
+          pixel[3] = samples[1] * scale;
+          break;
+        case 6:
+          for (size_t i = 0; i < 4; i++)
+            pixel[i] = samples[i] * scale;
+          break;
+      }
+    }
+  }
+
+  free(rows);
+  return decoded;
+}
+
+bool DecodePngImageRgba8(const uint8_t* png, size_t size,
+                         const PngHeader* header, uint8_t* pixels) {
+  const size_t pixel_count = (size_t)header->width * header->height;
+  if (header->color_type != 6 || header->bit_depth != 8 ||
+      header->interlace_method) {
+    uint16_t* wide = malloc(pixel_count * 4 * sizeof(*wide));
+    bool decoded = wide && DecodePngImage(png, size, header, wide);
+    for (size_t i = 0; decoded && i < pixel_count * 4; i++)
+      pixels[i] = (wide[i] + 128) / 257;
+    free(wide);
+    return decoded;
+  }
+
+  // The rows of 8-bit RGBA only have to lose their filter type byte.
+  const size_t data_size = PngImageDataSize(header);
+  const size_t row_size = (size_t)header->width * 4;
+  uint8_t* data = malloc(data_size);
+  bool decoded = data && InflatePngData(png, size, data, data_size) &&
+                 UnfilterPngData(header, data);
+  for (uint32_t y = 0; decoded && y < header->height; y++)
+    memcpy(pixels + y * row_size, data + y * (row_size + 1) + 1, row_size);
+  free(data);
+  return decoded;
+}
+
+// Writes a chunk to out and returns the position after it.
+static uint8_t* PutChunk(uint32_t type, const uint8_t* data, uint32_t length,
+                         uint8_t* out) {
+  StoreUint32(length, out);
+  StoreUint32(type, out + 4);
+  if (length)
+    memcpy(out + 8, data, length);
+  StoreUint32(crc32(crc32(0L, Z_NULL, 0), out + 4, length + 4),
+              out + 8 + length);
+  return out + kChunkOverhead + length;
+}
+
+bool ReplacePngImageData(const uint8_t* png, size_t size,
+                         const PngHeader* header,
+                         const PngChunk* palette_chunks,
+                         size_t palette_chunk_count, const uint8_t* deflated,
+                         size_t deflated_size, uint8_t** rebuilt,
+                         size_t* rebuilt_size) {
+  // Worst case, the image data is split over several chunks and every other
+  // chunk is kept.
+  size_t capacity = size + deflated_size +
+                    (deflated_size / kMaxChunkLength + 1) * kChunkOverhead;
+  for (size_t i = 0; i < palette_chunk_count; i++)
+    capacity += palette_chunks[i].length + kChunkOverhead;
+  uint8_t* out = malloc(capacity);
+  if (!out)
+    return false;
+
+  memcpy(out, kSignature, sizeof(kSignature));
+  uint8_t* position = out + sizeof(kSignature);
+  bool written_data = false;
+  size_t offset = sizeof(kSignature);
+  PngChunk chunk;
+  while (NextPngChunk(png, size, &offset, &chunk)) {
+    if (chunk.type == kHeaderChunk) {
+      uint8_t fields[13];
+      memcpy(fields, chunk.data, sizeof(fields));
+      StoreUint32(header->width, fields);
+      StoreUint32(header->height, fields + 4);
+      fields[8] = header->bit_depth;
+      fields[9] = header->color_type;
+      fields[12] = header->interlace_method;
+      position = PutChunk(kHeaderChunk, fields, sizeof(fields), position);
+    } else if (palette_chunks && (chunk.type == kPaletteChunk ||
+                                  chunk.type == kTransparencyChunk)) {
+      continue;
+    } else if (chunk.type != kImageDataChunk) {
+      memcpy(position, chunk.data - 8, chunk.length + kChunkOverhead);
+      position += chunk.length + kChunkOverhead;
+    } else if (!written_data) {
+      for (size_t i = 0; i < palette_chunk_count; i++)
+        position = PutChunk(palette_chunks[i].type, palette_chunks[i].data,
+                            palette_chunks[i].length, position);
+      for (size_t written = 0; written < deflated_size;) {
+        const uint32_t length = MIN(deflated_size - written, kMaxChunkLength);
+        position = PutChunk(kImageDataChunk, deflated + written, length,
+                            position);
+        written += length;
+      }
+      written_data = true;
+    }
+  }
+
+  *rebuilt = out;
+  *rebuilt_size = position - out;
+  return true;
+}
+
+// Builds a PNG file with header and the zlib stream in deflated as its image
+// data.
+static bool BuildPngImage(const PngHeader* header, const uint8_t* deflated,
+                          size_t deflated_size, uint8_t** png, size_t* size) {
+  // A minimal PNG to hold the header, so ReplacePngImageData can do the rest.
+  uint8_t fields[13] = {0};
+  StoreUint32(header->width, fields);
+  StoreUint32(header->height, fields + 4);
+  fields[8] = header->bit_depth;
+  fields[9] = header->color_type;
+  fields[12] = header->interlace_method;
+  uint8_t empty[sizeof(kSignature) + 3 * kChunkOverhead + sizeof(fields)];
+  memcpy(empty, kSignature, sizeof(kSignature));
+  uint8_t* position = PutChunk(kHeaderChunk, fields, sizeof(fields),
+                               empty + sizeof(kSignature));
+  position = PutChunk(kImageDataChunk, NULL, 0, position);
+  PutChunk(kImageEndChunk, NULL, 0, position);
+
+  return ReplacePngImageData(empty, sizeof(empty), header, NULL, 0, deflated,
+                             deflated_size, png, size);
+}
+
+bool EncodePngImage(const PngHeader* header, const uint8_t* data, int jobs,
+                    uint8_t** png, size_t* size) {
+  const size_t data_size = PngImageDataSize(header);
+  uint8_t* filtered = malloc(data_size);
+  uint8_t* deflated = NULL;
+  size_t deflated_size = 0;
+  if (!filtered || !FilterPngData(header, data, filtered) ||
+      !DeflatePngData(filtered, data_size, jobs, &deflated, &deflated_size)) {
+    free(filtered);
+    return false;
+  }
+  free(filtered);
+
+  const bool encoded =
+      BuildPngImage(header, deflated, deflated_size, png, size);
+  free(deflated);
+  return encoded;
+}
+
+bool EncodePngImageFast(const PngHeader* header, const uint8_t* data,
+                        uint8_t** png, size_t* size) {
+  const size_t data_size = PngImageDataSize(header);
+  uLongf deflated_size = compressBound(data_size);
+  uint8_t* deflated = malloc(deflated_size);
+  if (!deflated || compress2(deflated, &deflated_size, data, data_size,
+                             Z_BEST_SPEED) != Z_OK) {
+    free(deflated);
+    return false;
+  }
+
+  const bool encoded =
+      BuildPngImage(header, deflated, deflated_size, png, size);
+  free(deflated);
+  return encoded;
+}
@@ -0,0 +1,141 @@
+// -*- Mode: c; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+//
+// Copyright (c) 2017, Arjan van Leeuwen
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// Decoding and encoding the image data of PNG files, see
+// https://www.w3.org/TR/png/
+
+#ifndef PNG_H_
+#define PNG_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The fields of the IHDR chunk.
+typedef struct {
+  uint32_t width;
+  uint32_t height;
+  uint8_t bit_depth;
+  uint8_t color_type;
+  uint8_t interlace_method;
+} PngHeader;
+
+// A chunk of a PNG file in memory.
+typedef struct {
+  uint32_t type;
+  const uint8_t* data;
+  uint32_t length;
+} PngChunk;
+
+// Reads the header of the PNG file in png. Returns false if png isn't a PNG
+// file, or one with an invalid header.
+bool ReadPngHeader(const uint8_t* png, size_t size, PngHeader* header);
+
+// Reads the chunk at *offset in png and moves *offset to the next one. Start
+// with *offset set to 8 to skip the signature. Returns false at the end of the
+// file, or for a chunk that doesn't fit.
+bool NextPngChunk(const uint8_t* png, size_t size, size_t* offset,
+                  PngChunk* chunk);
+
+// Number of bits per pixel.
+size_t PngBitsPerPixel(const PngHeader* header);
+
+// Number of bytes in a row of pixels of the given width, without the filter
+// type byte.
+size_t PngRowSize(const PngHeader* header, uint32_t width);
+
+// Size of the image data once inflated: a filter type byte and the pixels of
+// every row, of every pass for an interlaced image.
+uint64_t PngImageDataSize(const PngHeader* header);
+
+// Inflates the image data in the IDAT chunks of png into data, which holds
+// exactly PngImageDataSize() bytes. Returns false if the image data is corrupt
+// or has a different size.
+bool InflatePngData(const uint8_t* png, size_t size, uint8_t* data,
+                    size_t data_size);
+
+// Undoes the filter of every row of inflated image data in place, leaving a
+// filter type of 0 (None). Returns false for an unknown filter type.
+bool UnfilterPngData(const PngHeader* header, uint8_t* data);
+
+// Filters the rows of unfiltered, non-interlaced image data into filtered,
+// picking the filter for each row that is likely to compress best. Returns
+// false if out of memory.
+bool FilterPngData(const PngHeader* header, const uint8_t* data,
+                   uint8_t* filtered);
+
+// Puts the pixels of the unfiltered passes of an interlaced image in their
+// place in image, which holds the image data of the same image without
+// interlacing and starts out zeroed.
+void DeinterlacePngData(const PngHeader* header, const uint8_t* passes,
+                        uint8_t* image);
+
+// Deflates image data into a zlib stream at the highest compression level.
+// The data is split in blocks that are compressed by up to jobs threads, each
+// primed with the data before it, so the result doesn't depend on the number
+// of threads. The caller frees *deflated. Returns false if out of memory, with
+// errno set.
+bool DeflatePngData(const uint8_t* data, size_t size, int jobs,
+                    uint8_t** deflated, size_t* deflated_size);
+
+// Builds a PNG file from the unfiltered, non-interlaced image data in data,
+// which is filtered and deflated like FilterPngData and DeflatePngData do.
+// The caller frees *png. Returns false if out of memory, with errno set.
+bool EncodePngImage(const PngHeader* header, const uint8_t* data, int jobs,
+                    uint8_t** png, size_t* size);
+
+// Builds a PNG file like EncodePngImage, but as fast as possible: the rows
+// keep their filter type and are deflated at the fastest level, on the
+// calling thread. Meant for small images that are made in bulk.
+bool EncodePngImageFast(const PngHeader* header, const uint8_t* data,
+                        uint8_t** png, size_t* size);
+
+// Decodes the PNG in png into pixels, which holds width * height pixels of
+// red, green, blue and alpha. Samples are scaled to 16 bits, so the pixels of
+// two PNGs can be compared whatever their format. Returns false if the image
+// is corrupt.
+bool DecodePngImage(const uint8_t* png, size_t size, const PngHeader* header,
+                    uint16_t* pixels);
+
+// Decodes the PNG in png into pixels like DecodePngImage, but with 8-bit
+// samples. 8-bit RGBA images, the usual kind in icons, are copied straight
+// from the unfiltered rows.
+bool DecodePngImageRgba8(const uint8_t* png, size_t size,
+                         const PngHeader* header, uint8_t* pixels);
+
+// Builds a copy of png with the header replaced by header and the IDAT chunks
+// replaced by deflated. If palette_chunks isn't NULL, the PLTE and tRNS chunks
+// of png are left out and palette_chunks are written right before the image
+// data instead. The caller frees *rebuilt.
+bool ReplacePngImageData(const uint8_t* png, size_t size,
+                         const PngHeader* header,
+                         const PngChunk* palette_chunks,
+                         size_t palette_chunk_count, const uint8_t* deflated,
+                         size_t deflated_size, uint8_t** rebuilt,
+                         size_t* rebuilt_size);
+
+#endif  // PNG_H_
@@ -35,27 +35,223 @@
 
 #include <arpa/inet.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <libgen.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include <sys/clonefile.h>
+#elif defined(__linux__)
+#include <linux/fs.h>
+#endif
+
+#include "hash.h"
+#include "jobs.h"
+#include "legacy.h"
+#include "png.h"
 
 // Magic values for headers were found at
 // https://en.wikipedia.org/wiki/Apple_Icon_Image_format.
 
 enum kBufferSize { kBufferSize = 1024 };
+enum kTarBlockSize { kTarBlockSize = 512 };
 static const char kIconsetExtension[] = ".iconset";
 static const char kIcnsExtension[] = ".icns";
+static const char kTarExtension[] = ".tar";
+static const char kManifestExtension[] = ".manifest";
+static const char kPngExtension[] = ".png";
+static const char kPamExtension[] = ".pam";
+static const char kDeltaExtension[] = ".delta";
 static const char kUnknownFormatFilename[] = "icon_data_";
+static const char kStandardStreamPath[] = "-";
 static const uint32_t kMagicHeader = 'icns';
+// Seed for the second half of the address of an object in the store.
+static const uint64_t kSecondAddressSeed = 0x69636e73;
+// A delta between two .icns files starts with this magic value, the size and
+// hash of the old file and the size and hash of the new file. The records
+// that follow rebuild the new file in order: kKeepRecord with the index and
+// number of icons to copy from the old file, or kDataRecord followed by an
+// icon with its header, as in the .icns file. Icons that are left out of the
+// new file don't need a record.
+static const uint32_t kDeltaMagic = 'icnd';
+static const uint32_t kKeepRecord = 'KEEP';
+static const uint32_t kDataRecord = 'DATA';
 
 typedef struct {
   char path[MAXPATHLEN];
 } Path;
 
+// How to extract an icon with the same data as an icon extracted before.
+typedef enum {
+  kDedupeNone,
+  // Clone the earlier file where the file system supports it, write a copy
+  // otherwise.
+  kDedupeClone,
+  // Hard link to the earlier file.
+  kDedupeLink
+} DedupeMode;
+
+typedef struct {
+  // Write the iconset as a single tar stream instead of a directory.
+  bool tar_output;
+  // Path of the tar file to write, or "-" for standard output. Derived from
+  // the icns name when not set.
+  const char* output_path;
+  // Add an extension to the names of unknown icon types, based on what their
+  // data looks like.
+  bool add_extensions;
+  // Print the icons in the file instead of extracting them.
+  bool list;
+  DedupeMode dedupe;
+  // Directory of a content addressed store to put the data of icons in. Only
+  // a manifest is written for the iconset itself.
+  const char* store_path;
+  // Decode the old RGB icon types and their masks to PNG.
+  bool decode_legacy;
+  // Decode PNG icons, and legacy icons when they are decoded, to 8-bit RGBA
+  // PAM files.
+  bool pam;
+  // Number of threads that decode icons.
+  int jobs;
+  // Write a delta from this .icns file to the given one.
+  const char* diff_path;
+  // Apply this delta to the given .icns file.
+  const char* apply_path;
+} Options;
+
+// An icon that was extracted to a file of its own, so that later icons with
+// the same data can refer to it.
+typedef struct {
+  uint64_t hash;
+  uint32_t size;
+  // Where the data of the icon starts in the .icns file.
+  long offset;
+  char* icon_filename;
+} ExtractedIcon;
+
+// The old RGB icon types, with the mask that goes with them and the PNG they
+// are decoded to. Their color channels are run-length encoded one after the
+// other, the mask holds one byte of alpha per pixel. ARGB icons have no mask:
+// the "ARGB" tag is followed by the alpha channel and the color channels.
+struct {
+  uint32_t image_type;
+  uint32_t mask_type;
+  uint32_t pixel_size;
+  // Number of bytes before the encoded channels: zeros, or the "ARGB" tag.
+  uint32_t padding;
+  const char* icon_filename;
+} static const kLegacyIconTypes[] = {
+    {'is32', 's8mk', 16, 0, "icon_16x16.png"},
+    {'il32', 'l8mk', 32, 0, "icon_32x32.png"},
+    {'ih32', 'h8mk', 48, 0, "icon_48x48.png"},
+    {'it32', 't8mk', 128, 4, "icon_128x128.png"},
+    {'ic04', 0, 16, 4, "icon_16x16.png"},
+    {'ic05', 0, 32, 4, "icon_32x32.png"}
+};
+
+enum {
+  kLegacyIconTypeCount = sizeof(kLegacyIconTypes) / sizeof(*kLegacyIconTypes)
+};
+
+// The data of a legacy icon and its mask, held until all icons are read since
+// the mask can come before or after the image.
+typedef struct {
+  uint8_t* image;
+  uint32_t image_size;
+  uint8_t* mask;
+  uint32_t mask_size;
+  // Set when another icon is extracted under the name of the decoded PNG.
+  bool taken;
+} LegacyIcon;
+
+// A PNG icon that is decoded to a PAM file. The PNG is kept as is if it can't
+// be decoded.
+typedef struct {
+  char* icon_filename;
+  uint8_t* png;
+  uint32_t png_size;
+  uint8_t* pam;
+  size_t pam_size;
+} DecodedIcon;
+
+// Where extracted icons end up: files in the iconset directory, or members
+// of a tar stream when tar is set.
+typedef struct {
+  Path iconset_path;
+  FILE* tar;
+  time_t mtime;
+  bool add_extensions;
+  DedupeMode dedupe;
+  ExtractedIcon* extracted;
+  size_t extracted_count;
+  size_t extracted_capacity;
+  // Set when icons go into a content addressed store.
+  const char* store_path;
+  FILE* manifest;
+  bool decode_legacy;
+  LegacyIcon legacy[kLegacyIconTypeCount];
+  // PNG icons that are decoded to PAM files once all icons are read.
+  bool pam;
+  int jobs;
+  DecodedIcon* decoded;
+  size_t decoded_count;
+  size_t decoded_capacity;
+} IconsetOutput;
+
+// An icon of an .icns file that is compared or rebuilt as a whole.
+typedef struct {
+  uint32_t type;
+  uint32_t size;
+  uint8_t* data;
+  uint64_t hash;
+} IcnsChunk;
+
+// All icons of an .icns file, with the size from its header and a hash of
+// the whole file.
+typedef struct {
+  IcnsChunk* chunks;
+  size_t count;
+  size_t capacity;
+  uint32_t size;
+  uint64_t hash;
+} IcnsChunks;
+
+// What the data of an icon looks like, found by looking at its first bytes.
+typedef enum {
+  kPayloadUnknown,
+  kPayloadPng,
+  kPayloadJpeg2000,
+  kPayloadJpeg2000Codestream,
+  kPayloadArgb,
+  kPayloadRle,
+  kPayloadMask,
+  kPayloadPlist
+} PayloadKind;
+
+struct {
+  const char* name;
+  const char* extension;
+} static const kPayloadKinds[] = {
+    [kPayloadUnknown] = {"unknown", ""},
+    [kPayloadPng] = {"png", ".png"},
+    [kPayloadJpeg2000] = {"jpeg2000", ".jp2"},
+    [kPayloadJpeg2000Codestream] = {"j2k", ".j2k"},
+    [kPayloadArgb] = {"argb", ".argb"},
+    [kPayloadRle] = {"rle", ".rle"},
+    [kPayloadMask] = {"mask", ".mask"},
+    [kPayloadPlist] = {"bplist", ".plist"}
+};
+
 struct {
   const char* icon_filename;
   uint32_t icon_type;
@@ -86,12 +282,45 @@ void PrintSystemError() {
 }
 
 void PrintUsage(const char* own_path) {
-  fprintf(stderr, "Usage: %s [file.icns]\n", own_path);
+  fprintf(stderr,
+          "Usage: %s [options] [file.icns]\n"
+          "Options:\n"
+          "  -l, --list      List the icons in the file instead of extracting "
+          "them\n"
+          "  -s, --sniff     Add an extension to unknown icon types based on "
+          "their data\n"
+          "  -D, --dedupe[=M]\n"
+          "                  Extract icons with the same data as an earlier "
+          "icon by\n"
+          "                  cloning (M=clone, default) or hard linking "
+          "(M=link) it\n"
+          "  -t, --tar       Write the iconset as a tar stream instead of a "
+          "directory\n"
+          "  -S, --store=DIR Put the data of every icon in a content "
+          "addressed store\n"
+          "                  in DIR, and only write a manifest for the "
+          "iconset\n"
+          "  -o, --output=F  Write the tar stream, manifest or delta to F, - "
+          "for standard\n"
+          "                  output\n"
+          "  -L, --decode-legacy\n"
+          "                  Decode the old RGB icon types and their masks "
+          "to PNG\n"
+          "  -P, --pam       Decode icons to 8-bit RGBA PAM files instead "
+          "of PNG\n"
+          "  -j, --jobs=N    Number of threads used to decode icons\n"
+          "  -d, --diff=OLD  Write a delta with the icons that changed from "
+          "the .icns\n"
+          "                  file OLD\n"
+          "  -a, --apply=D   Apply the delta D to the .icns file and write "
+          "the result\n"
+          "                  to --output\n",
+          own_path);
 }
 
 char* Basename(const char* path, char* basename) {
   if (!path || *path == '\0') {
-    strlcpy(basename, ".", sizeof("."));
+    snprintf(basename, sizeof("."), ".");
     return basename;
   }
 
@@ -105,22 +334,123 @@ char* Basename(const char* path, char* basename) {
   if (base_length >= MAXPATHLEN)
     return NULL;
 
-  strlcpy(basename, begin, base_length + 1);
+  snprintf(basename, base_length + 1, "%s", begin);
   return basename;
 }
 
-const char* IcnsFromArguments(int argc, char* argv[]) {
-  if (argc < 2) {
+const char* IcnsFromArguments(int argc, char* argv[], Options* options) {
+  static const struct option kLongOptions[] = {
+      {"list", no_argument, NULL, 'l'},
+      {"sniff", no_argument, NULL, 's'},
+      {"dedupe", optional_argument, NULL, 'D'},
+      {"tar", no_argument, NULL, 't'},
+      {"store", required_argument, NULL, 'S'},
+      {"output", required_argument, NULL, 'o'},
+      {"decode-legacy", no_argument, NULL, 'L'},
+      {"pam", no_argument, NULL, 'P'},
+      {"jobs", required_argument, NULL, 'j'},
+      {"diff", required_argument, NULL, 'd'},
+      {"apply", required_argument, NULL, 'a'},
+      {NULL, 0, NULL, 0}
+  };
+
+  int option;
+  while ((option = getopt_long(argc, argv, "lsD::tS:o:LPj:d:a:",
+                               kLongOptions, NULL)) != -1) {
+    switch (option) {
+      case 'l':
+        options->list = true;
+        break;
+      case 's':
+        options->add_extensions = true;
+        break;
+      case 'D':
+        if (!optarg || strcmp(optarg, "clone") == 0) {
+          options->dedupe = kDedupeClone;
+        } else if (strcmp(optarg, "link") == 0) {
+          options->dedupe = kDedupeLink;
+        } else {
+          PrintError("Dedupe mode must be clone or link.");
+          PrintUsage(argv[0]);
+          return NULL;
+        }
+        break;
+      case 't':
+        options->tar_output = true;
+        break;
+      case 'S':
+        options->store_path = optarg;
+        break;
+      case 'o':
+        options->output_path = optarg;
+        break;
+      case 'L':
+        options->decode_legacy = true;
+        break;
+      case 'P':
+        options->pam = true;
+        break;
+      case 'j':
+        options->jobs = atoi(optarg);
+        if (options->jobs < 1) {
+          PrintError("The number of jobs must be at least 1.");
+          PrintUsage(argv[0]);
+          return NULL;
+        }
+        break;
+      case 'd':
+        options->diff_path = optarg;
+        break;
+      case 'a':
+        options->apply_path = optarg;
+        break;
+      default:
+        PrintUsage(argv[0]);
+        return NULL;
+    }
+  }
+
+  if (optind >= argc) {
     PrintError("No path given to icns file.");
     PrintUsage(argv[0]);
     return NULL;
-  } else if (argc > 2) {
+  } else if (argc - optind > 1) {
     PrintError("Too many arguments.");
     PrintUsage(argv[0]);
     return NULL;
   }
 
-  return argv[1];
+  const bool delta = options->diff_path || options->apply_path;
+  if (delta && (options->list || options->add_extensions || options->dedupe ||
+                options->tar_output || options->store_path ||
+                options->decode_legacy || options->pam ||
+                (options->diff_path && options->apply_path))) {
+    PrintError("--diff and --apply can't be combined with other options.");
+    PrintUsage(argv[0]);
+    return NULL;
+  }
+
+  if (options->apply_path && !options->output_path) {
+    PrintError("--apply needs --output for the new .icns file.");
+    PrintUsage(argv[0]);
+    return NULL;
+  }
+
+  if (options->output_path && !options->tar_output && !options->store_path &&
+      !delta) {
+    PrintError("--output is only supported together with --tar, --store, "
+               "--diff or --apply.");
+    PrintUsage(argv[0]);
+    return NULL;
+  }
+
+  if (options->store_path && (options->tar_output || options->dedupe)) {
+    PrintError("--store can't be combined with --tar or --dedupe.");
+    PrintUsage(argv[0]);
+    return NULL;
+  }
+
+  return argv[optind];
 }
 
 uint32_t ReadUint32(FILE* file) {
@@ -131,6 +461,11 @@ uint32_t ReadUint32(FILE* file) {
   return ntohl(read);
 }
 
+bool WriteUint32(FILE* file, uint32_t value) {
+  const uint32_t written = htonl(value);
+  return fwrite(&written, sizeof(written), 1, file) == 1;
+}
+
 FILE* OpenIcnsFileForReading(const char* icns_path) {
   FILE* icns = fopen(icns_path, "r");
   if (!icns) {
@@ -169,7 +504,8 @@ Path GetIconsetPath(const char* icns_path) {
     return path;
   }
 
-  strlcpy(extension, kIconsetExtension, MAXPATHLEN - (extension - path.path));
+  snprintf(extension, MAXPATHLEN - (extension - path.path), "%s",
+           kIconsetExtension);
   return path;
 }
 
@@ -183,7 +519,696 @@ const char* GetFilenameFromType(uint32_t type) {
 
 }
 
-bool CopyIconToIconset(FILE* icns, Path iconset_path) {
+void PutTarNumber(uint64_t value, char* field, size_t length) {
+  snprintf(field, length, "%0*llo", (int)length - 1, (unsigned long long)value);
+}
+
+// Writes a ustar header for a member of the iconset, or for the iconset
+// directory itself when filename is NULL. The iconset directory goes into the
+// prefix field, so only the icon filename has to fit in the name field. Hard
+// links point to link_filename, another member of the iconset.
+bool WriteTarHeader(IconsetOutput* output, const char* filename,
+                    uint64_t size, char type, const char* link_filename) {
+  const char* iconset_name = output->iconset_path.path;
+  char block[kTarBlockSize] = {0};
+  if (strlen(iconset_name) >= 99 || (filename && strlen(filename) > 100)) {
+    PrintError("Name too long for tar stream");
+    return false;
+  }
+
+  if (link_filename &&
+      snprintf(block + 157, 100, "%s/%s", iconset_name, link_filename) >= 100) {
+    PrintError("Name too long for tar stream");
+    return false;
+  }
+
+  if (filename) {
+    memcpy(block, filename, strlen(filename));
+    memcpy(block + 345, iconset_name, strlen(iconset_name));
+  } else {
+    snprintf(block, 100, "%s/", iconset_name);
+  }
+  PutTarNumber(type == '5' ? 0755 : 0644, block + 100, 8);
+  PutTarNumber(0, block + 108, 8);
+  PutTarNumber(0, block + 116, 8);
+  PutTarNumber(size, block + 124, 12);
+  PutTarNumber(output->mtime, block + 136, 12);
+  memset(block + 148, ' ', 8);
+  block[156] = type;
+  memcpy(block + 257, "ustar", 6);
+  memcpy(block + 263, "00", 2);
+
+  unsigned checksum = 0;
+  for (size_t i = 0; i < sizeof(block); i++)
+    checksum += (uint8_t)block[i];
+  snprintf(block + 148, 8, "%06o", checksum);
+
+  if (fwrite(block, 1, sizeof(block), output->tar) != sizeof(block)) {
+    PrintSystemError();
+    return false;
+  }
+  return true;
+}
+
+bool WriteTarPadding(FILE* tar, uint64_t size) {
+  static const char kZeros[kTarBlockSize * 2] = {0};
+  size_t padding = (kTarBlockSize - size % kTarBlockSize) % kTarBlockSize;
+  if (fwrite(kZeros, 1, padding, tar) != padding) {
+    PrintSystemError();
+    return false;
+  }
+  return true;
+}
+
+bool WriteTarEnd(FILE* tar) {
+  // A tar stream ends with two empty blocks.
+  static const char kZeros[kTarBlockSize * 2] = {0};
+  if (fwrite(kZeros, 1, sizeof(kZeros), tar) != sizeof(kZeros)) {
+    PrintSystemError();
+    return false;
+  }
+  return true;
+}
+
+PayloadKind SniffPayload(uint32_t type, const uint8_t* data, size_t size) {
+  static const uint8_t kPngSignature[] = {0x89, 'P', 'N', 'G',
+                                          '\r', '\n', 0x1a, '\n'};
+  static const uint8_t kJpeg2000Signature[] = {0, 0, 0, 12, 'j', 'P',
+                                               ' ', ' ', '\r', '\n', 0x87,
+                                               '\n'};
+  static const uint8_t kJpeg2000Codestream[] = {0xff, 0x4f, 0xff, 0x51};
+
+  if (size >= sizeof(kPngSignature) &&
+      memcmp(data, kPngSignature, sizeof(kPngSignature)) == 0)
+    return kPayloadPng;
+  if (size >= sizeof(kJpeg2000Signature) &&
+      memcmp(data, kJpeg2000Signature, sizeof(kJpeg2000Signature)) == 0)
+    return kPayloadJpeg2000;
+  if (size >= sizeof(kJpeg2000Codestream) &&
+      memcmp(data, kJpeg2000Codestream, sizeof(kJpeg2000Codestream)) == 0)
+    return kPayloadJpeg2000Codestream;
+  if (size >= 4 && memcmp(data, "ARGB", 4) == 0)
+    return kPayloadArgb;
+  if (size >= 6 && memcmp(data, "bplist", 6) == 0)
+    return kPayloadPlist;
+
+  // The legacy RGB images ('is32', 'il32', 'ih32' and 'it32') and their masks
+  // ('s8mk', 'l8mk', ...) have no header, so go by their type instead.
+  if ((type & 0xffff) == ('3' << 8 | '2'))
+    return kPayloadRle;
+  if ((type & 0xffffff) == ('8' << 16 | 'm' << 8 | 'k'))
+    return kPayloadMask;
+
+  return kPayloadUnknown;
+}
+
+void GetIconFilename(uint32_t type, PayloadKind kind, bool add_extension,
+                     char* icon_filename, size_t length) {
+  const char* known_filename = GetFilenameFromType(type);
+  if (known_filename) {
+    snprintf(icon_filename, length, "%s", known_filename);
+    return;
+  }
+
+  char unknown_format[] = {(type >> 24) & 0xff, (type >> 16) & 0xff,
+                           (type >> 8) & 0xff, type & 0xff, '\0'};
+
+  snprintf(icon_filename, length, "%s%s%s", kUnknownFormatFilename,
+           unknown_format, add_extension ? kPayloadKinds[kind].extension : "");
+}
+
+Path GetIconPath(const IconsetOutput* output, const char* icon_filename) {
+  Path icon_path = output->iconset_path;
+  char* icon_path_end = icon_path.path + strlen(icon_path.path);
+  *icon_path_end++ = '/';
+  snprintf(icon_path_end, MAXPATHLEN - (icon_path_end - icon_path.path), "%s",
+           icon_filename);
+  return icon_path;
+}
+
+// Opens the file an icon is extracted to, or starts its member in the tar
+// stream.
+FILE* OpenIconTarget(IconsetOutput* output, const char* icon_filename,
+                     uint32_t size) {
+  if (output->tar) {
+    if (!WriteTarHeader(output, icon_filename, size, '0', NULL))
+      return NULL;
+    return output->tar;
+  }
+
+  FILE* target = fopen(GetIconPath(output, icon_filename).path, "w");
+  if (!target)
+    PrintSystemError();
+  return target;
+}
+
+bool CloseIconTarget(IconsetOutput* output, FILE* target, uint32_t size,
+                     bool success) {
+  if (output->tar)
+    return success && WriteTarPadding(output->tar, size);
+
+  if (fclose(target) != 0 && success) {
+    PrintSystemError();
+    return false;
+  }
+  return success;
+}
+
+bool CloneFile(const char* source_path, const char* target_path) {
+#if defined(__APPLE__)
+  return clonefile(source_path, target_path, 0) == 0;
+#elif defined(FICLONE)
+  int source = open(source_path, O_RDONLY);
+  if (source < 0)
+    return false;
+
+  int target = open(target_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  bool cloned = target >= 0 && ioctl(target, FICLONE, source) == 0;
+  if (target >= 0)
+    close(target);
+  close(source);
+  return cloned;
+#else
+  return false;
+#endif
+}
+
+// Checks that the data of an earlier icon in the .icns file really is the
+// same as data, not just its hash.
+bool IsSameAsExtracted(FILE* icns, const ExtractedIcon* extracted,
+                       const uint8_t* data) {
+  long position = ftell(icns);
+  if (position < 0 || fseek(icns, extracted->offset, SEEK_SET) < 0)
+    return false;
+
+  uint8_t buffer[kBufferSize];
+  bool same = true;
+  for (uint32_t compared = 0; same && compared < extracted->size;) {
+    size_t to_read = MIN(extracted->size - compared, kBufferSize);
+    same = fread(buffer, 1, to_read, icns) == to_read &&
+           memcmp(buffer, data + compared, to_read) == 0;
+    compared += to_read;
+  }
+
+  return fseek(icns, position, SEEK_SET) == 0 && same;
+}
+
+// Makes icon_filename refer to the earlier extracted_filename without writing
+// the data again. Returns false if that's not possible, in which case the data
+// should be written as usual.
+bool ExtractDuplicate(IconsetOutput* output, const char* extracted_filename,
+                      const char* icon_filename) {
+  if (output->tar) {
+    return output->dedupe == kDedupeLink &&
+           WriteTarHeader(output, icon_filename, 0, '1', extracted_filename);
+  }
+
+  Path source = GetIconPath(output, extracted_filename);
+  Path target = GetIconPath(output, icon_filename);
+  if (output->dedupe == kDedupeLink)
+    return link(source.path, target.path) == 0;
+  return CloneFile(source.path, target.path);
+}
+
+bool AddExtractedIcon(IconsetOutput* output, uint64_t hash, uint32_t size,
+                      long offset, const char* icon_filename) {
+  if (output->extracted_count == output->extracted_capacity) {
+    size_t capacity =
+        output->extracted_capacity ? output->extracted_capacity * 2 : 16;
+    ExtractedIcon* grown =
+        realloc(output->extracted, capacity * sizeof(*grown));
+    if (!grown) {
+      PrintSystemError();
+      return false;
+    }
+    output->extracted = grown;
+    output->extracted_capacity = capacity;
+  }
+
+  ExtractedIcon* extracted = &output->extracted[output->extracted_count];
+  extracted->icon_filename = strdup(icon_filename);
+  if (!extracted->icon_filename) {
+    PrintSystemError();
+    return false;
+  }
+  extracted->hash = hash;
+  extracted->size = size;
+  extracted->offset = offset;
+  output->extracted_count++;
+  return true;
+}
+
+uint8_t* ReadIconData(FILE* icns, uint32_t size) {
+  uint8_t* data = malloc(size);
+  if (!data) {
+    PrintSystemError();
+    return NULL;
+  }
+
+  if (fread(data, 1, size, icns) != size) {
+    PrintError("Error copying from .icns file to iconset");
+    free(data);
+    return NULL;
+  }
+
+  return data;
+}
+
+// Extracts an icon that is read into memory as a whole, so that its hash is
+// known before writing it. Icons with the same data as an earlier icon refer
+// to the earlier file instead of being written again.
+bool CopyDedupedIconToIconset(FILE* icns, uint32_t header, uint32_t size,
+                              IconsetOutput* output) {
+  long offset = ftell(icns);
+  if (offset < 0) {
+    PrintSystemError();
+    return false;
+  }
+
+  uint8_t* data = ReadIconData(icns, size);
+  if (!data)
+    return false;
+
+  char icon_filename[MAXPATHLEN];
+  GetIconFilename(header, SniffPayload(header, data, size),
+                  output->add_extensions, icon_filename,
+                  sizeof(icon_filename));
+
+  const uint64_t hash = Hash(data, size, 0);
+  for (size_t i = 0; i < output->extracted_count; i++) {
+    const ExtractedIcon* extracted = &output->extracted[i];
+    if (extracted->hash == hash && extracted->size == size &&
+        IsSameAsExtracted(icns, extracted, data) &&
+        ExtractDuplicate(output, extracted->icon_filename, icon_filename)) {
+      free(data);
+      return true;
+    }
+  }
+
+  FILE* target = OpenIconTarget(output, icon_filename, size);
+  if (!target) {
+    free(data);
+    return false;
+  }
+
+  bool written = fwrite(data, 1, size, target) == size;
+  if (!written)
+    PrintError("Error copying from .icns file to iconset");
+  free(data);
+  return CloseIconTarget(output, target, size, written) &&
+         AddExtractedIcon(output, hash, size, offset, icon_filename);
+}
+
+bool MakeDirectory(const char* path) {
+  if (mkdir(path, 0777) == 0 || errno == EEXIST)
+    return true;
+
+  PrintSystemError();
+  return false;
+}
+
+// Writes data to the store under its address, unless the store already has
+// it. The data goes to a temporary file first, so readers (or other readicns
+// processes) never see a partial object.
+bool AddObjectToStore(const char* store_path, const char* address,
+                      const uint8_t* data, uint32_t size) {
+  Path object_path;
+  snprintf(object_path.path, sizeof(object_path.path), "%s/%.2s", store_path,
+           address);
+  if (!MakeDirectory(object_path.path))
+    return false;
+
+  const size_t directory_length = strlen(object_path.path);
+  snprintf(object_path.path + directory_length,
+           sizeof(object_path.path) - directory_length, "/%s", address + 2);
+
+  struct stat info;
+  if (stat(object_path.path, &info) == 0 && info.st_size == size)
+    return true;
+
+  Path temporary_path;
+  snprintf(temporary_path.path, sizeof(temporary_path.path),
+           "%s/.object-XXXXXX", store_path);
+  int fd = mkstemp(temporary_path.path);
+  if (fd < 0) {
+    PrintSystemError();
+    return false;
+  }
+
+  bool written = true;
+  for (uint32_t offset = 0; written && offset < size;) {
+    ssize_t written_size = write(fd, data + offset, size - offset);
+    if (written_size < 0 && errno == EINTR)
+      continue;
+    written = written_size > 0;
+    offset += written ? written_size : 0;
+  }
+
+  // Objects are shared by all manifests, so they shouldn't be changed.
+  if (written && fchmod(fd, 0444) < 0)
+    written = false;
+  if (close(fd) < 0)
+    written = false;
+  if (!written || rename(temporary_path.path, object_path.path) < 0) {
+    PrintSystemError();
+    unlink(temporary_path.path);
+    return false;
+  }
+
+  return true;
+}
+
+// Puts data in the store, named after two 64-bit hashes of the data, and
+// adds a line "<address> <size> <icon filename>" to the manifest.
+bool StoreIconData(IconsetOutput* output, const char* icon_filename,
+                   const uint8_t* data, uint32_t size) {
+  char address[33];
+  snprintf(address, sizeof(address), "%016llx%016llx",
+           (unsigned long long)Hash(data, size, 0),
+           (unsigned long long)Hash(data, size, kSecondAddressSeed));
+
+  if (!AddObjectToStore(output->store_path, address, data, size))
+    return false;
+
+  if (fprintf(output->manifest, "%s %u %s\n", address, size,
+              icon_filename) < 0) {
+    PrintSystemError();
+    return false;
+  }
+  return true;
+}
+
+bool StoreIcon(FILE* icns, uint32_t header, uint32_t size,
+               IconsetOutput* output) {
+  uint8_t* data = ReadIconData(icns, size);
+  if (!data)
+    return false;
+
+  char icon_filename[MAXPATHLEN];
+  GetIconFilename(header, SniffPayload(header, data, size),
+                  output->add_extensions, icon_filename,
+                  sizeof(icon_filename));
+
+  bool stored = StoreIconData(output, icon_filename, data, size);
+  free(data);
+  return stored;
+}
+
+// Writes an icon that is in memory to the store, the tar stream or the
+// iconset directory.
+bool WriteIconData(IconsetOutput* output, const char* icon_filename,
+                   const uint8_t* data, uint32_t size) {
+  if (output->manifest)
+    return StoreIconData(output, icon_filename, data, size);
+
+  FILE* target = OpenIconTarget(output, icon_filename, size);
+  if (!target)
+    return false;
+
+  bool written = fwrite(data, 1, size, target) == size;
+  if (!written)
+    PrintError("Error copying from .icns file to iconset");
+  return CloseIconTarget(output, target, size, written);
+}
+
+// Holds on to the data of a legacy icon or mask when legacy icons are
+// decoded. Sets *held if the icon was taken, and marks the PNG of a legacy
+// icon as taken when another icon has the same name.
+bool HoldLegacyIcon(FILE* icns, uint32_t header, uint32_t size,
+                    IconsetOutput* output, bool* held) {
+  *held = false;
+  const char* known_filename = GetFilenameFromType(header);
+  for (size_t i = 0; i < kLegacyIconTypeCount; i++) {
+    LegacyIcon* legacy = &output->legacy[i];
+    if (known_filename &&
+        strcmp(known_filename, kLegacyIconTypes[i].icon_filename) == 0)
+      legacy->taken = true;
+
+    // A second icon of the same type is extracted as is.
+    uint8_t** data;
+    uint32_t* data_size;
+    if (header == kLegacyIconTypes[i].image_type && !legacy->image) {
+      data = &legacy->image;
+      data_size = &legacy->image_size;
+    } else if (kLegacyIconTypes[i].mask_type &&
+               header == kLegacyIconTypes[i].mask_type && !legacy->mask) {
+      data = &legacy->mask;
+      data_size = &legacy->mask_size;
+    } else {
+      continue;
+    }
+
+    if (!(*data = ReadIconData(icns, size)))
+      return false;
+    *data_size = size;
+    *held = true;
+  }
+  return true;
+}
+
+// Decodes a legacy or ARGB icon, and its mask if there is one, into the
+// unfiltered rows of an RGBA image. Returns false if the data is corrupt.
+bool DecodeLegacyIcon(size_t index, const LegacyIcon* legacy, uint8_t* rows) {
+  const uint32_t pixel_size = kLegacyIconTypes[index].pixel_size;
+  const uint32_t padding = kLegacyIconTypes[index].padding;
+  const bool argb = !kLegacyIconTypes[index].mask_type;
+  const size_t count = (size_t)pixel_size * pixel_size;
+  const size_t channel_count = argb ? 4 : 3;
+  if (legacy->image_size < padding ||
+      (argb && memcmp(legacy->image, "ARGB", padding) != 0) ||
+      (legacy->mask && legacy->mask_size != count))
+    return false;
+
+  // The channels are decoded into planes first, so that runs can be filled
+  // with memset and literals copied with memcpy.
+  uint8_t* planes = malloc(count * channel_count);
+  if (!planes)
+    return false;
+
+  const uint8_t* data = legacy->image + padding;
+  size_t size = legacy->image_size - padding;
+  bool decoded = true;
+  if (!argb && size == count * 3) {
+    // Some files have the smallest sizes without any compression.
+    memcpy(planes, data, count * 3);
+  } else {
+    for (size_t channel = 0; decoded && channel < channel_count; channel++) {
+      const size_t used =
+          DecodeIconRle(data, size, planes + channel * count, count, 1);
+      decoded = used != 0;
+      data += used;
+      size -= used;
+    }
+  }
+
+  const uint8_t* alpha = argb ? planes : legacy->mask;
+  const uint8_t* red = argb ? planes + count : planes;
+  const uint8_t* green = red + count;
+  const uint8_t* blue = green + count;
+  for (uint32_t y = 0; decoded && y < pixel_size; y++) {
+    uint8_t* row = rows + y * (1 + (size_t)pixel_size * 4);
+    const size_t start = (size_t)y * pixel_size;
+    *row++ = 0;
+    for (uint32_t x = 0; x < pixel_size; x++) {
+      row[x * 4] = red[start + x];
+      row[x * 4 + 1] = green[start + x];
+      row[x * 4 + 2] = blue[start + x];
+      row[x * 4 + 3] = alpha ? alpha[start + x] : 0xff;
+    }
+  }
+
+  free(planes);
+  return decoded;
+}
+
+// Makes a PAM file with room for width * height pixels of 8-bit RGBA, which
+// go at *pixels. The caller frees the result.
+uint8_t* NewPamImage(uint32_t width, uint32_t height, size_t* size,
+                     uint8_t** pixels) {
+  char header[128];
+  const int header_size =
+      snprintf(header, sizeof(header),
+               "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\n"
+               "TUPLTYPE RGB_ALPHA\nENDHDR\n", width, height);
+  *size = header_size + (size_t)width * height * 4;
+  uint8_t* pam = malloc(*size);
+  if (!pam)
+    return NULL;
+
+  memcpy(pam, header, header_size);
+  *pixels = pam + header_size;
+  return pam;
+}
+
+// Names the PAM file of a PNG icon after it, with the .png extension
+// replaced.
+void GetPamFilename(const char* png_filename, char* pam_filename,
+                    size_t length) {
+  size_t base_length = strlen(png_filename);
+  if (base_length >= sizeof(kPngExtension) - 1 &&
+      strcmp(png_filename + base_length - (sizeof(kPngExtension) - 1),
+             kPngExtension) == 0)
+    base_length -= sizeof(kPngExtension) - 1;
+  snprintf(pam_filename, length, "%.*s%s", (int)base_length, png_filename,
+           kPamExtension);
+}
+
+// Encodes the unfiltered rows of an RGBA image as a PNG, or as a PAM file.
+bool EncodeDecodedRows(const PngHeader* header, const uint8_t* rows, bool pam,
+                       uint8_t** encoded, size_t* encoded_size) {
+  if (!pam)
+    return EncodePngImageFast(header, rows, encoded, encoded_size);
+
+  uint8_t* pixels;
+  *encoded = NewPamImage(header->width, header->height, encoded_size, &pixels);
+  const size_t row_size = (size_t)header->width * 4;
+  for (uint32_t y = 0; *encoded && y < header->height; y++)
+    memcpy(pixels + y * row_size, rows + y * (row_size + 1) + 1, row_size);
+  return *encoded != NULL;
+}
+
+// Writes a legacy icon as a PNG (or PAM file), or its data and mask as is if
+// it can't be decoded or its PNG name is taken by another icon. Legacy icons
+// that come later in kLegacyIconTypes can't use the same name anymore.
+bool WriteLegacyIcon(IconsetOutput* output, size_t index) {
+  const LegacyIcon* legacy = &output->legacy[index];
+  const char* png_filename = kLegacyIconTypes[index].icon_filename;
+  const uint32_t pixel_size = kLegacyIconTypes[index].pixel_size;
+  if (legacy->image && !legacy->taken) {
+    PngHeader header = {pixel_size, pixel_size, 8, 6, 0};
+    uint8_t* rows = malloc(PngImageDataSize(&header));
+    uint8_t* png = NULL;
+    size_t png_size = 0;
+    bool encoded = rows && DecodeLegacyIcon(index, legacy, rows) &&
+                   EncodeDecodedRows(&header, rows, output->pam, &png,
+                                     &png_size);
+    free(rows);
+    if (encoded) {
+      char icon_filename[MAXPATHLEN];
+      if (output->pam)
+        GetPamFilename(png_filename, icon_filename, sizeof(icon_filename));
+      else
+        snprintf(icon_filename, sizeof(icon_filename), "%s", png_filename);
+      bool written = WriteIconData(output, icon_filename, png, png_size);
+      free(png);
+      for (size_t i = index + 1; i < kLegacyIconTypeCount; i++) {
+        if (strcmp(kLegacyIconTypes[i].icon_filename, png_filename) == 0)
+          output->legacy[i].taken = true;
+      }
+      return written;
+    }
+    const uint32_t type = kLegacyIconTypes[index].image_type;
+    fprintf(stderr, "Warning: Can't decode the %c%c%c%c icon, extracting its "
+            "data as is.\n", (type >> 24) & 0xff, (type >> 16) & 0xff,
+            (type >> 8) & 0xff, type & 0xff);
+  }
+
+  const uint32_t types[] = {kLegacyIconTypes[index].image_type,
+                            kLegacyIconTypes[index].mask_type};
+  const uint8_t* data[] = {legacy->image, legacy->mask};
+  const uint32_t sizes[] = {legacy->image_size, legacy->mask_size};
+  for (size_t i = 0; i < 2; i++) {
+    if (!data[i])
+      continue;
+
+    char icon_filename[MAXPATHLEN];
+    GetIconFilename(types[i], SniffPayload(types[i], data[i], sizes[i]),
+                    output->add_extensions, icon_filename,
+                    sizeof(icon_filename));
+    if (!WriteIconData(output, icon_filename, data[i], sizes[i]))
+      return false;
+  }
+  return true;
+}
+
+// Holds on to the data of a PNG icon, to decode it once all icons are read.
+// Sets *held if the icon is a PNG.
+bool HoldPngIcon(FILE* icns, uint32_t header, uint32_t size,
+                 IconsetOutput* output, bool* held) {
+  // Only the signature is read to tell, before going back to the start of
+  // the icon.
+  uint8_t signature[8];
+  size_t buffered = MIN(size, sizeof(signature));
+  if (fread(signature, 1, buffered, icns) != buffered ||
+      fseek(icns, -(long)buffered, SEEK_CUR) < 0) {
+    PrintError("Error reading .icns file");
+    return false;
+  }
+  *held = SniffPayload(header, signature, buffered) == kPayloadPng;
+  if (!*held)
+    return true;
+
+  if (output->decoded_count == output->decoded_capacity) {
+    size_t capacity =
+        output->decoded_capacity ? output->decoded_capacity * 2 : 16;
+    DecodedIcon* grown = realloc(output->decoded, capacity * sizeof(*grown));
+    if (!grown) {
+      PrintSystemError();
+      return false;
+    }
+    output->decoded = grown;
+    output->decoded_capacity = capacity;
+  }
+
+  char icon_filename[MAXPATHLEN];
+  GetIconFilename(header, kPayloadPng, output->add_extensions, icon_filename,
+                  sizeof(icon_filename));
+  DecodedIcon* icon = &output->decoded[output->decoded_count];
+  *icon = (DecodedIcon){strdup(icon_filename), NULL, size, NULL, 0};
+  if (!icon->icon_filename) {
+    PrintSystemError();
+    return false;
+  }
+  if (!(icon->png = ReadIconData(icns, size))) {
+    free(icon->icon_filename);
+    return false;
+  }
+  output->decoded_count++;
+  return true;
+}
+
+bool DecodePngIcon(void* context, size_t index) {
+  DecodedIcon* icon = &((IconsetOutput*)context)->decoded[index];
+  PngHeader header;
+  uint8_t* pixels;
+  if (!ReadPngHeader(icon->png, icon->png_size, &header) ||
+      (uint64_t)header.width * header.height > UINT32_MAX / 4 ||
+      !(icon->pam = NewPamImage(header.width, header.height,
+                                &icon->pam_size, &pixels)))
+    return true;
+
+  if (!DecodePngImageRgba8(icon->png, icon->png_size, &header, pixels)) {
+    free(icon->pam);
+    icon->pam = NULL;
+  }
+  return true;
+}
+
+// Decodes the held PNG icons in parallel, and writes them in the order they
+// are in the .icns file.
+bool WriteDecodedIcons(IconsetOutput* output) {
+  RunInParallel(DecodePngIcon, output, output->decoded_count, output->jobs);
+
+  for (size_t i = 0; i < output->decoded_count; i++) {
+    const DecodedIcon* icon = &output->decoded[i];
+    if (!icon->pam) {
+      fprintf(stderr, "Warning: Can't decode %s, extracting it as is.\n",
+              icon->icon_filename);
+      if (!WriteIconData(output, icon->icon_filename, icon->png,
+                         icon->png_size))
+        return false;
+      continue;
+    }
+
+    char pam_filename[MAXPATHLEN];
+    GetPamFilename(icon->icon_filename, pam_filename, sizeof(pam_filename));
+    if (!WriteIconData(output, pam_filename, icon->pam, icon->pam_size))
+      return false;
+  }
+  return true;
+}
+
+bool CopyIconToIconset(FILE* icns, IconsetOutput* output) {
   uint32_t header = ReadUint32(icns);
   if (!header && feof(icns))
     return true;
@@ -195,79 +1220,530 @@ bool CopyIconToIconset(FILE* icns, Path iconset_path) {
   }
   size -= 8;
 
-  const char* icon_filename = GetFilenameFromType(header);
-  char* iconset_path_end = iconset_path.path + strlen(iconset_path.path);
-  *iconset_path_end++ = '/';
-  if (icon_filename) {
-    strlcpy(iconset_path_end, icon_filename,
-            MAXPATHLEN - (iconset_path_end - iconset_path.path));
-  } else {
-    char unknown_format[] = {(header >> 24) & 0xff, (header >> 16) & 0xff,
-                             (header >> 8) & 0xff, header & 0xff, '\0'};
+  bool held = false;
+  if (output->decode_legacy &&
+      !HoldLegacyIcon(icns, header, size, output, &held))
+    return false;
+  if (!held && output->pam && !HoldPngIcon(icns, header, size, output, &held))
+    return false;
+  if (held)
+    return true;
 
-    iconset_path_end +=
-        strlcpy(iconset_path_end, kUnknownFormatFilename,
-                MAXPATHLEN - (iconset_path_end - iconset_path.path));
-    strlcpy(iconset_path_end, unknown_format,
-            MAXPATHLEN - (iconset_path_end - iconset_path.path));
-  }
+  if (output->manifest)
+    return StoreIcon(icns, header, size, output);
+  if (output->dedupe != kDedupeNone)
+    return CopyDedupedIconToIconset(icns, header, size, output);
 
-  FILE* target = fopen(iconset_path.path, "w");
-  if (!target) {
-    PrintSystemError();
+  // The first part of the icon is read before creating the target, so its
+  // name can depend on what the data looks like.
+  uint8_t buffer[kBufferSize];
+  size_t buffered = size > kBufferSize ? kBufferSize : size;
+  if (fread(buffer, 1, buffered, icns) != buffered) {
+    PrintError("Error copying from .icns file to iconset");
     return false;
   }
 
-  uint8_t buffer[kBufferSize];
-  while (size > 0) {
-    size_t to_read = size > kBufferSize ? kBufferSize : size;
-    if (fread(buffer, 1, to_read, icns) != to_read ||
-        fwrite(buffer, 1, to_read, target) != to_read) {
+  char icon_filename[MAXPATHLEN];
+  GetIconFilename(header, SniffPayload(header, buffer, buffered),
+                  output->add_extensions, icon_filename,
+                  sizeof(icon_filename));
+
+  FILE* target = OpenIconTarget(output, icon_filename, size);
+  if (!target)
+    return false;
+
+  uint32_t remaining = size;
+  for (;;) {
+    if (fwrite(buffer, 1, buffered, target) != buffered) {
+      PrintError("Error copying from .icns file to iconset");
+      return CloseIconTarget(output, target, size, false);
+    }
+
+    remaining -= buffered;
+    if (remaining == 0)
+      break;
+
+    buffered = remaining > kBufferSize ? kBufferSize : remaining;
+    if (fread(buffer, 1, buffered, icns) != buffered) {
       PrintError("Error copying from .icns file to iconset");
-      fclose(target);
+      return CloseIconTarget(output, target, size, false);
+    }
+  }
+
+  return CloseIconTarget(output, target, size, true);
+}
+
+bool ListIcns(const char* icns_path, const Options* options) {
+  FILE* icns = OpenIcnsFileForReading(icns_path);
+  if (!icns)
+    return false;
+
+  for (;;) {
+    uint32_t header = ReadUint32(icns);
+    if (!header && feof(icns))
+      break;
+
+    uint32_t size = ReadUint32(icns);
+    if (size <= 8) {
+      PrintError("Invalid size in .icns file");
+      fclose(icns);
+      return false;
+    }
+    size -= 8;
+
+    // Only the start of every icon is read, the rest is skipped.
+    uint8_t buffer[16];
+    size_t buffered = size > sizeof(buffer) ? sizeof(buffer) : size;
+    if (fread(buffer, 1, buffered, icns) != buffered ||
+        fseek(icns, size - buffered, SEEK_CUR) < 0) {
+      PrintError("Error reading .icns file");
+      fclose(icns);
       return false;
     }
-    size -= to_read;
+
+    PayloadKind kind = SniffPayload(header, buffer, buffered);
+    char icon_filename[MAXPATHLEN];
+    GetIconFilename(header, kind, options->add_extensions, icon_filename,
+                    sizeof(icon_filename));
+    printf("%c%c%c%c %10u %-9s %s\n", (header >> 24) & 0xff,
+           (header >> 16) & 0xff, (header >> 8) & 0xff, header & 0xff, size,
+           kPayloadKinds[kind].name, icon_filename);
   }
 
-  fclose(target);
+  fclose(icns);
   return true;
 }
 
-bool CreateIconsetFromIcns(const char* icns_path) {
+// Opens the single file that the iconset is written to in tar or store mode:
+// the --output path, or the iconset path with extension.
+FILE* OpenOutputFile(const Options* options, const IconsetOutput* output,
+                     const char* extension) {
+  if (options->output_path &&
+      strcmp(options->output_path, kStandardStreamPath) == 0)
+    return stdout;
+
+  Path path;
+  const int length =
+      options->output_path
+          ? snprintf(path.path, sizeof(path.path), "%s", options->output_path)
+          : snprintf(path.path, sizeof(path.path), "%s%s",
+                     output->iconset_path.path, extension);
+  if (length < 0 || length >= (int)sizeof(path.path)) {
+    PrintError("Can't determine name of output file");
+    return NULL;
+  }
+
+  FILE* file = fopen(path.path, "w");
+  if (!file)
+    PrintSystemError();
+  return file;
+}
+
+bool CloseOutputFile(FILE* file, bool success) {
+  if ((file == stdout ? fflush(stdout) : fclose(file)) != 0) {
+    PrintSystemError();
+    return false;
+  }
+  return success;
+}
+
+bool CreateIconsetFromIcns(const char* icns_path, const Options* options) {
   FILE* icns = OpenIcnsFileForReading(icns_path);
   if (!icns)
     return false;
 
-  Path iconset_path = GetIconsetPath(icns_path);
-  if (IsEmpty(iconset_path)) {
+  // Tar members get the time of the .icns file, so the same file always
+  // gives the same stream.
+  struct stat info;
+  IconsetOutput output = {.iconset_path = GetIconsetPath(icns_path),
+                          .mtime = fstat(fileno(icns), &info) == 0 &&
+                                           S_ISREG(info.st_mode)
+                                       ? info.st_mtime
+                                       : 0,
+                          .add_extensions = options->add_extensions,
+                          .dedupe = options->dedupe};
+  if (IsEmpty(output.iconset_path)) {
     fclose(icns);
     return false;
   }
 
-  if (mkdir(iconset_path.path, 0777)) {
+  if (options->store_path) {
+    output.store_path = options->store_path;
+    if (!MakeDirectory(output.store_path) ||
+        !(output.manifest =
+              OpenOutputFile(options, &output, kManifestExtension))) {
+      fclose(icns);
+      return false;
+    }
+  } else if (options->tar_output) {
+    output.tar = OpenOutputFile(options, &output, kTarExtension);
+    if (!output.tar || !WriteTarHeader(&output, NULL, 0, '5', NULL)) {
+      if (output.tar && output.tar != stdout)
+        fclose(output.tar);
+      fclose(icns);
+      return false;
+    }
+  } else if (mkdir(output.iconset_path.path, 0777)) {
     PrintSystemError();
     fclose(icns);
     return false;
   }
 
-  while (!feof(icns)) {
-    if (!CopyIconToIconset(icns, iconset_path)) {
-      fclose(icns);
-      return false;
+  output.decode_legacy = options->decode_legacy;
+  output.pam = options->pam;
+  output.jobs = options->jobs;
+  bool success = true;
+  while (success && !feof(icns))
+    success = CopyIconToIconset(icns, &output);
+  fclose(icns);
+
+  if (success)
+    success = WriteDecodedIcons(&output);
+  for (size_t i = 0; i < output.decoded_count; i++) {
+    free(output.decoded[i].icon_filename);
+    free(output.decoded[i].png);
+    free(output.decoded[i].pam);
+  }
+  free(output.decoded);
+
+  for (size_t i = 0; i < kLegacyIconTypeCount; i++) {
+    if (success)
+      success = WriteLegacyIcon(&output, i);
+    free(output.legacy[i].image);
+    free(output.legacy[i].mask);
+  }
+
+  for (size_t i = 0; i < output.extracted_count; i++)
+    free(output.extracted[i].icon_filename);
+  free(output.extracted);
+
+  if (output.tar)
+    success = CloseOutputFile(output.tar, success && WriteTarEnd(output.tar));
+  if (output.manifest)
+    success = CloseOutputFile(output.manifest, success);
+
+  return success;
+}
+
+void FreeIcnsChunks(IcnsChunks* chunks) {
+  for (size_t i = 0; i < chunks->count; i++)
+    free(chunks->chunks[i].data);
+  free(chunks->chunks);
+}
+
+void HashChunkHeader(HashState* state, uint32_t type, uint32_t size) {
+  const uint32_t header[] = {htonl(type), htonl(size)};
+  HashUpdate(state, header, sizeof(header));
+}
+
+// Reads every icon of an .icns file into memory, walking the icon headers
+// like CopyIconToIconset does.
+bool ReadIcnsChunks(const char* icns_path, IcnsChunks* chunks) {
+  FILE* icns = OpenIcnsFileForReading(icns_path);
+  if (!icns)
+    return false;
+
+  // The header was checked, but its size is needed to rebuild the file.
+  HashState state;
+  HashInit(&state, 0);
+  bool success = fseek(icns, 4, SEEK_SET) == 0;
+  chunks->size = ReadUint32(icns);
+  HashChunkHeader(&state, kMagicHeader, chunks->size);
+  while (success) {
+    uint32_t header = ReadUint32(icns);
+    if (!header && feof(icns))
+      break;
+
+    // Empty icons are valid, --update and --remove accept them too.
+    uint32_t size = ReadUint32(icns);
+    if (size < 8) {
+      PrintError("Invalid size in .icns file");
+      success = false;
+      break;
     }
+    size -= 8;
+
+    if (chunks->count == chunks->capacity) {
+      const size_t capacity = chunks->capacity ? chunks->capacity * 2 : 32;
+      IcnsChunk* grown =
+          realloc(chunks->chunks, capacity * sizeof(*chunks->chunks));
+      if (!grown) {
+        PrintSystemError();
+        success = false;
+        break;
+      }
+      chunks->chunks = grown;
+      chunks->capacity = capacity;
+    }
+
+    uint8_t* data = ReadIconData(icns, size);
+    if (!data) {
+      success = false;
+      break;
+    }
+    chunks->chunks[chunks->count++] =
+        (IcnsChunk){header, size, data, Hash(data, size, 0)};
+    HashChunkHeader(&state, header, size + 8);
+    HashUpdate(&state, data, size);
   }
+  chunks->hash = HashFinal(&state);
 
   fclose(icns);
+  return success;
+}
+
+// Finds an icon of the old file with the same type and data as an icon of
+// the new file. The icon after the one before is preferred, so that
+// unchanged runs of icons take a single record.
+bool FindOldChunk(const IcnsChunks* old_chunks, const IcnsChunk* chunk,
+                  size_t preferred, size_t* index) {
+  for (size_t i = 0; i < old_chunks->count; i++) {
+    const size_t candidate = (preferred + i) % old_chunks->count;
+    const IcnsChunk* old_chunk = &old_chunks->chunks[candidate];
+    if (old_chunk->type == chunk->type && old_chunk->size == chunk->size &&
+        old_chunk->hash == chunk->hash &&
+        memcmp(old_chunk->data, chunk->data, chunk->size) == 0) {
+      *index = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool WriteKeepRecord(FILE* delta, size_t start, size_t count) {
+  return count == 0 ||
+         (WriteUint32(delta, kKeepRecord) && WriteUint32(delta, start) &&
+          WriteUint32(delta, count));
+}
+
+bool WriteDeltaHeader(FILE* delta, const IcnsChunks* old_chunks,
+                      const IcnsChunks* new_chunks) {
+  return WriteUint32(delta, kDeltaMagic) &&
+         WriteUint32(delta, old_chunks->size) &&
+         WriteUint32(delta, old_chunks->hash >> 32) &&
+         WriteUint32(delta, old_chunks->hash) &&
+         WriteUint32(delta, new_chunks->size) &&
+         WriteUint32(delta, new_chunks->hash >> 32) &&
+         WriteUint32(delta, new_chunks->hash);
+}
+
+// Writes a delta that turns the .icns file at old_path into the one at
+// icns_path. Only the icons that are new or changed are in the delta.
+bool DiffIcns(const char* old_path, const char* icns_path,
+              const Options* options) {
+  IcnsChunks old_chunks = {0};
+  IcnsChunks new_chunks = {0};
+  IconsetOutput output = {0};
+  if (!ReadIcnsChunks(old_path, &old_chunks) ||
+      !ReadIcnsChunks(icns_path, &new_chunks)) {
+    FreeIcnsChunks(&old_chunks);
+    FreeIcnsChunks(&new_chunks);
+    return false;
+  }
+
+  FILE* delta = NULL;
+  if (!Basename(icns_path, output.iconset_path.path))
+    PrintError("Can't determine name of icns file");
+  else
+    delta = OpenOutputFile(options, &output, kDeltaExtension);
+  bool written = delta && WriteDeltaHeader(delta, &old_chunks, &new_chunks);
+
+  size_t keep_start = 0;
+  size_t keep_count = 0;
+  for (size_t i = 0; written && i < new_chunks.count; i++) {
+    const IcnsChunk* chunk = &new_chunks.chunks[i];
+    size_t index;
+    if (FindOldChunk(&old_chunks, chunk, keep_start + keep_count, &index)) {
+      if (keep_count > 0 && index == keep_start + keep_count) {
+        keep_count++;
+      } else {
+        written = WriteKeepRecord(delta, keep_start, keep_count);
+        keep_start = index;
+        keep_count = 1;
+      }
+      continue;
+    }
+
+    written = WriteKeepRecord(delta, keep_start, keep_count) &&
+              WriteUint32(delta, kDataRecord) &&
+              WriteUint32(delta, chunk->type) &&
+              WriteUint32(delta, chunk->size + 8) &&
+              fwrite(chunk->data, 1, chunk->size, delta) == chunk->size;
+    keep_start += keep_count;
+    keep_count = 0;
+  }
+  written = written && WriteKeepRecord(delta, keep_start, keep_count);
+  if (delta && !written)
+    PrintSystemError();
+
+  FreeIcnsChunks(&old_chunks);
+  FreeIcnsChunks(&new_chunks);
+  return delta && CloseOutputFile(delta, written);
+}
+
+// Writes a chunk and adds it to the hash. data may be NULL for an empty icon.
+bool WriteChunk(FILE* file, HashState* state, uint32_t type,
+                const uint8_t* data, uint32_t size) {
+  HashChunkHeader(state, type, size + 8);
+  if (size)
+    HashUpdate(state, data, size);
+  return WriteUint32(file, type) && WriteUint32(file, size + 8) &&
+         (!size || fwrite(data, 1, size, file) == size);
+}
+
+// Copies file from its start to standard output.
+bool CopyToStandardOutput(FILE* file) {
+  uint8_t buffer[kBufferSize];
+  size_t read;
+  bool copied = fseek(file, 0, SEEK_SET) == 0;
+  while (copied && (read = fread(buffer, 1, sizeof(buffer), file)))
+    copied = fwrite(buffer, 1, read, stdout) == read;
+  if (!copied || ferror(file) || fflush(stdout) != 0) {
+    PrintSystemError();
+    return false;
+  }
   return true;
 }
 
+// Rebuilds the new .icns file from the old one at icns_path and a delta
+// written by DiffIcns. The old file has to be the one the delta was made
+// from. The result is written next to the output and only renamed over it
+// when it hashes to the new file, so the output can be the old file.
+bool ApplyDelta(const char* delta_path, const char* icns_path,
+                const Options* options) {
+  FILE* delta = fopen(delta_path, "r");
+  if (!delta) {
+    PrintSystemError();
+    return false;
+  }
+
+  IcnsChunks old_chunks = {0};
+  if (!ReadIcnsChunks(icns_path, &old_chunks)) {
+    fclose(delta);
+    return false;
+  }
+
+  const uint32_t magic = ReadUint32(delta);
+  const uint32_t old_size = ReadUint32(delta);
+  uint64_t old_hash = (uint64_t)ReadUint32(delta) << 32;
+  old_hash |= ReadUint32(delta);
+  const uint32_t new_size = ReadUint32(delta);
+  uint64_t new_hash = (uint64_t)ReadUint32(delta) << 32;
+  new_hash |= ReadUint32(delta);
+  const bool to_stdout =
+      strcmp(options->output_path, kStandardStreamPath) == 0;
+  FILE* icns = NULL;
+  Path temporary_path = {{0}};
+  if (magic != kDeltaMagic || feof(delta)) {
+    PrintError("This doesn't look like a delta between .icns files.");
+  } else if (old_size != old_chunks.size || old_hash != old_chunks.hash) {
+    PrintError("The delta was made from a different .icns file.");
+  } else if (to_stdout) {
+    // What reaches standard output can't be taken back, so the patched file
+    // waits in a temporary file until it matches the hash in the delta.
+    if (!(icns = tmpfile()))
+      PrintSystemError();
+  } else if (snprintf(temporary_path.path, sizeof(temporary_path.path),
+                      "%s.tmp", options->output_path) >=
+             (int)sizeof(temporary_path.path)) {
+    PrintError("Can't determine name of output file");
+  } else if (!(icns = fopen(temporary_path.path, "w"))) {
+    PrintSystemError();
+  }
+
+  // An output that already exists, like the old file when patching in place,
+  // keeps its mode.
+  struct stat info;
+  if (icns && !to_stdout && stat(options->output_path, &info) == 0 &&
+      fchmod(fileno(icns), info.st_mode & 07777) < 0) {
+    PrintSystemError();
+    fclose(icns);
+    unlink(temporary_path.path);
+    icns = NULL;
+  }
+
+  HashState state;
+  HashInit(&state, 0);
+  HashChunkHeader(&state, kMagicHeader, new_size);
+  bool written = icns && WriteUint32(icns, kMagicHeader) &&
+                 WriteUint32(icns, new_size);
+  bool valid = true;
+  while (written && valid) {
+    const uint32_t record = ReadUint32(delta);
+    if (!record && feof(delta))
+      break;
+
+    if (record == kKeepRecord) {
+      const uint32_t start = ReadUint32(delta);
+      const uint32_t count = ReadUint32(delta);
+      valid = !feof(delta) && start < old_chunks.count &&
+              count <= old_chunks.count - start;
+      for (size_t i = start; valid && written && i < start + count; i++) {
+        const IcnsChunk* chunk = &old_chunks.chunks[i];
+        written = WriteChunk(icns, &state, chunk->type, chunk->data,
+                             chunk->size);
+      }
+    } else if (record == kDataRecord) {
+      const uint32_t type = ReadUint32(delta);
+      const uint32_t size = ReadUint32(delta);
+      // An empty icon has no data to read, and malloc(0) may return NULL.
+      uint8_t* data = NULL;
+      valid = !feof(delta) && size >= 8;
+      if (valid && size > 8) {
+        written = (data = malloc(size - 8)) != NULL;
+        valid = !written || fread(data, 1, size - 8, delta) == size - 8;
+      }
+      if (written && valid)
+        written = WriteChunk(icns, &state, type, data, size - 8);
+      free(data);
+    } else {
+      valid = false;
+    }
+  }
+  if (icns && !written)
+    PrintSystemError();
+  if (icns && written && !valid)
+    PrintError("Invalid record in delta");
+  if (icns && written && valid && HashFinal(&state) != new_hash) {
+    PrintError("The patched .icns file doesn't match the hash in the delta.");
+    valid = false;
+  }
+
+  fclose(delta);
+  FreeIcnsChunks(&old_chunks);
+  if (!icns)
+    return false;
+  if (to_stdout) {
+    const bool applied = written && valid && CopyToStandardOutput(icns);
+    fclose(icns);
+    return applied;
+  }
+  bool applied = CloseOutputFile(icns, written && valid);
+  if (applied && rename(temporary_path.path, options->output_path) < 0) {
+    PrintSystemError();
+    applied = false;
+  }
+  if (!applied)
+    unlink(temporary_path.path);
+  return applied;
+}
+
 int main(int argc, char* argv[]) {
-  const char* icns_path = IcnsFromArguments(argc, argv);
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  Options options = {.dedupe = kDedupeNone,
+                     .jobs = processors > 0 ? processors : 1};
+  const char* icns_path = IcnsFromArguments(argc, argv, &options);
   if (!icns_path)
     return -1;
 
-  if (!CreateIconsetFromIcns(icns_path))
+  if (options.list)
+    return ListIcns(icns_path, &options) ? 0 : -1;
+  if (options.diff_path)
+    return DiffIcns(options.diff_path, icns_path, &options) ? 0 : -1;
+  if (options.apply_path)
+    return ApplyDelta(options.apply_path, icns_path, &options) ? 0 : -1;
+
+  if (!CreateIconsetFromIcns(icns_path, &options))
     return -1;
 
   return 0;
@@ -0,0 +1,172 @@
+// -*- Mode: c; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+//
+// Copyright (c) 2017, Arjan van Leeuwen
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "resize.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <sys/param.h>
+
+static const double kLanczosLobes = 3;
+
+// The weights of the source pixels that make up one pixel of the result.
+typedef struct {
+  uint32_t first;
+  uint32_t count;
+  float* weights;
+} Contribution;
+
+static double Sinc(double x) {
+  if (x == 0)
+    return 1;
+  x *= M_PI;
+  return sin(x) / x;
+}
+
+// Overlap of the pixel from position to position + 1 with the range from
+// start to end.
+static double Overlap(double position, double start, double end) {
+  const double overlap = fmin(position + 1, end) - fmax(position, start);
+  return overlap > 0 ? overlap : 0;
+}
+
+// Works out the contributions for scaling size pixels to new_size along one
+// axis. The weights of every result pixel add up to one. The caller frees
+// weights of the first contribution, which holds those of all of them.
+static bool GetContributions(uint32_t size, uint32_t new_size,
+                             ResizeFilter filter,
+                             Contribution* contributions) {
+  const double scale = (double)size / new_size;
+  const double support =
+      filter == kResizeLanczos ? kLanczosLobes * fmax(scale, 1) : scale / 2;
+  const uint32_t max_count = (uint32_t)ceil(support) * 2 + 2;
+  float* weights = malloc((size_t)new_size * max_count * sizeof(*weights));
+  if (!weights)
+    return false;
+
+  for (uint32_t i = 0; i < new_size; i++) {
+    Contribution* contribution = &contributions[i];
+    const double center = (i + 0.5) * scale;
+    const long first = MAX((long)floor(center - support), 0L);
+    const long last = MIN((long)ceil(center + support), (long)size - 1);
+    contribution->first = first;
+    contribution->count = 0;
+    contribution->weights = weights + (size_t)i * max_count;
+
+    double total = 0;
+    for (long j = first; j <= last; j++) {
+      double weight;
+      if (filter == kResizeBox) {
+        weight = Overlap(j, center - support, center + support);
+      } else {
+        const double distance = (j + 0.5 - center) / fmax(scale, 1);
+        weight = fabs(distance) < kLanczosLobes
+                     ? Sinc(distance) * Sinc(distance / kLanczosLobes)
+                     : 0;
+      }
+      contribution->weights[contribution->count++] = weight;
+      total += weight;
+    }
+    for (uint32_t j = 0; j < contribution->count; j++)
+      contribution->weights[j] /= total;
+  }
+  return true;
+}
+
+bool ResizeImage(const uint16_t* pixels, uint32_t width, uint32_t height,
+                 uint32_t new_width, uint32_t new_height, ResizeFilter filter,
+                 uint8_t* resized) {
+  Contribution* columns = malloc(new_width * sizeof(*columns));
+  Contribution* rows = malloc(new_height * sizeof(*rows));
+  // Scaled horizontally, premultiplied and one float per channel.
+  float* between = malloc((size_t)new_width * height * 4 * sizeof(*between));
+  float* line = malloc((size_t)width * 4 * sizeof(*line));
+  bool success = columns && rows && between && line;
+  const bool have_columns =
+      success && GetContributions(width, new_width, filter, columns);
+  const bool have_rows =
+      have_columns && GetContributions(height, new_height, filter, rows);
+  success = have_rows;
+
+  // The loops over the four channels of a pixel are written so the compiler
+  // can keep them in one vector register.
+  for (uint32_t y = 0; success && y < height; y++) {
+    const uint16_t* source = pixels + (size_t)y * width * 4;
+    for (uint32_t x = 0; x < width; x++) {
+      const float alpha = source[x * 4 + 3] / 65535.0f;
+      for (int c = 0; c < 3; c++)
+        line[x * 4 + c] = source[x * 4 + c] / 65535.0f * alpha;
+      line[x * 4 + 3] = alpha;
+    }
+
+    float* target = between + (size_t)y * new_width * 4;
+    for (uint32_t x = 0; x < new_width; x++) {
+      const Contribution* column = &columns[x];
+      float sum[4] = {0, 0, 0, 0};
+      for (uint32_t i = 0; i < column->count; i++) {
+        const float* pixel = line + (size_t)(column->first + i) * 4;
+        for (int c = 0; c < 4; c++)
+          sum[c] += pixel[c] * column->weights[i];
+      }
+      for (int c = 0; c < 4; c++)
+        target[x * 4 + c] = sum[c];
+    }
+  }
+
+  for (uint32_t y = 0; success && y < new_height; y++) {
+    const Contribution* row = &rows[y];
+    uint8_t* target = resized + (size_t)y * new_width * 4;
+    for (uint32_t x = 0; x < new_width; x++) {
+      float sum[4] = {0, 0, 0, 0};
+      for (uint32_t i = 0; i < row->count; i++) {
+        const float* pixel =
+            between + ((size_t)(row->first + i) * new_width + x) * 4;
+        for (int c = 0; c < 4; c++)
+          sum[c] += pixel[c] * row->weights[i];
+      }
+
+      // Lanczos can overshoot, so clamp before undoing the premultiplication.
+      const float alpha = fminf(fmaxf(sum[3], 0), 1);
+      for (int c = 0; c < 3; c++) {
+        const float value =
+            alpha > 0 ? fminf(fmaxf(sum[c] / alpha, 0), 1) : 0;
+        target[x * 4 + c] = (uint8_t)lrintf(value * 255);
+      }
+      target[x * 4 + 3] = (uint8_t)lrintf(alpha * 255);
+    }
+  }
+
+  if (have_columns)
+    free(columns[0].weights);
+  if (have_rows)
+    free(rows[0].weights);
+  free(columns);
+  free(rows);
+  free(between);
+  free(line);
+  return success;
+}
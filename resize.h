@@ -0,0 +1,52 @@
+// -*- Mode: c; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+//
+// Copyright (c) 2017, Arjan van Leeuwen
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// Scaling images down to make icons of other sizes.
+
+#ifndef RESIZE_H_
+#define RESIZE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+  // Lanczos with three lobes, widened by the scale factor. Sharp, at the cost
+  // of slight ringing along hard edges.
+  kResizeLanczos,
+  // The average of the pixels that each new pixel covers.
+  kResizeBox
+} ResizeFilter;
+
+// Scales pixels, width * height pixels of 16-bit RGBA, down to resized, which
+// holds new_width * new_height pixels of 8-bit RGBA. Colors are weighted by
+// their alpha, so transparent pixels don't bleed into the edges. Returns false
+// if out of memory.
+bool ResizeImage(const uint16_t* pixels, uint32_t width, uint32_t height,
+                 uint32_t new_width, uint32_t new_height, ResizeFilter filter,
+                 uint8_t* resized);
+
+#endif  // RESIZE_H_
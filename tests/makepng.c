@@ -0,0 +1,242 @@
+// -*- Mode: c; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+//
+// Copyright (c) 2017, Arjan van Leeuwen
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// Writes an 8-bit RGBA test PNG of the given size. The pattern depends on the
+// seed, and uses few enough colors that --reduce can store it with a palette.
+// With a comment, a tEXt chunk with it follows the header chunk.
+//
+// -w makes the PNG 16-bit, with samples that round to the 8-bit colors, and
+// -i interlaces it. -p also writes the 8-bit pixels as the PAM file that
+// readicns -P makes of the PNG.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../png.h"
+
+static const uint8_t kColors[][4] = {
+    {0, 0, 0, 0},       {255, 255, 255, 255}, {200, 30, 40, 255},
+    {20, 120, 220, 255}, {250, 200, 0, 128},  {0, 0, 0, 64},
+};
+
+// The signature and the header chunk.
+static const size_t kHeaderEnd = 8 + 25;
+static const char kCommentKeyword[] = "Comment";
+
+// The Adam7 passes: the first pixel of each, and the distance between pixels.
+static const uint8_t kPasses[][4] = {
+    {0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4},
+    {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2},
+};
+
+static void PutUint32(uint32_t value, FILE* file) {
+  const uint8_t bytes[] = {value >> 24, value >> 16, value >> 8, value};
+  fwrite(bytes, 1, sizeof(bytes), file);
+}
+
+// Writes a tEXt chunk with the comment, and returns whether it was written.
+static bool WriteComment(const char* comment, FILE* file) {
+  const size_t length = sizeof(kCommentKeyword) + strlen(comment);
+  uint8_t* chunk = malloc(4 + length);
+  if (!chunk)
+    return false;
+  memcpy(chunk, "tEXt", 4);
+  memcpy(chunk + 4, kCommentKeyword, sizeof(kCommentKeyword));
+  memcpy(chunk + 4 + sizeof(kCommentKeyword), comment, strlen(comment));
+  PutUint32(length, file);
+  fwrite(chunk, 1, 4 + length, file);
+  PutUint32(crc32(crc32(0L, Z_NULL, 0), chunk, 4 + length), file);
+  free(chunk);
+  return !ferror(file);
+}
+
+// Writes the 8-bit RGBA pixels as a PAM file, with the header of readicns.
+static bool WritePam(const char* path, uint32_t size, const uint8_t* pixels) {
+  FILE* file = fopen(path, "w");
+  if (!file)
+    return false;
+  fprintf(file,
+          "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\n"
+          "TUPLTYPE RGB_ALPHA\nENDHDR\n", size, size);
+  fwrite(pixels, 4, (size_t)size * size, file);
+  const bool written = !ferror(file);
+  return fclose(file) == 0 && written;
+}
+
+// Rebuilds png with its image data interlaced. Every pass is filtered like a
+// small image, so the passes get the same filters as the rows of others.
+static bool Interlace(const PngHeader* header, const uint8_t* rows,
+                      const uint8_t* png, size_t png_size, uint8_t** rebuilt,
+                      size_t* rebuilt_size) {
+  const size_t pixel_size = 4 * header->bit_depth / 8;
+  const size_t row_size = (size_t)header->width * pixel_size + 1;
+  PngHeader interlaced = *header;
+  interlaced.interlace_method = 1;
+  const size_t data_size = PngImageDataSize(&interlaced);
+  uint8_t* passes = malloc(data_size);
+  uint8_t* filtered = malloc(data_size);
+  if (!passes || !filtered) {
+    free(passes);
+    free(filtered);
+    return false;
+  }
+
+  size_t offset = 0;
+  bool interlaced_all = true;
+  for (size_t p = 0; p < sizeof(kPasses) / sizeof(*kPasses); p++) {
+    const uint32_t x0 = kPasses[p][0], y0 = kPasses[p][1];
+    const uint32_t dx = kPasses[p][2], dy = kPasses[p][3];
+    PngHeader pass = *header;
+    pass.width = header->width > x0 ? (header->width - x0 - 1) / dx + 1 : 0;
+    pass.height = header->height > y0 ? (header->height - y0 - 1) / dy + 1 : 0;
+    if (!pass.width || !pass.height)
+      continue;
+    const size_t pass_row_size = pass.width * pixel_size + 1;
+    for (uint32_t y = 0; y < pass.height; y++) {
+      uint8_t* row = passes + offset + y * pass_row_size;
+      row[0] = 0;
+      for (uint32_t x = 0; x < pass.width; x++)
+        memcpy(row + 1 + x * pixel_size,
+               rows + (y0 + y * dy) * row_size + 1 + (x0 + x * dx) * pixel_size,
+               pixel_size);
+    }
+    if (!FilterPngData(&pass, passes + offset, filtered + offset)) {
+      interlaced_all = false;
+      break;
+    }
+    offset += pass.height * pass_row_size;
+  }
+
+  uint8_t* deflated = NULL;
+  size_t deflated_size;
+  const bool done =
+      interlaced_all &&
+      DeflatePngData(filtered, data_size, 1, &deflated, &deflated_size) &&
+      ReplacePngImageData(png, png_size, &interlaced, NULL, 0, deflated,
+                          deflated_size, rebuilt, rebuilt_size);
+  free(deflated);
+  free(passes);
+  free(filtered);
+  return done;
+}
+
+int main(int argc, char** argv) {
+  bool interlace = false;
+  bool wide = false;
+  const char* pam_path = NULL;
+  int option;
+  while ((option = getopt(argc, argv, "iwp:")) != -1) {
+    switch (option) {
+      case 'i':
+        interlace = true;
+        break;
+      case 'w':
+        wide = true;
+        break;
+      case 'p':
+        pam_path = optarg;
+        break;
+      default:
+        argc = 0;
+        break;
+    }
+  }
+  argc -= optind;
+  argv += optind;
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr,
+            "Usage: makepng [-i] [-w] [-p file.pam] size seed file.png "
+            "[comment]\n");
+    return -1;
+  }
+
+  const uint32_t size = strtoul(argv[0], NULL, 10);
+  const uint32_t seed = strtoul(argv[1], NULL, 10);
+  const size_t color_count = sizeof(kColors) / sizeof(*kColors);
+  const size_t sample_size = wide ? 2 : 1;
+  // Every row starts with its filter type, 0 for None.
+  const size_t row_size = (size_t)size * 4 * sample_size + 1;
+  uint8_t* rows = size ? calloc(row_size, size) : NULL;
+  uint8_t* pixels = size ? malloc((size_t)size * size * 4) : NULL;
+  if (!rows || !pixels) {
+    perror("Error");
+    free(rows);
+    free(pixels);
+    return -1;
+  }
+  for (uint32_t y = 0; y < size; y++) {
+    for (uint32_t x = 0; x < size; x++) {
+      const uint8_t* color =
+          kColors[(x / 3 + y / 5 + (x * y) / 7 + seed) % color_count];
+      uint8_t* sample = rows + y * row_size + 1 + x * 4 * sample_size;
+      memcpy(pixels + ((size_t)y * size + x) * 4, color, 4);
+      for (size_t c = 0; c < 4; c++) {
+        if (!wide) {
+          sample[c] = color[c];
+          continue;
+        }
+        // Up to 128 away from color * 257 still rounds to color.
+        const int offset = (int)((x * 7 + y * 13 + c * 29 + seed) % 257) - 128;
+        int value = color[c] * 257 + offset;
+        value = value < 0 ? 0 : value > 65535 ? 65535 : value;
+        sample[c * 2] = value >> 8;
+        sample[c * 2 + 1] = value;
+      }
+    }
+  }
+
+  PngHeader header = {size, size, wide ? 16 : 8, 6, 0};
+  uint8_t* png = NULL;
+  size_t png_size;
+  bool encoded = EncodePngImage(&header, rows, 1, &png, &png_size);
+  if (encoded && interlace) {
+    uint8_t* interlaced = NULL;
+    encoded = Interlace(&header, rows, png, png_size, &interlaced, &png_size);
+    free(png);
+    png = interlaced;
+  }
+
+  FILE* file = NULL;
+  bool written = encoded && (file = fopen(argv[2], "w")) &&
+                 fwrite(png, 1, kHeaderEnd, file) == kHeaderEnd &&
+                 (argc == 3 || WriteComment(argv[3], file)) &&
+                 fwrite(png + kHeaderEnd, 1, png_size - kHeaderEnd, file) ==
+                     png_size - kHeaderEnd;
+  if (file && fclose(file) != 0)
+    written = false;
+  if (written && pam_path)
+    written = WritePam(pam_path, size, pixels);
+  if (!written)
+    perror("Error");
+  free(png);
+  free(rows);
+  free(pixels);
+  return written ? 0 : -1;
+}
@@ -0,0 +1,498 @@
+#!/bin/sh
+#
+# Round trips through createicns and readicns on PNGs made by makepng. Run
+# with `make test`, from the directory with the built tools.
+
+tools=$(pwd)
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+
+failures=0
+
+fail() {
+  echo "FAIL: $1"
+  failures=$((failures + 1))
+}
+
+pass() {
+  echo "PASS: $1"
+}
+
+# Makes the iconset $1 with the given sizes, and a seed for the pattern.
+make_iconset() {
+  iconset=$1
+  seed=$2
+  shift 2
+  mkdir -p "$iconset"
+  for size in "$@"; do
+    png="$iconset/icon_${size}x${size}.png"
+    "$tools/tests/makepng" "$size" "$seed" "$png" || return 1
+  done
+}
+
+make_iconset old.iconset 0 16 32 128 || exit 1
+"$tools/createicns" old.iconset || exit 1
+
+# Filling a preallocated, mapped file gives the same file as writing it.
+if "$tools/createicns" -m -o mapped.icns old.iconset &&
+   cmp -s mapped.icns old.icns; then
+  pass "mmap output"
+else
+  fail "mmap output"
+fi
+
+# A tar stream of the iconset gives the same file as the directory, written
+# to a file, to a pipe (through a temporary file) and to a regular file on
+# standard output.
+if tar -cf - old.iconset | "$tools/createicns" -o tar-input.icns - &&
+   cmp -s tar-input.icns old.icns &&
+   tar -cf - old.iconset | "$tools/createicns" - | cat > piped.icns &&
+   cmp -s piped.icns old.icns &&
+   tar -cf - old.iconset | "$tools/createicns" - > redirected.icns &&
+   cmp -s redirected.icns old.icns; then
+  pass "tar input"
+else
+  fail "tar input"
+fi
+
+# Extracting a tar stream gives the iconset that readicns writes otherwise,
+# and the same .icns file always gives the same stream.
+cp old.icns extracted.icns
+mkdir untarred
+if "$tools/readicns" extracted.icns &&
+   "$tools/readicns" -t -o extracted.tar extracted.icns &&
+   "$tools/readicns" -t -o - extracted.icns > again.tar &&
+   cmp -s extracted.tar again.tar &&
+   (cd untarred && tar -xf ../extracted.tar) &&
+   diff -r extracted.iconset untarred/extracted.iconset >/dev/null; then
+  pass "tar output"
+else
+  fail "tar output"
+fi
+
+# Whether the .icns files $1 and $2 list the same icons, in any order.
+same_icons() {
+  "$tools/readicns" -l "$1" | sort > "$1.list" &&
+  "$tools/readicns" -l "$2" | sort > "$2.list" &&
+  cmp -s "$1.list" "$2.list"
+}
+
+# PNGs with other names get the types of their sizes.
+mkdir renamed.iconset
+cp old.iconset/icon_16x16.png renamed.iconset/small.png
+cp old.iconset/icon_32x32.png renamed.iconset/medium.png
+cp old.iconset/icon_128x128.png renamed.iconset/large.png
+if "$tools/createicns" -d renamed.iconset &&
+   same_icons renamed.icns old.icns; then
+  pass "detect types"
+else
+  fail "detect types"
+fi
+
+# Icons of unknown types get an extension from their data, which createicns
+# ignores when reading them back.
+"$tools/createicns" -l -o sniffed.icns old.iconset || exit 1
+cp sniffed.icns unsniffed.icns
+if "$tools/readicns" -s sniffed.icns &&
+   [ -f sniffed.iconset/icon_data_is32.rle ] &&
+   [ -f sniffed.iconset/icon_data_s8mk.mask ] &&
+   "$tools/createicns" -o resniffed.icns sniffed.iconset &&
+   same_icons resniffed.icns unsniffed.icns; then
+  pass "sniff"
+else
+  fail "sniff"
+fi
+
+# Icons with the same data are extracted once, cloned or hard linked, and
+# the iconset still gives the same icons.
+make_iconset dupe-source.iconset 0 32 256 || exit 1
+cp dupe-source.iconset/icon_256x256.png \
+  dupe-source.iconset/icon_128x128@2x.png
+"$tools/createicns" -o dupe.icns dupe-source.iconset || exit 1
+cp dupe.icns linked.icns
+if "$tools/readicns" -D dupe.icns &&
+   diff -r dupe-source.iconset dupe.iconset >/dev/null &&
+   "$tools/readicns" -Dlink linked.icns &&
+   [ linked.iconset/icon_256x256.png -ef \
+     linked.iconset/icon_128x128@2x.png ] &&
+   "$tools/createicns" -o relinked.icns linked.iconset &&
+   same_icons relinked.icns dupe.icns; then
+  pass "dedupe"
+else
+  fail "dedupe"
+fi
+
+# Icons in the store are kept once, and the manifest gives back the iconset.
+cp old.icns stored.icns
+mkdir restored.iconset
+if "$tools/readicns" -S store stored.icns &&
+   "$tools/readicns" -S store -o dupe.manifest dupe.icns &&
+   [ "$(find store -type f | wc -l)" -eq 4 ] &&
+   while read -r hash size name; do
+     cp "store/${hash%"${hash#??}"}/${hash#??}" "restored.iconset/$name"
+   done < stored.iconset.manifest &&
+   diff -r old.iconset restored.iconset >/dev/null; then
+  pass "store"
+else
+  fail "store"
+fi
+
+# A cache hit gives the same file as a fresh build.
+if "$tools/createicns" -c cache -o miss.icns old.iconset &&
+   "$tools/createicns" -c cache -o hit.icns old.iconset &&
+   [ "$(find cache -type f | wc -l)" -eq 1 ] &&
+   cmp -s miss.icns old.icns && cmp -s hit.icns old.icns; then
+  pass "cache"
+else
+  fail "cache"
+fi
+
+# Stripping a comment leaves the PNG as it was made without one.
+mkdir commented.iconset
+"$tools/tests/makepng" 32 0 commented.iconset/icon_32x32.png "A comment" ||
+  exit 1
+if "$tools/createicns" -s -o stripped.icns commented.iconset &&
+   "$tools/createicns" -o commented.icns commented.iconset &&
+   ! cmp -s stripped.icns commented.icns &&
+   "$tools/readicns" stripped.icns &&
+   cmp -s stripped.iconset/icon_32x32.png old.iconset/icon_32x32.png; then
+  pass "strip"
+else
+  fail "strip"
+fi
+
+# Verifying copies intact PNGs unchanged, and refuses a broken chunk.
+cp -R old.iconset corrupt.iconset
+printf 'x' | dd of=corrupt.iconset/icon_128x128.png bs=1 seek=60 \
+  conv=notrunc 2>/dev/null
+if "$tools/createicns" -V -o verified.icns old.iconset &&
+   cmp -s verified.icns old.icns &&
+   "$tools/createicns" -Vfull -o verified-full.icns old.iconset &&
+   cmp -s verified-full.icns old.icns &&
+   ! "$tools/createicns" -V -o corrupt.icns corrupt.iconset 2>/dev/null; then
+  pass "verify"
+else
+  fail "verify"
+fi
+
+# Extracts the icons of $1 as PAM files into $2.iconset, so that the pixels
+# can be compared whatever the PNG encoding.
+extract_pixels() {
+  cp "$1" "$2.icns" && "$tools/readicns" -P "$2.icns"
+}
+
+# Transforming with option $1 keeps every pixel, and never makes the file
+# larger.
+check_transform() {
+  name=transformed$1
+  if "$tools/createicns" "$1" -o "$name.icns" old.iconset &&
+     [ "$(wc -c < "$name.icns")" -le "$(wc -c < old.icns)" ] &&
+     extract_pixels "$name.icns" "$name-pixels" &&
+     diff -r png.iconset "$name-pixels.iconset" >/dev/null; then
+    pass "$1 keeps the pixels"
+  else
+    fail "$1 keeps the pixels"
+  fi
+}
+
+extract_pixels old.icns png || exit 1
+check_transform -z
+check_transform -zdeinterlace
+check_transform -R
+check_transform -Rz
+
+# An optimizer runs once per icon, its results are remembered, and output
+# that isn't a PNG is ignored.
+cat > count.sh <<END
+echo "\$1" >> "$work/optimized"
+END
+echo ': > "$1"' > truncate.sh
+if XDG_CACHE_HOME="$work/xdg" "$tools/createicns" -O "sh $work/count.sh" \
+     -o optimized.icns old.iconset &&
+   XDG_CACHE_HOME="$work/xdg" "$tools/createicns" -O "sh $work/count.sh" \
+     -o reoptimized.icns old.iconset &&
+   [ "$(wc -l < optimized)" -eq 3 ] &&
+   cmp -s optimized.icns old.icns && cmp -s reoptimized.icns old.icns &&
+   XDG_CACHE_HOME="$work/xdg" "$tools/createicns" -O "sh $work/truncate.sh" \
+     -o truncated.icns old.iconset 2>/dev/null &&
+   cmp -s truncated.icns old.icns; then
+  pass "optimize with a command"
+else
+  fail "optimize with a command"
+fi
+
+# The missing sizes are made at their size, and the largest icon is kept.
+make_iconset large.iconset 3 256 || exit 1
+if "$tools/createicns" -g -o generated.icns large.iconset &&
+   "$tools/createicns" -gbox -o boxed.icns large.iconset &&
+   [ "$("$tools/readicns" -l generated.icns | wc -l)" -eq 7 ] &&
+   [ "$("$tools/readicns" -l boxed.icns | wc -l)" -eq 7 ] &&
+   extract_pixels generated.icns generated-pixels &&
+   "$tools/readicns" generated.icns &&
+   cmp -s generated.iconset/icon_256x256.png large.iconset/icon_256x256.png
+then
+  sizes_match=true
+  for size in 16 32 64 128; do
+    pam=generated-pixels.iconset/icon_${size}x${size}.pam
+    [ "$(sed -n 's/^WIDTH //p' "$pam")" = "$size" ] || sizes_match=false
+  done
+  if $sizes_match; then
+    pass "generate"
+  else
+    fail "generate"
+  fi
+else
+  fail "generate"
+fi
+
+# Generated icons are reduced like the others.
+if "$tools/createicns" -g -R -o generated-reduced.icns large.iconset &&
+   [ "$(wc -c < generated-reduced.icns)" -lt "$(wc -c < generated.icns)" ] &&
+   extract_pixels generated-reduced.icns generated-reduced-pixels &&
+   diff -r generated-pixels.iconset generated-reduced-pixels.iconset \
+     >/dev/null; then
+  pass "generate and reduce"
+else
+  fail "generate and reduce"
+fi
+
+# Every legacy type is added, next to the PNG icons.
+if "$tools/createicns" -l -o legacy.icns old.iconset &&
+   [ "$("$tools/readicns" -l legacy.icns | cut -d' ' -f1 | sort |
+        tr '\n' ' ')" = \
+     "h8mk ic07 icp4 icp5 ih32 il32 is32 it32 l8mk s8mk t8mk " ]; then
+  pass "legacy types"
+else
+  fail "legacy types"
+fi
+
+# The legacy RLE icons and their masks decode to the pixels of the PNGs they
+# were made from. The PNGs are removed first, so that the decoded icons get
+# their names.
+if "$tools/createicns" -X icp4 legacy.icns &&
+   "$tools/createicns" -X icp5 legacy.icns &&
+   "$tools/createicns" -X ic07 legacy.icns &&
+   "$tools/readicns" -L -P legacy.icns &&
+   cmp -s legacy.iconset/icon_16x16.pam png.iconset/icon_16x16.pam &&
+   cmp -s legacy.iconset/icon_32x32.pam png.iconset/icon_32x32.pam &&
+   cmp -s legacy.iconset/icon_128x128.pam png.iconset/icon_128x128.pam; then
+  pass "legacy encode and decode"
+else
+  fail "legacy encode and decode"
+fi
+
+# The ARGB icons decode to the pixels of their PNGs as well.
+if "$tools/createicns" -a -o argb.icns old.iconset &&
+   "$tools/createicns" -X icp4 argb.icns &&
+   "$tools/createicns" -X icp5 argb.icns &&
+   "$tools/readicns" -L -P argb.icns &&
+   cmp -s argb.iconset/icon_16x16.pam png.iconset/icon_16x16.pam &&
+   cmp -s argb.iconset/icon_32x32.pam png.iconset/icon_32x32.pam; then
+  pass "ARGB encode and decode"
+else
+  fail "ARGB encode and decode"
+fi
+
+# Interlaced and 16-bit PNGs decode to 8-bit PAM files with the pixels they
+# round to.
+mkdir -p wide.iconset
+if "$tools/tests/makepng" -i -p interlaced.pam 32 3 \
+       wide.iconset/icon_32x32.png &&
+   "$tools/tests/makepng" -w -p 16-bit.pam 128 3 \
+       wide.iconset/icon_128x128.png &&
+   "$tools/tests/makepng" -i -w -p both.pam 256 3 \
+       wide.iconset/icon_256x256.png &&
+   "$tools/createicns" -o decoded.icns wide.iconset &&
+   "$tools/readicns" -P decoded.icns &&
+   head -n 5 decoded.iconset/icon_128x128.pam | tail -n 4 | tr '\n' ' ' |
+       grep -qx 'WIDTH 128 HEIGHT 128 DEPTH 4 MAXVAL 255 ' &&
+   cmp -s decoded.iconset/icon_32x32.pam interlaced.pam &&
+   cmp -s decoded.iconset/icon_128x128.pam 16-bit.pam &&
+   cmp -s decoded.iconset/icon_256x256.pam both.pam; then
+  pass "interlaced and 16-bit PNGs to PAM"
+else
+  fail "interlaced and 16-bit PNGs to PAM"
+fi
+
+# The .icns file is the same with other outputs, and the web PNGs are the
+# PNGs of the iconset.
+if "$tools/createicns" -I fan-out.ico -W web -o fan-out.icns old.iconset &&
+   cmp -s fan-out.icns old.icns &&
+   cmp -s web/icon-16x16.png old.iconset/icon_16x16.png &&
+   cmp -s web/icon-32x32.png old.iconset/icon_32x32.png &&
+   cmp -s web/icon-128x128.png old.iconset/icon_128x128.png; then
+  pass "ico and web outputs"
+else
+  fail "ico and web outputs"
+fi
+
+# An .ico file gives back the PNGs it was made from.
+if "$tools/createicns" -o from-ico.icns fan-out.ico &&
+   "$tools/readicns" from-ico.icns &&
+   diff -r old.iconset from-ico.iconset >/dev/null; then
+  pass "ico input"
+else
+  fail "ico input"
+fi
+
+# Profiles hold the icons of building an iconset with only their types.
+make_iconset small.iconset 0 16 32 || exit 1
+if "$tools/createicns" -p kept.icns:icp4,icp5 -p left-out.icns:-ic07 \
+     -o profiled.icns old.iconset &&
+   cmp -s profiled.icns old.icns &&
+   "$tools/createicns" small.iconset &&
+   same_icons kept.icns small.icns && same_icons left-out.icns small.icns
+then
+  pass "profiles"
+else
+  fail "profiles"
+fi
+
+# The embedded array is the .icns file, and the table points at the data of
+# its icons. Built with -DOBJECT, the program links against the object file
+# of --object instead of the C source.
+mkdir embed
+cat > dump.c <<'END'
+#include <stdio.h>
+
+#include "embed/app-icon.h"
+
+#ifdef OBJECT
+extern const unsigned char app_icon_icns_end[];
+#endif
+
+static uint32_t Load(const unsigned char* data) {
+  return (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+int main(int argc, char** argv) {
+#ifdef OBJECT
+  if (app_icon_icns_end - app_icon_icns != APP_ICON_ICNS_SIZE)
+    return 1;
+#endif
+  for (size_t i = 0; i < APP_ICON_ICON_COUNT; i++) {
+    const app_icon_icon* icon = &app_icon_icons[i];
+    if (Load(app_icon_icns + icon->offset - 8) != icon->type ||
+        Load(app_icon_icns + icon->offset - 4) != icon->size + 8)
+      return 1;
+  }
+  FILE* file = fopen(argv[1], "w");
+  return !file ||
+         fwrite(app_icon_icns, 1, APP_ICON_ICNS_SIZE, file) !=
+             APP_ICON_ICNS_SIZE ||
+         fclose(file) != 0;
+}
+END
+if "$tools/createicns" -E embed/app-icon -o embedded.icns old.iconset &&
+   ${CC:-cc} -o dump-embed dump.c embed/app-icon.c &&
+   ./dump-embed dumped-embed.icns && cmp -s dumped-embed.icns old.icns; then
+  pass "embed"
+else
+  fail "embed"
+fi
+
+# The object file links in place of the C source of --embed.
+case "$(uname -s)-$(uname -m)" in
+  Linux-x86_64|Linux-aarch64)
+    if "$tools/createicns" -b app-icon.o -o object.icns old.iconset &&
+       ${CC:-cc} -DOBJECT -o dump-object dump.c app-icon.o &&
+       ./dump-object dumped-object.icns &&
+       cmp -s dumped-object.icns old.icns; then
+      pass "object"
+    else
+      fail "object"
+    fi
+    ;;
+  *)
+    echo "SKIP: object, not an ELF machine createicns writes for"
+    ;;
+esac
+
+# diff then apply gives back the new file.
+make_iconset new.iconset 0 16 32 128 || exit 1
+"$tools/tests/makepng" 32 1 new.iconset/icon_32x32.png || exit 1
+"$tools/tests/makepng" 256 1 new.iconset/icon_256x256.png || exit 1
+"$tools/createicns" new.iconset || exit 1
+if "$tools/readicns" -d old.icns -o delta new.icns &&
+   "$tools/readicns" -a delta -o applied.icns old.icns &&
+   cmp -s applied.icns new.icns; then
+  pass "diff and apply"
+else
+  fail "diff and apply"
+fi
+
+# Applying in place replaces the old file, and keeps its mode.
+cp old.icns in-place.icns
+chmod 640 in-place.icns
+if "$tools/readicns" -a delta -o in-place.icns in-place.icns &&
+   cmp -s in-place.icns new.icns && ! [ -e in-place.icns.tmp ] &&
+   ls -l in-place.icns | grep -q '^-rw-r-----'; then
+  pass "apply in place"
+else
+  fail "apply in place"
+fi
+
+# A delta doesn't apply to another file.
+if "$tools/readicns" -a delta -o wrong.icns new.icns 2>/dev/null ||
+   [ -e wrong.icns ]; then
+  fail "apply to the wrong file"
+else
+  pass "apply to the wrong file"
+fi
+
+# Applying to standard output writes the new file, and only once it matches
+# the hash in the delta: a delta with the hash of the old file instead writes
+# nothing.
+cp delta bad-hash.delta
+dd if=delta of=bad-hash.delta bs=1 skip=8 seek=20 count=8 conv=notrunc \
+    2>/dev/null
+if "$tools/readicns" -a delta -o - old.icns > stdout.icns &&
+   cmp -s stdout.icns new.icns &&
+   ! "$tools/readicns" -a bad-hash.delta -o - old.icns > bad-hash.icns \
+       2>/dev/null &&
+   ! [ -s bad-hash.icns ]; then
+  pass "apply to standard output"
+else
+  fail "apply to standard output"
+fi
+
+# Deltas to and from a file with an empty icon apply like other deltas.
+mkdir emptied
+: > emptied/icon_32x32.png
+cp new.icns emptied.icns
+if "$tools/createicns" -U emptied/icon_32x32.png emptied.icns &&
+   "$tools/readicns" -d new.icns -o emptying.delta emptied.icns &&
+   "$tools/readicns" -a emptying.delta -o empty.icns new.icns &&
+   cmp -s empty.icns emptied.icns &&
+   "$tools/readicns" -d emptied.icns -o filling.delta new.icns &&
+   "$tools/readicns" -a filling.delta -o filled.icns emptied.icns &&
+   cmp -s filled.icns new.icns; then
+  pass "diff and apply an empty icon"
+else
+  fail "diff and apply an empty icon"
+fi
+
+# Updating and removing icons in place lists the same icons as building the
+# changed iconset.
+cp old.icns patched.icns
+cp -R old.iconset changed.iconset
+"$tools/tests/makepng" 32 2 changed.iconset/icon_32x32.png || exit 1
+"$tools/tests/makepng" 64 2 changed.iconset/icon_32x32@2x.png || exit 1
+rm changed.iconset/icon_16x16.png
+"$tools/createicns" changed.iconset || exit 1
+if "$tools/createicns" -U changed.iconset/icon_32x32.png patched.icns &&
+   "$tools/createicns" -U changed.iconset/icon_32x32@2x.png patched.icns &&
+   "$tools/createicns" -X icon_16x16.png patched.icns &&
+   same_icons patched.icns changed.icns &&
+   [ "$(wc -c < patched.icns)" -eq "$(wc -c < changed.icns)" ]; then
+  pass "update and remove, then list"
+else
+  fail "update and remove, then list"
+fi
+
+if [ "$failures" -ne 0 ]; then
+  echo "$failures test(s) failed"
+  exit 1
+fi
+echo "All tests passed"